@@ -618,6 +618,64 @@ proc mandel {xres yres infx infy supx supy} {
     }
 }
 
+### EXPRESSIONS ################################################################
+
+# Count the (a, b, c) triples for which the filter expression holds
+proc expr_int_filter {n} {
+    set lim 500
+    set count 0
+    for {set a 0} {$a < $n} {incr a} {
+        for {set b 0} {$b < $n} {incr b} {
+            set c [expr {($a ^ $b) % 7}]
+            if {$a*$b + $c > $lim && ($a & 1) == 0} {
+                incr count
+            }
+        }
+    }
+    return $count
+}
+
+# Evaluate a polynomial with Horner's rule at n points
+proc expr_float_poly {n} {
+    set sum 0.0
+    for {set i 0} {$i < $n} {incr i} {
+        set x [expr {$i / double($n)}]
+        set y [expr {((2.5 * $x - 1.25) * $x + 0.5) * $x - 3.0}]
+        set sum [expr {$sum + abs($y) / ($x + 1.0)}]
+    }
+    return $sum
+}
+
+# Mixed integer and floating point with comparisons and logical operators
+proc expr_mixed {n} {
+    set hits 0
+    for {set i 1} {$i <= $n} {incr i} {
+        set r [expr {$i * 0.75 - ($i / 3) + -$i % 5}]
+        if {($r > 10.0 || $i % 3 == 0) && !($r >= $n)} {
+            incr hits
+        }
+    }
+    return $hits
+}
+
+### AFTER TIMERS ###############################################################
+
+# Schedule n pending timers, then cancel them by id, every other one first
+proc after_timers {n} {
+    set ids {}
+    for {set i 0} {$i < $n} {incr i} {
+        lappend ids [after [expr {60000 + $i % 1000}] {}]
+    }
+    foreach {a b} $ids {
+        after cancel $a
+    }
+    foreach {a b} $ids {
+        if {$b ne ""} {
+            after cancel $b
+        }
+    }
+}
+
 ### RUN ALL ####################################################################
 
 # bench.tcl ?-batch? ?-time <ms>? ?version?
@@ -664,6 +722,10 @@ bench {listcreate} {listcreate 100}
 bench {expand} {expand}
 bench {wiki.tcl.tk/8566} {commonsub_test 10}
 bench {mandel} {mandel 30 30 -2 -1.5 1 1.5}
+bench {expr int filter} {expr_int_filter 40}
+bench {expr float poly} {expr_float_poly 500}
+bench {expr mixed} {expr_mixed 500}
+bench {after timers} {after_timers 100000}
 
 if {$batchmode} {
     if {$ver == ""} {
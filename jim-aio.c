@@ -47,6 +47,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #endif
 #ifdef HAVE_UTIL_H
 #include <util.h>
@@ -87,6 +90,9 @@
 #define AIO_CMD_LEN 32      /* e.g. aio.handleXXXXXX */
 #define AIO_DEFAULT_RBUF_LEN 256     /* read size for gets, read */
 #define AIO_DEFAULT_WBUF_LIMIT (64 * 1024)  /* max size of writebuf before flushing */
+#define AIO_COPY_RBUF_LEN (64 * 1024)   /* read size for large copies */
+#define AIO_MAX_RBUF_LEN (16 * 1024 * 1024) /* max readsize, keeps buffer sizes well within int */
+#define AIO_COPY_KERNEL_LEN (1024 * 1024 * 1024) /* max bytes per kernel copy call */
 
 #define AIO_KEEPOPEN 1  /* don't set O_CLOEXEC, don't close on command delete */
 #define AIO_NODELETE 2  /* don't delete AF_UNIX path on close */
@@ -171,6 +177,23 @@ static int JimReadableTimeout(int fd, long ms)
 
 struct AioFile;
 
+/**
+ * A byte buffer for buffered reads and writes.
+ * Data is consumed from the front by advancing 'start', so consuming part
+ * of the buffer never moves the rest of the data. The space is reclaimed
+ * when the buffer empties, or when more space is needed and at least half
+ * of the used space has been consumed.
+ * The data is always followed by a null terminator once allocated.
+ */
+typedef struct {
+    char *data;             /* NULL if not yet allocated */
+    int start;              /* offset of the first byte of data */
+    int len;                /* number of bytes of data */
+    int size;               /* allocated size, including space for the null terminator */
+} AioBuf;
+
+#define aio_buf_data(B) ((B)->data + (B)->start)
+
 typedef struct {
     int (*writer)(struct AioFile *af, const char *buf, int len);
     int (*reader)(struct AioFile *af, char *buf, int len, int pending);
@@ -190,14 +213,85 @@ typedef struct AioFile
     int addr_family;
     void *ssl;
     const JimAioFopsType *fops;
-    Jim_Obj *readbuf;       /* Contains any buffered read data. NULL if empty. refcount=0 */
-    Jim_Obj *writebuf;      /* Contains any buffered write data. refcount=1 */
-    char *rbuf;             /* Temporary read buffer (NULL if not yet allocated) */
-    size_t rbuf_len;        /* Length of rbuf */
+    AioBuf readbuf;         /* Contains any buffered read data */
+    AioBuf writebuf;        /* Contains any buffered write data */
+    int readsize;           /* Size of each read into readbuf */
     size_t wbuf_limit;      /* Max size of writebuf before flushing */
+    struct AioCopy *copy;   /* The background copyto using this channel, if any */
 } AioFile;
 
-static void aio_consume(Jim_Obj *objPtr, int n);
+/**
+ * Returns a pointer to space for at least n more bytes at the end of the buffer.
+ * Use aio_buf_added() to add any bytes stored there.
+ */
+static char *aio_buf_space(AioBuf *buf, int n)
+{
+    int needed = buf->len + n + 1;
+
+    if (buf->start + needed > buf->size) {
+        if (buf->start >= buf->len && needed <= buf->size) {
+            /* At least half the used space has been consumed, so move the data down.
+             * The cost of this is covered by the data consumed.
+             */
+            memmove(buf->data, aio_buf_data(buf), buf->len);
+            buf->start = 0;
+        }
+        else {
+            int size = buf->size * 2;
+
+            if (size < needed) {
+                size = needed;
+            }
+            if (buf->start) {
+                memmove(buf->data, aio_buf_data(buf), buf->len);
+                buf->start = 0;
+            }
+            buf->data = Jim_Realloc(buf->data, size);
+            buf->size = size;
+        }
+    }
+    return aio_buf_data(buf) + buf->len;
+}
+
+/* Adds the n bytes stored at aio_buf_space() to the buffer */
+static void aio_buf_added(AioBuf *buf, int n)
+{
+    buf->len += n;
+    aio_buf_data(buf)[buf->len] = 0;
+}
+
+static void aio_buf_append(AioBuf *buf, const char *str, int n)
+{
+    memcpy(aio_buf_space(buf, n), str, n);
+    aio_buf_added(buf, n);
+}
+
+/**
+ * Removes n bytes from the front of the buffer.
+ * n must be <= buf->len
+ */
+static void aio_consume(AioBuf *buf, int n)
+{
+    assert(n <= buf->len);
+
+    buf->len -= n;
+    if (buf->len) {
+        buf->start += n;
+    }
+    else {
+        buf->start = 0;
+    }
+}
+
+/* Frees the buffer if it is empty and has grown beyond maxsize */
+static void aio_buf_trim(AioBuf *buf, int maxsize)
+{
+    if (buf->len == 0 && buf->size > maxsize) {
+        Jim_Free(buf->data);
+        buf->data = NULL;
+        buf->size = 0;
+    }
+}
 
 static int stdio_writer(struct AioFile *af, const char *buf, int len)
 {
@@ -205,7 +299,7 @@ static int stdio_writer(struct AioFile *af, const char *buf, int len)
     if (ret < 0 && errno == EPIPE) {
         /* Also discard the write buffer since otherwise when
          * we try to flush on shutdown we may get SIGPIPE */
-        aio_consume(af->writebuf, Jim_Length(af->writebuf));
+        aio_consume(&af->writebuf, af->writebuf.len);
     }
     return ret;
 }
@@ -364,6 +458,9 @@ static int aio_start_nonblocking(AioFile *af)
 
 static int JimAioSubCmdProc(Jim_Interp *interp, int argc, Jim_Obj *const *argv);
 static void JimAioSetTaint(AioFile *af, int taintsource, int taintsink);
+#ifdef jim_ext_eventloop
+static void aio_copy_cancel(Jim_Interp *interp, struct AioCopy *copy);
+#endif
 static AioFile *JimMakeChannel(Jim_Interp *interp, int fd, Jim_Obj *filename,
     const char *hdlfmt, int family, int flags);
 
@@ -681,25 +778,6 @@ static int JimCheckStreamError(Jim_Interp *interp, AioFile *af)
     return ret;
 }
 
-/**
- * Removes n bytes from the beginning of objPtr.
- *
- * objPtr must have a string rep.
- * n must be <= bytelen(objPtr)
- */
-static void aio_consume(Jim_Obj *objPtr, int n)
-{
-    assert(objPtr->bytes);
-    assert(n <= objPtr->length);
-
-    /* Move the data down, plus 1 for the null terminator */
-    memmove(objPtr->bytes, objPtr->bytes + n, objPtr->length - n + 1);
-    objPtr->length -= n;
-    /* Note that we don't have to worry about utf8 len because the read and write
-     * buffers are used as pure byte buffers
-     */
-}
-
 /* forward declaration */
 static int aio_flush(Jim_Interp *interp, AioFile *af);
 
@@ -713,7 +791,7 @@ static int aio_autoflush(Jim_Interp *interp, void *clientData, int mask)
     AioFile *af = clientData;
 
     aio_flush(interp, af);
-    if (Jim_Length(af->writebuf) == 0) {
+    if (af->writebuf.len == 0) {
         /* Done, so remove the handler */
         return -1;
     }
@@ -734,13 +812,11 @@ static int aio_autoflush(Jim_Interp *interp, void *clientData, int mask)
  */
 static int aio_flush(Jim_Interp *interp, AioFile *af)
 {
-    int len;
-    const char *pt = Jim_GetString(af->writebuf, &len);
-    if (len) {
-        int ret = af->fops->writer(af, pt, len);
+    if (af->writebuf.len) {
+        int ret = af->fops->writer(af, aio_buf_data(&af->writebuf), af->writebuf.len);
         if (ret > 0) {
             /* Consume what we wrote */
-            aio_consume(af->writebuf, ret);
+            aio_consume(&af->writebuf, ret);
         }
         if (ret < 0) {
             return JimCheckStreamError(interp, af);
@@ -748,7 +824,7 @@ static int aio_flush(Jim_Interp *interp, AioFile *af)
         /* If not all data could be written, but with no error, and there is no writable
          * handler, we can try to auto-flush
          */
-        if (Jim_Length(af->writebuf)) {
+        if (af->writebuf.len) {
 #ifdef jim_ext_eventloop
             void *handler = Jim_FindFileHandler(interp, af->fd, JIM_EVENT_WRITABLE);
             if (handler == NULL) {
@@ -764,10 +840,79 @@ static int aio_flush(Jim_Interp *interp, AioFile *af)
             Jim_SetResultString(interp, "send buffer is full", -1);
             return JIM_ERR;
         }
+        /* Don't hang on to a write buffer that grew for a large write */
+        aio_buf_trim(&af->writebuf, af->wbuf_limit * 2 + 1);
     }
     return JIM_OK;
 }
 
+/**
+ * Called after data has been added to af->writebuf.
+ * Flushes the write buffer if required by the buffering mode.
+ * 'nl' is set if a line was completed, as for 'puts' without -nonewline.
+ * 'offset' is where the new data starts in af->writebuf. Only the new data needs
+ * to be checked for a newline since the buffer is flushed when one is added.
+ */
+static int aio_flush_buffered(Jim_Interp *interp, AioFile *af, int nl, int offset)
+{
+    int wnow = 0;
+
+    switch (af->wbuft) {
+        case WBUF_OPT_NONE:
+            /* Just write immediately */
+            wnow = 1;
+            break;
+
+        case WBUF_OPT_LINE:
+            /* Write everything if it contains a newline, or -nonewline wasn't given */
+            if (nl || memchr(aio_buf_data(&af->writebuf) + offset, '\n', af->writebuf.len - offset) != NULL) {
+                wnow = 1;
+            }
+            break;
+
+        case WBUF_OPT_FULL:
+            if (af->writebuf.len >= af->wbuf_limit) {
+                wnow = 1;
+            }
+            break;
+    }
+
+    if (wnow) {
+        return aio_flush(interp, af);
+    }
+    return JIM_OK;
+}
+
+/**
+ * Writes len bytes to the channel, subject to the buffering mode,
+ * as for 'puts -nonewline'.
+ *
+ * If nothing is buffered and the data would be flushed immediately anyway,
+ * it is written directly rather than being copied to af->writebuf first.
+ */
+static int aio_write(Jim_Interp *interp, AioFile *af, const char *buf, int len)
+{
+    int offset = af->writebuf.len;
+
+    if (offset == 0 && (af->wbuft == WBUF_OPT_NONE || (af->wbuft == WBUF_OPT_FULL && len >= af->wbuf_limit))) {
+        int ret = af->fops->writer(af, buf, len);
+        if (ret == len) {
+            return JIM_OK;
+        }
+        if (ret < 0) {
+            if (JimCheckStreamError(interp, af)) {
+                return JIM_ERR;
+            }
+            ret = 0;
+        }
+        /* Buffer the rest and let aio_flush() deal with it */
+        aio_buf_append(&af->writebuf, buf + ret, len - ret);
+        return aio_flush(interp, af);
+    }
+    aio_buf_append(&af->writebuf, buf, len);
+    return aio_flush_buffered(interp, af, 0, offset);
+}
+
 /**
  * Read until 'len' bytes are available in readbuf.
  *
@@ -782,12 +927,8 @@ static int aio_flush(Jim_Interp *interp, AioFile *af)
  */
 static int aio_read_len(Jim_Interp *interp, AioFile *af, unsigned flags, int neededLen)
 {
-    if (!af->readbuf) {
-        af->readbuf = Jim_NewStringObj(interp, NULL, 0);
-    }
-
     if (neededLen >= 0) {
-        neededLen -= Jim_Length(af->readbuf);
+        neededLen -= af->readbuf.len;
         if (neededLen <= 0) {
             return JIM_OK;
         }
@@ -798,20 +939,15 @@ static int aio_read_len(Jim_Interp *interp, AioFile *af, unsigned flags, int nee
         int readlen;
 
         if (neededLen == -1) {
-            readlen = af->rbuf_len;
+            readlen = af->readsize;
         }
         else {
-            readlen = (neededLen > af->rbuf_len ? af->rbuf_len : neededLen);
-        }
-        /* Allocate buffer if not already allocated */
-        if (!af->rbuf) {
-            af->rbuf = Jim_Alloc(af->rbuf_len);
+            readlen = (neededLen > af->readsize ? af->readsize : neededLen);
         }
-        retval = af->fops->reader(af, af->rbuf, readlen, flags & AIO_NONBLOCK);
+        /* Read directly into the end of the read buffer */
+        retval = af->fops->reader(af, aio_buf_space(&af->readbuf, readlen), readlen, flags & AIO_NONBLOCK);
         if (retval > 0) {
-            if (retval) {
-                Jim_AppendString(interp, af->readbuf, af->rbuf, retval);
-            }
+            aio_buf_added(&af->readbuf, retval);
             if (neededLen != -1) {
                 neededLen -= retval;
             }
@@ -830,29 +966,29 @@ static int aio_read_len(Jim_Interp *interp, AioFile *af, unsigned flags, int nee
 }
 
 /**
- * Consumes neededLen bytes from readbuf and those
+ * Consumes neededLen bytes from readbuf and returns those
  * bytes as a string object.
  *
  * If neededLen is -1, or >= len(readbuf), returns the entire readbuf.
- *
- * Returns NULL if no data available.
  */
 static Jim_Obj *aio_read_consume(Jim_Interp *interp, AioFile *af, int neededLen)
 {
-    Jim_Obj *objPtr = NULL;
+    AioBuf *buf = &af->readbuf;
+    Jim_Obj *objPtr;
 
-    if (neededLen < 0 || af->readbuf == NULL || Jim_Length(af->readbuf) <= neededLen) {
-        objPtr = af->readbuf;
-        af->readbuf = NULL;
+    if (neededLen < 0 || neededLen > buf->len) {
+        neededLen = buf->len;
     }
-    else if (af->readbuf) {
-        /* Need to consume part of the readbuf */
-        int len;
-        const char *pt = Jim_GetString(af->readbuf, &len);
-
-        objPtr  = Jim_NewStringObj(interp, pt, neededLen);
-        aio_consume(af->readbuf, neededLen);
+    if (neededLen && neededLen == buf->len && buf->start == 0 && neededLen >= buf->size / 2) {
+        /* The object can take over the buffer rather than copying it */
+        objPtr = Jim_NewStringObjNoAlloc(interp, buf->data, neededLen);
+        buf->data = NULL;
+        buf->len = buf->size = 0;
+        return objPtr;
     }
+    objPtr = Jim_NewStringObj(interp, aio_buf_data(buf), neededLen);
+    aio_consume(buf, neededLen);
+    aio_buf_trim(buf, (af->readsize + 1) * 4);
 
     return objPtr;
 }
@@ -863,9 +999,16 @@ static void JimAioDelProc(Jim_Interp *interp, void *privData)
 
     JIM_NOTUSED(interp);
 
+#ifdef jim_ext_eventloop
+    if (af->copy) {
+        /* Abandon the background copyto so that it no longer refers to this channel */
+        aio_copy_cancel(interp, af->copy);
+    }
+#endif
+
     /* Try to flush and write data before close */
     aio_flush(interp, af);
-    Jim_DecrRefCount(interp, af->writebuf);
+    Jim_Free(af->writebuf.data);
 
 #if UNIX_SOCKETS
     if (af->addr_family == PF_UNIX && (af->flags & AIO_NODELETE) == 0) {
@@ -895,11 +1038,7 @@ static void JimAioDelProc(Jim_Interp *interp, void *privData)
     if (!(af->flags & AIO_KEEPOPEN)) {
         close(af->fd);
     }
-    if (af->readbuf) {
-        Jim_FreeNewObj(interp, af->readbuf);
-    }
-
-    Jim_Free(af->rbuf);
+    Jim_Free(af->readbuf.data);
     Jim_Free(af);
 }
 
@@ -973,16 +1112,30 @@ static int aio_cmd_read(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
     return JIM_OK;
 }
 
+/**
+ * Returns the AioFile for the channel command, or NULL if
+ * the command is not a native channel.
+ */
+static AioFile *JimAioGetFile(Jim_Interp *interp, Jim_Obj *command)
+{
+    Jim_Cmd *cmdPtr = Jim_GetCommand(interp, command, JIM_NONE);
+
+    /* XXX: There ought to be a supported API for this */
+    if (cmdPtr && !(cmdPtr->flags & JIM_CMD_ISPROC) && cmdPtr->u.native.cmdProc == JimAioSubCmdProc) {
+        return (AioFile *) cmdPtr->u.native.privData;
+    }
+    return NULL;
+}
+
 /* Use 'name getfd' to get the file descriptor associated with channel 'name'
  * Currently this is only used by 'info channels'. Is there a better way?
  */
 int Jim_AioFilehandle(Jim_Interp *interp, Jim_Obj *command)
 {
-    Jim_Cmd *cmdPtr = Jim_GetCommand(interp, command, JIM_ERRMSG);
+    AioFile *af = JimAioGetFile(interp, command);
 
-    /* XXX: There ought to be a supported API for this */
-    if (cmdPtr && !(cmdPtr->flags & JIM_CMD_ISPROC) && cmdPtr->u.native.cmdProc == JimAioSubCmdProc) {
-        return ((AioFile *) cmdPtr->u.native.privData)->fd;
+    if (af) {
+        return af->fd;
     }
     Jim_SetResultFormatted(interp, "Not a filehandle: \"%#s\"", command);
     return -1;
@@ -1024,26 +1177,322 @@ static int aio_cmd_gettaint(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
     return JIM_OK;
 }
 
-static int aio_cmd_copy(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE) || defined(HAVE_SPLICE)
+#define HAVE_KERNEL_COPY
+
+/* Returns 1 if errno indicates that a kernel copy isn't supported between these file descriptors */
+static int aio_copy_unsupported(void)
 {
-    AioFile *af = Jim_CmdPrivData(interp);
-    jim_wide count = 0;
-    jim_wide maxlen = JIM_WIDE_MAX;
-    int ok = 1;
-    Jim_Obj *objv[4];
-    long taintsink;
+    switch (errno) {
+        case EINVAL:
+        case ENOSYS:
+        case EBADF:
+#ifdef EXDEV
+        case EXDEV:
+#endif
+#ifdef EOPNOTSUPP
+        case EOPNOTSUPP:
+#endif
+            return 1;
+    }
+    return 0;
+}
 
-    if (argc == 2) {
-        if (Jim_GetWide(interp, argv[1], &maxlen) != JIM_OK) {
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t aio_copy_file_range(int in, int out, size_t len)
+{
+    return copy_file_range(in, NULL, out, NULL, len, 0);
+}
+#endif
+
+#ifdef HAVE_SENDFILE
+static ssize_t aio_sendfile(int in, int out, size_t len)
+{
+    return sendfile(out, in, NULL, len);
+}
+#endif
+
+#ifdef HAVE_SPLICE
+static ssize_t aio_splice(int in, int out, size_t len)
+{
+    return splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+}
+#endif
+
+/**
+ * Copies from src to dst with the given kernel copy function until eof or
+ * maxlen bytes have been copied in total, adding the number of bytes copied to *count.
+ *
+ * Returns JIM_OK when done, JIM_ERR on error (with errno set) or JIM_CONTINUE if
+ * the copy function isn't supported for these file descriptors.
+ */
+static int aio_copy_kernel_with(ssize_t (*copier)(int in, int out, size_t len),
+    AioFile *src, AioFile *dst, jim_wide maxlen, jim_wide *count)
+{
+    jim_wide copied = 0;
+
+    while (*count < maxlen) {
+        jim_wide len = maxlen - *count;
+        ssize_t ret;
+
+        if (len > AIO_COPY_KERNEL_LEN) {
+            len = AIO_COPY_KERNEL_LEN;
+        }
+        ret = copier(src->fd, dst->fd, len);
+        if (ret > 0) {
+            copied += ret;
+            *count += ret;
+        }
+        else if (ret == 0) {
+            if (copied == 0) {
+                /* Some special files (e.g. in /proc) claim to be empty,
+                 * so let read() decide whether this is really eof
+                 */
+                return JIM_CONTINUE;
+            }
+            src->flags |= AIO_EOF;
+            break;
+        }
+        else if (errno != EINTR) {
+            return aio_copy_unsupported() ? JIM_CONTINUE : JIM_ERR;
+        }
+    }
+    return JIM_OK;
+}
+
+#ifdef HAVE_SPLICE
+/**
+ * Moves 'len' bytes from the pipe 'fd' to dst with read() and write(),
+ * for when they can't be spliced to dst, adding the number of bytes written to *count.
+ *
+ * Returns 0 if ok or -1 on error (with errno set).
+ */
+static int aio_drain_pipe(int fd, AioFile *dst, ssize_t len, jim_wide *count)
+{
+    char buf[4096];
+
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len < (ssize_t)sizeof(buf) ? len : (ssize_t)sizeof(buf));
+        char *p = buf;
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        len -= n;
+        while (n > 0) {
+            ssize_t out = write(dst->fd, p, n);
+            if (out < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            p += out;
+            n -= out;
+            *count += out;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Like aio_copy_kernel_with() but splices from src to dst via a pipe,
+ * for when neither is a pipe.
+ */
+static int aio_copy_splice_pipe(AioFile *src, AioFile *dst, jim_wide maxlen, jim_wide *count)
+{
+    int p[2];
+    int rc = JIM_OK;
+    int err;
+
+    if (pipe(p) != 0) {
+        return JIM_CONTINUE;
+    }
+    while (*count < maxlen) {
+        jim_wide len = maxlen - *count;
+        ssize_t in;
+
+        if (len > AIO_COPY_KERNEL_LEN) {
+            len = AIO_COPY_KERNEL_LEN;
+        }
+        in = splice(src->fd, NULL, p[1], NULL, len, SPLICE_F_MOVE);
+        if (in == 0) {
+            src->flags |= AIO_EOF;
+            break;
+        }
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = aio_copy_unsupported() ? JIM_CONTINUE : JIM_ERR;
+            break;
+        }
+        /* Now move everything in the pipe to the destination */
+        while (in > 0) {
+            ssize_t out = splice(p[0], NULL, dst->fd, NULL, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                /* e.g. dst doesn't support splice. The data is already out of src,
+                 * so write what is in the pipe and leave the rest to the caller,
+                 * which reports any error that persists.
+                 */
+                rc = aio_drain_pipe(p[0], dst, in, count) == 0 ? JIM_CONTINUE : JIM_ERR;
+                goto done;
+            }
+            in -= out;
+            *count += out;
+        }
+    }
+done:
+    err = errno;
+    close(p[0]);
+    close(p[1]);
+    errno = err;
+    return rc;
+}
+#endif
+
+/**
+ * Copies up to maxlen bytes in total from src to dst without copying through user space,
+ * adding the number of bytes copied to *count.
+ * Both must be blocking, unbuffered plain file descriptors.
+ *
+ * Uses copy_file_range() between files, sendfile() from a file, and splice() otherwise.
+ *
+ * Returns JIM_OK when done, JIM_ERR on error (with errno set) or JIM_CONTINUE
+ * if the remainder (if any) needs to be copied by the caller.
+ */
+static int aio_copy_kernel(AioFile *src, AioFile *dst, jim_wide maxlen, jim_wide *count)
+{
+    struct stat srcsb, dstsb;
+    int rc = JIM_CONTINUE;
+
+    if (fstat(src->fd, &srcsb) != 0 || fstat(dst->fd, &dstsb) != 0) {
+        return JIM_CONTINUE;
+    }
+#ifdef HAVE_COPY_FILE_RANGE
+    if (S_ISREG(srcsb.st_mode) && S_ISREG(dstsb.st_mode)) {
+        rc = aio_copy_kernel_with(aio_copy_file_range, src, dst, maxlen, count);
+    }
+#endif
+#ifdef HAVE_SENDFILE
+    if (rc == JIM_CONTINUE && S_ISREG(srcsb.st_mode)) {
+        rc = aio_copy_kernel_with(aio_sendfile, src, dst, maxlen, count);
+    }
+#endif
+#ifdef HAVE_SPLICE
+    if (rc == JIM_CONTINUE) {
+        if (S_ISFIFO(srcsb.st_mode) || S_ISFIFO(dstsb.st_mode)) {
+            rc = aio_copy_kernel_with(aio_splice, src, dst, maxlen, count);
+        }
+        else if (S_ISSOCK(srcsb.st_mode) && (S_ISSOCK(dstsb.st_mode) || S_ISREG(dstsb.st_mode))) {
+            rc = aio_copy_splice_pipe(src, dst, maxlen, count);
+        }
+    }
+#endif
+    return rc;
+}
+#endif /* HAVE_KERNEL_COPY */
+
+/**
+ * Copies up to maxlen bytes from af to the native channel dst, returning
+ * the number of bytes copied in *count.
+ */
+static int aio_copy_to_channel(Jim_Interp *interp, AioFile *af, AioFile *dst, jim_wide maxlen, jim_wide *count)
+{
+    /* Any buffered read data comes first */
+    if (af->readbuf.len) {
+        int len = af->readbuf.len;
+
+        if (len > maxlen) {
+            len = maxlen;
+        }
+        if (aio_write(interp, dst, aio_buf_data(&af->readbuf), len) != JIM_OK) {
             return JIM_ERR;
         }
+        aio_consume(&af->readbuf, len);
+        *count += len;
     }
 
-    objv[0] = argv[0];
+#ifdef HAVE_KERNEL_COPY
+    if (*count < maxlen && af->fops == &stdio_fops && dst->fops == &stdio_fops &&
+        af->timeout == 0 && !((af->flags | dst->flags) & AIO_NONBLOCK)) {
+        /* Flush the destination and if that succeeds, let the kernel do the work */
+        if (aio_flush(interp, dst) != JIM_OK) {
+            return JIM_ERR;
+        }
+        if (dst->writebuf.len == 0) {
+            int rc = aio_copy_kernel(af, dst, maxlen, count);
+            if (rc == JIM_ERR) {
+                JimAioSetError(interp, NULL);
+                return JIM_ERR;
+            }
+            if (rc == JIM_OK) {
+                return JIM_OK;
+            }
+        }
+    }
+#endif
+
+    /* Otherwise copy through af->readbuf (which is now empty) without creating objects */
+    while (*count < maxlen && !aio_eof(af)) {
+        jim_wide len = maxlen - *count;
+        int readlen = af->readsize;
+        int retval;
+
+        if (*count >= 16384 && readlen < AIO_COPY_RBUF_LEN) {
+            /* Heuristic check - for large copy speed-up */
+            readlen = AIO_COPY_RBUF_LEN;
+        }
+        if (len > readlen) {
+            len = readlen;
+        }
+        retval = af->fops->reader(af, aio_buf_space(&af->readbuf, len), len, 0);
+        if (retval > 0) {
+            int ret;
+
+            aio_buf_added(&af->readbuf, retval);
+            ret = aio_write(interp, dst, aio_buf_data(&af->readbuf), retval);
+            aio_consume(&af->readbuf, retval);
+            if (ret != JIM_OK) {
+                return JIM_ERR;
+            }
+            /* Only count what was written */
+            *count += retval;
+            continue;
+        }
+        if (JimCheckStreamError(interp, af)) {
+            return JIM_ERR;
+        }
+        if (!aio_eof(af)) {
+            /* No data available on a nonblocking channel, or timed out */
+            break;
+        }
+    }
+    aio_buf_trim(&af->readbuf, (af->readsize + 1) * 4);
+    return JIM_OK;
+}
+
+/**
+ * Copies up to maxlen bytes from af to a channel that isn't a native
+ * channel (e.g. from popen) via 'puts', returning the number of bytes copied in *count.
+ */
+static int aio_copy_to_command(Jim_Interp *interp, AioFile *af, Jim_Obj *dstObj, jim_wide maxlen, jim_wide *count)
+{
+    int ok = 1;
+    Jim_Obj *objv[4];
+    long taintsink;
+
+    objv[0] = dstObj;
     objv[1] = Jim_NewStringObj(interp, "gettaint", -1);
     objv[2] = Jim_NewStringObj(interp, "-sink", -1);
     if (Jim_EvalObjVector(interp, 3, objv) != JIM_OK || Jim_GetLong(interp, Jim_GetResult(interp), &taintsink) != JIM_OK) {
-        Jim_SetResultFormatted(interp, "Not a filehandle: \"%#s\"", argv[0]);
+        Jim_SetResultFormatted(interp, "Not a filehandle: \"%#s\"", dstObj);
         return JIM_ERR;
     }
 
@@ -1056,49 +1505,322 @@ static int aio_cmd_copy(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
      * but more likely because the target isn't a filehandle.
      * Should use use getfd to test for that case instead?
      */
-    objv[0] = argv[0];
+    objv[0] = dstObj;
     objv[1] = Jim_NewStringObj(interp, "flush", -1);
     if (Jim_EvalObjVector(interp, 2, objv) != JIM_OK) {
-        Jim_SetResultFormatted(interp, "Not a filehandle: \"%#s\"", argv[0]);
+        Jim_SetResultFormatted(interp, "Not a filehandle: \"%#s\"", dstObj);
         return JIM_ERR;
     }
 
     /* Now prep for puts -nonewline. It's a shame we don't simply have 'write' */
-    objv[0] = argv[0];
+    objv[0] = dstObj;
     objv[1] = Jim_NewStringObj(interp, "puts", -1);
     objv[2] = Jim_NewStringObj(interp, "-nonewline", -1);
     Jim_IncrRefCount(objv[1]);
     Jim_IncrRefCount(objv[2]);
 
-    while (count < maxlen) {
-        jim_wide len = maxlen - count;
-        if (len > af->rbuf_len) {
-            len = af->rbuf_len;
+    while (*count < maxlen) {
+        jim_wide len = maxlen - *count;
+        if (len > af->readsize) {
+            len = af->readsize;
         }
         if (aio_read_len(interp, af, 0, len) != JIM_OK) {
             ok = 0;
             break;
         }
         objv[3] = aio_read_consume(interp, af, len);
-        count += Jim_Length(objv[3]);
+        len = Jim_Length(objv[3]);
         if (Jim_EvalObjVector(interp, 4, objv) != JIM_OK) {
             ok = 0;
             break;
         }
+        *count += len;
         if (aio_eof(af)) {
             break;
         }
-        if (count >= 16384 && af->rbuf_len < 65536) {
+        if (*count >= 16384 && af->readsize < AIO_COPY_RBUF_LEN) {
             /* Heuristic check - for large copy speed-up */
-            af->rbuf_len = 65536;
-            af->rbuf = Jim_Realloc(af->rbuf, af->rbuf_len);
+            af->readsize = AIO_COPY_RBUF_LEN;
         }
     }
 
     Jim_DecrRefCount(interp, objv[1]);
     Jim_DecrRefCount(interp, objv[2]);
 
-    if (!ok) {
+    return ok ? JIM_OK : JIM_ERR;
+}
+
+#ifdef jim_ext_eventloop
+/**
+ * A background copyto -command.
+ *
+ * Data is read from src into src->readbuf and written from there to dst.
+ * Only one handler is installed at a time: readable on src while there is nothing
+ * to write, otherwise writable on dst until everything has been written. So reading
+ * stops while dst can't keep up.
+ *
+ * Both channels point to the copy via af->copy, so closing either channel
+ * cancels the copy (see JimAioDelProc()).
+ */
+typedef struct AioCopy {
+    AioFile *src;           /* The source channel */
+    AioFile *dst;           /* The destination channel */
+    Jim_Obj *command;       /* Called as: command count ?error? */
+    jim_wide maxlen;        /* Max bytes to copy */
+    jim_wide count;         /* Bytes written so far */
+    int fd;                 /* The fd of the installed handler */
+    int mask;               /* The mask of the installed handler, or 0 if none */
+    int srcnb;              /* The original nonblocking mode of the source */
+    int dstnb;              /* The original nonblocking mode of the destination */
+} AioCopy;
+
+static int aio_copy_event(Jim_Interp *interp, void *clientData, int mask);
+static void aio_copy_finalizer(Jim_Interp *interp, void *clientData);
+
+/* Installs the handler for the given mask in place of the current handler (if different) */
+static void aio_copy_wait(Jim_Interp *interp, AioCopy *copy, int fd, int mask)
+{
+    if (copy->mask != mask || copy->fd != fd) {
+        if (copy->mask) {
+            /* Clear the mask first so that the finalizer knows this is expected */
+            int oldmask = copy->mask;
+            copy->mask = 0;
+            Jim_DeleteFileHandler(interp, copy->fd, oldmask);
+        }
+        if (mask) {
+            Jim_CreateFileHandler(interp, fd, mask, aio_copy_event, copy, aio_copy_finalizer);
+        }
+        copy->fd = fd;
+        copy->mask = mask;
+    }
+}
+
+/* Detaches the copy from both channels, restores their modes and frees it */
+static void aio_copy_free(Jim_Interp *interp, AioCopy *copy)
+{
+    copy->src->copy = NULL;
+    copy->dst->copy = NULL;
+    aio_set_nonblocking(copy->src, copy->srcnb);
+    aio_set_nonblocking(copy->dst, copy->dstnb);
+    Jim_DecrRefCount(interp, copy->command);
+    Jim_Free(copy);
+}
+
+static void aio_copy_done(Jim_Interp *interp, AioCopy *copy, Jim_Obj *errObj);
+
+/**
+ * Called when a copy handler is removed.
+ * If this wasn't done by the copy itself (e.g. the handler was replaced or
+ * removed on error), the copy can't continue, so finish it with an error.
+ */
+static void aio_copy_finalizer(Jim_Interp *interp, void *clientData)
+{
+    AioCopy *copy = clientData;
+
+    if (copy->mask) {
+        AioFile *af = copy->fd == copy->src->fd ? copy->src : copy->dst;
+
+        copy->mask = 0;
+        Jim_SetResultFormatted(interp, "%#s: copy handler was removed", af->filename);
+        aio_copy_done(interp, copy, Jim_GetResult(interp));
+    }
+}
+
+/* Abandons the copy without calling the callback, as when either channel is closed */
+static void aio_copy_cancel(Jim_Interp *interp, AioCopy *copy)
+{
+    aio_copy_wait(interp, copy, -1, 0);
+    aio_copy_free(interp, copy);
+}
+
+/* Finishes the copy and calls the callback with the count and the error message, if any */
+static void aio_copy_done(Jim_Interp *interp, AioCopy *copy, Jim_Obj *errObj)
+{
+    Jim_Obj *scriptObj = Jim_DuplicateObj(interp, copy->command);
+
+    Jim_ListAppendElement(interp, scriptObj, Jim_NewWideObj(interp, copy->count));
+    if (errObj) {
+        Jim_ListAppendElement(interp, scriptObj, errObj);
+    }
+    Jim_IncrRefCount(scriptObj);
+
+    aio_copy_cancel(interp, copy);
+
+    Jim_EvalObjBackground(interp, scriptObj);
+    Jim_DecrRefCount(interp, scriptObj);
+}
+
+/* Returns an error message object for the last operation on the channel */
+static Jim_Obj *aio_copy_error(Jim_Interp *interp, AioFile *af)
+{
+    Jim_SetResultFormatted(interp, "%#s: %s", af->filename, af->fops->strerror(af));
+    return Jim_GetResult(interp);
+}
+
+/**
+ * Handler for the background copy.
+ * Reads if readable, then writes as much as possible and decides what to wait for next.
+ */
+static int aio_copy_event(Jim_Interp *interp, void *clientData, int mask)
+{
+    AioCopy *copy = clientData;
+    AioFile *src = copy->src;
+    AioFile *dst = copy->dst;
+
+    if (mask & JIM_EVENT_READABLE) {
+        jim_wide len = copy->maxlen - copy->count - src->readbuf.len;
+        int readlen = src->readsize < AIO_COPY_RBUF_LEN ? AIO_COPY_RBUF_LEN : src->readsize;
+
+        if (len > readlen) {
+            len = readlen;
+        }
+        if (len > 0) {
+            int ret = src->fops->reader(src, aio_buf_space(&src->readbuf, len), len, 1);
+            if (ret > 0) {
+                aio_buf_added(&src->readbuf, ret);
+            }
+            else if (!aio_eof(src) && src->fops->error(src)) {
+                aio_copy_done(interp, copy, aio_copy_error(interp, src));
+                return JIM_OK;
+            }
+            /* Otherwise this is eof or there was nothing to read after all */
+        }
+    }
+
+    /* Write any data previously buffered for dst first, then the copied data */
+    while (dst->writebuf.len || src->readbuf.len) {
+        AioBuf *buf = dst->writebuf.len ? &dst->writebuf : &src->readbuf;
+        int ret = dst->fops->writer(dst, aio_buf_data(buf), buf->len);
+
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                /* Wait until dst is writable */
+                break;
+            }
+            aio_copy_done(interp, copy, aio_copy_error(interp, dst));
+            return JIM_OK;
+        }
+        aio_consume(buf, ret);
+        if (buf == &src->readbuf) {
+            copy->count += ret;
+        }
+    }
+
+    if (dst->writebuf.len || src->readbuf.len) {
+        aio_copy_wait(interp, copy, dst->fd, JIM_EVENT_WRITABLE);
+    }
+    else if (copy->count >= copy->maxlen || aio_eof(src)) {
+        aio_copy_done(interp, copy, NULL);
+    }
+    else {
+        aio_copy_wait(interp, copy, src->fd, JIM_EVENT_READABLE);
+    }
+    return JIM_OK;
+}
+
+/**
+ * Starts a background copy from af to dst, calling commandObj when done.
+ * The callback is always called from the event loop, never from here.
+ */
+static int aio_copy_background(Jim_Interp *interp, AioFile *af, AioFile *dst, jim_wide maxlen, Jim_Obj *commandObj)
+{
+    AioCopy *copy;
+    void *handler;
+
+    if (Jim_FindFileHandler(interp, af->fd, JIM_EVENT_READABLE)) {
+        Jim_SetResultFormatted(interp, "%#s: channel is busy", af->filename);
+        return JIM_ERR;
+    }
+    handler = Jim_FindFileHandler(interp, dst->fd, JIM_EVENT_WRITABLE);
+    if (handler == dst) {
+        /* The copy takes over flushing the write buffer from aio_autoflush() */
+        Jim_DeleteFileHandler(interp, dst->fd, JIM_EVENT_WRITABLE);
+    }
+    else if (handler) {
+        Jim_SetResultFormatted(interp, "%#s: channel is busy", dst->filename);
+        return JIM_ERR;
+    }
+
+    copy = Jim_Alloc(sizeof(*copy));
+    memset(copy, 0, sizeof(*copy));
+    copy->src = af;
+    copy->dst = dst;
+    copy->command = commandObj;
+    Jim_IncrRefCount(commandObj);
+    copy->maxlen = maxlen;
+    copy->fd = -1;
+
+    af->copy = copy;
+    dst->copy = copy;
+    copy->srcnb = !!(af->flags & AIO_NONBLOCK);
+    copy->dstnb = !!(dst->flags & AIO_NONBLOCK);
+    aio_set_nonblocking(af, 1);
+    aio_set_nonblocking(dst, 1);
+
+    if (af->readbuf.len || dst->writebuf.len || aio_eof(af) || maxlen <= 0) {
+        /* Something to write, or nothing to read */
+        aio_copy_wait(interp, copy, dst->fd, JIM_EVENT_WRITABLE);
+    }
+    else {
+        aio_copy_wait(interp, copy, af->fd, JIM_EVENT_READABLE);
+    }
+    return JIM_OK;
+}
+#endif
+
+static int aio_cmd_copy(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+{
+    AioFile *af = Jim_CmdPrivData(interp);
+    AioFile *dst;
+    jim_wide count = 0;
+    jim_wide maxlen = JIM_WIDE_MAX;
+    Jim_Obj *commandObj = NULL;
+    int ret;
+
+    if (argc == 2 || argc == 4) {
+        if (Jim_GetWide(interp, argv[1], &maxlen) != JIM_OK) {
+            return JIM_ERR;
+        }
+    }
+    if (argc >= 3) {
+        if (!Jim_CompareStringImmediate(interp, argv[argc - 2], "-command")) {
+            return JIM_USAGE;
+        }
+        commandObj = argv[argc - 1];
+    }
+
+    dst = JimAioGetFile(interp, argv[0]);
+    if (af->copy || (dst && dst->copy)) {
+        Jim_SetResultFormatted(interp, "%#s: channel is busy", af->copy ? af->filename : dst->filename);
+        return JIM_ERR;
+    }
+    if (commandObj) {
+#ifdef jim_ext_eventloop
+        if (!dst) {
+            Jim_SetResultFormatted(interp, "Not a filehandle: \"%#s\"", argv[0]);
+            return JIM_ERR;
+        }
+        if (af->taintsource & dst->taintsink) {
+            Jim_SetResultString(interp, "copying tainted source", -1);
+            return JIM_ERR;
+        }
+        return aio_copy_background(interp, af, dst, maxlen, commandObj);
+#else
+        Jim_SetResultString(interp, "-command requires the eventloop", -1);
+        return JIM_ERR;
+#endif
+    }
+    if (dst) {
+        if (af->taintsource & dst->taintsink) {
+            Jim_SetResultString(interp, "copying tainted source", -1);
+            return JIM_ERR;
+        }
+        ret = aio_copy_to_channel(interp, af, dst, maxlen, &count);
+    }
+    else {
+        ret = aio_copy_to_command(interp, af, argv[0], maxlen, &count);
+    }
+    if (ret != JIM_OK) {
         return JIM_ERR;
     }
 
@@ -1171,17 +1893,22 @@ static int aio_cmd_gets(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
     }
 
     while (!aio_eof(af)) {
-        if (af->readbuf) {
-            const char *pt = Jim_GetString(af->readbuf, &len);
+        if (af->readbuf.len) {
+            const char *pt = aio_buf_data(&af->readbuf);
+            len = af->readbuf.len;
             nl = jim_strstr(pt + offset, len - offset, nlstr, nlstrlen);
             if (nl) {
                 /* got a line */
                 objPtr = Jim_NewStringObj(interp, pt, nl - pt + (keepnl ? nlstrlen : 0));
                 /* And consume it plus the eol */
-                aio_consume(af->readbuf, nl - pt + nlstrlen);
+                aio_consume(&af->readbuf, nl - pt + nlstrlen);
                 break;
             }
-            offset = len;
+            /* Next time, search from where the eol could start in the new data */
+            offset = len - nlstrlen + 1;
+            if (offset < 0) {
+                offset = 0;
+            }
         }
 
         /* Not got a line yet, so read more */
@@ -1192,10 +1919,9 @@ static int aio_cmd_gets(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 
     aio_set_nonblocking(af, nb);
 
-    if (!nl && aio_eof(af) && af->readbuf) {
+    if (!nl && aio_eof(af) && af->readbuf.len) {
         /* Just take what we have as the line */
-        objPtr = af->readbuf;
-        af->readbuf = NULL;
+        objPtr = aio_read_consume(interp, af, -1);
     }
     else if (!objPtr) {
         objPtr = Jim_NewStringObj(interp, NULL, 0);
@@ -1221,14 +1947,19 @@ static int aio_cmd_gets(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
     return JIM_OK;
 }
 
+/* Jim_StringChunkProc to append each piece of a string to a buffer */
+static int aio_buf_append_chunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    aio_buf_append(privData, str, len);
+    return JIM_OK;
+}
+
 static int aio_cmd_puts(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
     AioFile *af = Jim_CmdPrivData(interp);
-    int wlen;
-    const char *wdata;
     Jim_Obj *strObj;
-    int wnow = 0;
     int nl = 1;
+    int offset;
 
     if (Jim_CheckTaint(interp, af->taintsink)) {
         Jim_SetResultString(interp, "puts: tainted data", -1);
@@ -1249,46 +1980,14 @@ static int aio_cmd_puts(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
     /* Keep it simple and always go via the writebuf instead of trying to optimise
      * the case that we can write immediately
      */
-#ifdef JIM_MAINTAINER
-    if (Jim_IsShared(af->writebuf)) {
-        /* This should generally never happen since this object isn't accessible,
-         * but it is possible with 'debug objects' */
-        Jim_DecrRefCount(interp, af->writebuf);
-        af->writebuf = Jim_DuplicateObj(interp, af->writebuf);
-        Jim_IncrRefCount(af->writebuf);
-    }
-#endif
-    Jim_AppendObj(interp, af->writebuf, strObj);
+    offset = af->writebuf.len;
+    /* Long strings may be built from pieces, so append them a piece at a time */
+    Jim_StringForeachChunk(interp, strObj, aio_buf_append_chunk, &af->writebuf);
     if (nl) {
-        Jim_AppendString(interp, af->writebuf, "\n", 1);
-    }
-
-    /* Now do we need to flush? */
-    wdata = Jim_GetString(af->writebuf, &wlen);
-    switch (af->wbuft) {
-        case WBUF_OPT_NONE:
-            /* Just write immediately */
-            wnow = 1;
-            break;
-
-        case WBUF_OPT_LINE:
-            /* Write everything if it contains a newline, or -nonewline wasn't given */
-            if (nl || memchr(wdata, '\n', wlen) != NULL) {
-                wnow = 1;
-            }
-            break;
-
-        case WBUF_OPT_FULL:
-            if (wlen >= af->wbuf_limit) {
-                wnow = 1;
-            }
-            break;
+        aio_buf_append(&af->writebuf, "\n", 1);
     }
 
-    if (wnow) {
-        return aio_flush(interp, af);
-    }
-    return JIM_OK;
+    return aio_flush_buffered(interp, af, nl, offset);
 }
 
 static int aio_cmd_isatty(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
@@ -1548,10 +2247,8 @@ static int aio_cmd_seek(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
         JimAioSetError(interp, af->filename);
         return JIM_ERR;
     }
-    if (af->readbuf) {
-        Jim_FreeNewObj(interp, af->readbuf);
-        af->readbuf = NULL;
-    }
+    /* Discard any buffered read data */
+    aio_consume(&af->readbuf, af->readbuf.len);
     af->flags &= ~AIO_EOF;
     return JIM_OK;
 }
@@ -1814,15 +2511,17 @@ static int aio_cmd_readsize(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 
     if (argc) {
         long l;
-        if (Jim_GetLong(interp, argv[0], &l) != JIM_OK || l <= 0) {
+        if (Jim_GetLong(interp, argv[0], &l) != JIM_OK) {
             return JIM_ERR;
         }
-        af->rbuf_len = l;
-        if (af->rbuf) {
-            af->rbuf = Jim_Realloc(af->rbuf, af->rbuf_len);
+        if (l <= 0 || l > AIO_MAX_RBUF_LEN) {
+            /* Keep in step with AIO_MAX_RBUF_LEN */
+            Jim_SetResultFormatted(interp, "bad readsize \"%#s\": must be between 1 and 16777216", argv[0]);
+            return JIM_ERR;
         }
+        af->readsize = l;
     }
-    Jim_SetResultInt(interp, af->rbuf_len);
+    Jim_SetResultInt(interp, af->readsize);
 
     return JIM_OK;
 }
@@ -1848,6 +2547,14 @@ static int aio_cmd_timeout(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 static int aio_eventinfo(Jim_Interp *interp, AioFile * af, unsigned mask,
     int argc, Jim_Obj * const *argv)
 {
+    if (af->copy) {
+        /* The handlers belong to a background copyto */
+        if (argc == 0) {
+            return JIM_OK;
+        }
+        Jim_SetResultFormatted(interp, "%#s: channel is busy", af->filename);
+        return JIM_ERR;
+    }
     if (argc == 0) {
         /* Return current script */
         Jim_Obj *objPtr = Jim_FindFileHandler(interp, af->fd, mask);
@@ -2181,11 +2888,12 @@ static const jim_subcmd_type aio_command_table[] = {
         /* Description: Read and return bytes from the stream. To eof if no len. */
     },
     {   "copyto",
-        "handle ?size?",
+        "handle ?size? ?-command script?",
         aio_cmd_copy,
         1,
-        2,
-        /* Description: Copy up to 'size' bytes to the given filehandle, or to eof if no size. */
+        4,
+        /* Description: Copy up to 'size' bytes to the given filehandle, or to eof if no size.
+         * With -command, copy in the background and call 'script count ?error?' when done. */
     },
     {   "getfd",
         NULL,
@@ -2717,12 +3425,9 @@ static AioFile *JimMakeChannel(Jim_Interp *interp, int fd, Jim_Obj *filename,
     aio_set_nonblocking(af, !!(flags & AIO_NONBLOCK));
     /* Now set flags */
     af->flags |= flags;
-    /* Create an empty write buf */
-    af->writebuf = Jim_NewStringObj(interp, NULL, 0);
-    Jim_IncrRefCount(af->writebuf);
     af->wbuf_limit = AIO_DEFAULT_WBUF_LIMIT;
-    af->rbuf_len = AIO_DEFAULT_RBUF_LEN;
-    /* Don't allocate rbuf or readbuf until we need it */
+    af->readsize = AIO_DEFAULT_RBUF_LEN;
+    /* Don't allocate readbuf or writebuf until we need them */
 
     /* By default, all channels are JIM_TAINT_STD for input and output. */
     if (!(flags & AIO_NOTAINT)) {
@@ -191,6 +191,9 @@ static int array_cmd_set(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
         dictObj = Jim_DuplicateObj(interp, dictObj);
     }
 
+    /* Size the array once for the case where all the names are new */
+    Jim_DictReserve(interp, dictObj, Jim_DictSize(interp, dictObj) + len / 2);
+
     for (i = 0; i < len; i += 2) {
         Jim_Obj *nameObj;
         Jim_Obj *valueObj;
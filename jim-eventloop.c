@@ -66,6 +66,20 @@
 #endif
 #endif
 
+/* Choose how to wait for file events: epoll on Linux, otherwise poll(), otherwise select() */
+#if defined(HAVE_EPOLL_CREATE1) && defined(HAVE_SYS_EPOLL_H)
+#define JIM_EVENT_EPOLL
+#include <sys/epoll.h>
+#ifdef HAVE_PTHREAD_ATFORK
+#include <pthread.h>
+#endif
+#elif defined(HAVE_POLL) && defined(HAVE_POLL_H)
+#define JIM_EVENT_POLL
+#include <poll.h>
+#elif defined(HAVE_SELECT)
+#define JIM_EVENT_SELECT
+#endif
+
 #ifndef HAVE_USLEEP
 /* XXX: Implement this in terms of select() or nanosleep() */
 #define usleep(US) sleep((US) / 1000000)
@@ -82,9 +96,27 @@ typedef struct Jim_FileEvent
     Jim_FileProc *fileProc;
     Jim_EventFinalizerProc *finalizerProc;
     void *clientData;
-    struct Jim_FileEvent *next;
+    struct Jim_FileEvent *next; /* next handler for the same fd */
 } Jim_FileEvent;
 
+/* The file event handlers for one fd */
+typedef struct Jim_FdEvents
+{
+    Jim_FileEvent *head;        /* handlers for this fd, most recently created first */
+    int mask;                   /* events currently registered with the backend */
+    int index;                  /* poll: index into pollfds, epoll: -1 if the fd can't be polled */
+} Jim_FdEvents;
+
+/* Fds that are ready, as returned by JimWaitFileEvents() */
+typedef struct Jim_ReadyFd
+{
+    int fd;
+    int mask;
+} Jim_ReadyFd;
+
+/* Maximum number of ready fds returned at once. Any others are returned next time. */
+#define JIM_EVENT_BATCH 64
+
 /* Time event structure */
 typedef struct Jim_TimeEvent
 {
@@ -94,14 +126,28 @@ typedef struct Jim_TimeEvent
     Jim_TimeProc *timeProc;
     Jim_EventFinalizerProc *finalizerProc;
     void *clientData;
-    struct Jim_TimeEvent *next;
+    int heapIndex;              /* position in the timer heap */
 } Jim_TimeEvent;
 
 /* Per-interp stucture containing the state of the event loop */
 typedef struct Jim_EventLoop
 {
-    Jim_FileEvent *fileEventHead;
-    Jim_TimeEvent *timeEventHead;
+    Jim_FdEvents *fds;          /* file event handlers, indexed by fd */
+    int fdsSize;                /* allocated size of fds */
+    int fileEventFds;           /* number of fds with handlers */
+#if defined(JIM_EVENT_EPOLL)
+    int epfd;                   /* epoll instance, or -1 if not yet created */
+    unsigned long epollOwner;   /* JimCurrentProcess() when epfd was created, since it is shared after fork */
+    int unpolledFds;            /* number of fds that epoll can't wait on (e.g. regular files) */
+#elif defined(JIM_EVENT_POLL)
+    struct pollfd *pollfds;     /* one entry for each fd with handlers */
+    int pollfdsSize;            /* allocated size of pollfds */
+#endif
+    int nextScan;               /* poll/select: where to start looking for ready fds, for fairness */
+    Jim_TimeEvent **timers;     /* binary min-heap of time events, ordered by when, then id */
+    int timersLen;              /* number of time events */
+    int timersSize;             /* allocated size of timers */
+    Jim_HashTable timersById;   /* time events by id */
     jim_wide timeEventNextId;   /* highest event id created, starting at 1 */
     int suppress_bgerror; /* bgerror returned break, so don't call it again */
 } Jim_EventLoop;
@@ -148,6 +194,317 @@ int Jim_EvalObjBackground(Jim_Interp *interp, Jim_Obj *scriptObjPtr)
 }
 
 
+/* ---------------------------------------------------------------------------
+ * Backends for waiting on file events.
+ *
+ * Each backend keeps its own registration of the fds with handlers, updated
+ * by JimUpdateFileEvents() as handlers are added and removed, so that waiting
+ * and dispatching costs depend on the number of ready fds rather than on the
+ * total number of fds.
+ * ---------------------------------------------------------------------------*/
+
+#if defined(JIM_EVENT_EPOLL)
+static int JimEpollEvents(int mask)
+{
+    int events = 0;
+
+    if (mask & JIM_EVENT_READABLE)
+        events |= EPOLLIN;
+    if (mask & JIM_EVENT_WRITABLE)
+        events |= EPOLLOUT;
+    if (mask & JIM_EVENT_EXCEPTION)
+        events |= EPOLLPRI;
+    return events;
+}
+
+/* Adds or modifies the registration of fd. Returns 0 on success, or -1 if fd can't be polled */
+static int JimEpollCtl(Jim_EventLoop *eventLoop, int op, int fd, int mask)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = JimEpollEvents(mask);
+    ev.data.fd = fd;
+    if (epoll_ctl(eventLoop->epfd, op, fd, &ev) == 0) {
+        return 0;
+    }
+    if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+        /* The fd was closed and reopened, so it was removed automatically */
+        return epoll_ctl(eventLoop->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+        return epoll_ctl(eventLoop->epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    return -1;
+}
+
+#ifdef HAVE_PTHREAD_ATFORK
+/* The number of forks leading to this process, so that checking for a
+ * forked child before each wait doesn't need a system call
+ */
+static unsigned long JimForkCount;
+static pthread_once_t JimAtForkOnce = PTHREAD_ONCE_INIT;
+
+static void JimAtForkChild(void)
+{
+    JimForkCount++;
+}
+
+static void JimRegisterAtFork(void)
+{
+    pthread_atfork(NULL, NULL, JimAtForkChild);
+}
+
+#define JimCurrentProcess() JimForkCount
+#else
+#define JimCurrentProcess() ((unsigned long)getpid())
+#endif
+
+/* Creates the epoll instance if necessary. Since an epoll instance is shared
+ * with a forked child, a new one is created (and all the fds registered again)
+ * if this is no longer the process that created it.
+ */
+static void JimEpollCreate(Jim_EventLoop *eventLoop)
+{
+    int fd;
+
+    if (eventLoop->epfd >= 0) {
+        if (eventLoop->epollOwner == JimCurrentProcess()) {
+            return;
+        }
+        close(eventLoop->epfd);
+    }
+    eventLoop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    eventLoop->epollOwner = JimCurrentProcess();
+    eventLoop->unpolledFds = 0;
+
+    for (fd = 0; fd < eventLoop->fdsSize; fd++) {
+        Jim_FdEvents *fde = &eventLoop->fds[fd];
+        if (fde->mask) {
+            fde->index = JimEpollCtl(eventLoop, EPOLL_CTL_ADD, fd, fde->mask);
+            if (fde->index < 0) {
+                eventLoop->unpolledFds++;
+            }
+        }
+    }
+}
+#endif
+
+#if defined(JIM_EVENT_EPOLL) || defined(JIM_EVENT_POLL)
+/* Converts a timeout in microseconds (or -1 for none) to milliseconds */
+static int JimTimeoutMs(jim_wide sleep_us)
+{
+    jim_wide ms;
+
+    if (sleep_us < 0) {
+        return -1;
+    }
+    /* Round up so that a timer is never found to be not quite ready */
+    ms = (sleep_us + 999) / 1000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+#endif
+
+#if defined(JIM_EVENT_POLL)
+static short JimPollEvents(int mask)
+{
+    short events = 0;
+
+    if (mask & JIM_EVENT_READABLE)
+        events |= POLLIN;
+    if (mask & JIM_EVENT_WRITABLE)
+        events |= POLLOUT;
+    if (mask & JIM_EVENT_EXCEPTION)
+        events |= POLLPRI;
+    return events;
+}
+#endif
+
+/* Updates the events that are waited for on fd to 'mask' (which may be 0) */
+static void JimUpdateFileEvents(Jim_EventLoop *eventLoop, int fd, int mask)
+{
+    Jim_FdEvents *fde = &eventLoop->fds[fd];
+
+    if (fde->mask == mask) {
+        return;
+    }
+#if defined(JIM_EVENT_EPOLL)
+    JimEpollCreate(eventLoop);
+    if (mask == 0) {
+        if (fde->index < 0) {
+            eventLoop->unpolledFds--;
+        }
+        else {
+            /* This fails if the fd is already closed, which is fine */
+            epoll_ctl(eventLoop->epfd, EPOLL_CTL_DEL, fd, NULL);
+        }
+        fde->index = -1;
+    }
+    else if (fde->mask == 0 || fde->index >= 0) {
+        int index = JimEpollCtl(eventLoop, fde->mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, mask);
+        if (index < 0) {
+            /* e.g. a regular file, which is always ready, as with select() */
+            eventLoop->unpolledFds++;
+        }
+        fde->index = index;
+    }
+#elif defined(JIM_EVENT_POLL)
+    if (fde->mask == 0) {
+        /* New fd, so add it to the end */
+        if (eventLoop->fileEventFds >= eventLoop->pollfdsSize) {
+            eventLoop->pollfdsSize = eventLoop->pollfdsSize ? eventLoop->pollfdsSize * 2 : 16;
+            eventLoop->pollfds = Jim_Realloc(eventLoop->pollfds, sizeof(*eventLoop->pollfds) * eventLoop->pollfdsSize);
+        }
+        fde->index = eventLoop->fileEventFds;
+        eventLoop->pollfds[fde->index].fd = fd;
+    }
+    if (mask == 0) {
+        /* Move the last entry into the place of the removed one */
+        int last = eventLoop->fileEventFds - 1;
+        eventLoop->pollfds[fde->index] = eventLoop->pollfds[last];
+        eventLoop->fds[eventLoop->pollfds[last].fd].index = fde->index;
+        fde->index = -1;
+    }
+    else {
+        eventLoop->pollfds[fde->index].events = JimPollEvents(mask);
+    }
+#endif
+    if (fde->mask == 0) {
+        eventLoop->fileEventFds++;
+    }
+    else if (mask == 0) {
+        eventLoop->fileEventFds--;
+    }
+    fde->mask = mask;
+}
+
+/* Waits up to sleep_us (or forever if -1) for any fd with handlers to become ready
+ * and stores up to JIM_EVENT_BATCH ready fds in 'ready'.
+ *
+ * Returns the number of ready fds, or -1 on error with the interp result set.
+ */
+static int JimWaitFileEvents(Jim_Interp *interp, Jim_EventLoop *eventLoop, jim_wide sleep_us, Jim_ReadyFd *ready)
+{
+    int count = 0;
+
+#if defined(JIM_EVENT_EPOLL)
+    {
+        struct epoll_event events[JIM_EVENT_BATCH];
+        int n;
+        int i;
+
+        JimEpollCreate(eventLoop);
+        if (eventLoop->unpolledFds) {
+            /* These are always ready, so don't wait */
+            sleep_us = 0;
+        }
+        n = epoll_wait(eventLoop->epfd, events, JIM_EVENT_BATCH, JimTimeoutMs(sleep_us));
+        for (i = 0; i < n; i++) {
+            int mask = 0;
+
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                mask |= JIM_EVENT_READABLE;
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                mask |= JIM_EVENT_WRITABLE;
+            if (events[i].events & EPOLLPRI)
+                mask |= JIM_EVENT_EXCEPTION;
+            ready[count].fd = events[i].data.fd;
+            ready[count++].mask = mask;
+        }
+        if (eventLoop->unpolledFds) {
+            int fd;
+
+            for (fd = 0; fd < eventLoop->fdsSize && count < JIM_EVENT_BATCH; fd++) {
+                if (eventLoop->fds[fd].mask && eventLoop->fds[fd].index < 0) {
+                    ready[count].fd = fd;
+                    ready[count++].mask = eventLoop->fds[fd].mask;
+                }
+            }
+        }
+    }
+#elif defined(JIM_EVENT_POLL)
+    if (poll(eventLoop->pollfds, eventLoop->fileEventFds, JimTimeoutMs(sleep_us)) > 0) {
+        int i;
+
+        /* Start where the last scan left off so that all fds get a turn */
+        for (i = 0; i < eventLoop->fileEventFds && count < JIM_EVENT_BATCH; i++) {
+            struct pollfd *pfd = &eventLoop->pollfds[(eventLoop->nextScan + i) % eventLoop->fileEventFds];
+            int mask = 0;
+
+            if (pfd->revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+                mask |= JIM_EVENT_READABLE;
+            if (pfd->revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
+                mask |= JIM_EVENT_WRITABLE;
+            if (pfd->revents & POLLPRI)
+                mask |= JIM_EVENT_EXCEPTION;
+            if (mask) {
+                ready[count].fd = pfd->fd;
+                ready[count++].mask = mask;
+            }
+        }
+        eventLoop->nextScan = (eventLoop->nextScan + i) % eventLoop->fileEventFds;
+    }
+#elif defined(JIM_EVENT_SELECT)
+    {
+        struct timeval tv, *tvp = NULL;
+        fd_set rfds, wfds, efds;
+        int maxfd = -1;
+        int retval;
+        int fd;
+        int i;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
+
+        for (fd = 0; fd < eventLoop->fdsSize; fd++) {
+            int mask = eventLoop->fds[fd].mask;
+            if (mask & JIM_EVENT_READABLE)
+                FD_SET(fd, &rfds);
+            if (mask & JIM_EVENT_WRITABLE)
+                FD_SET(fd, &wfds);
+            if (mask & JIM_EVENT_EXCEPTION)
+                FD_SET(fd, &efds);
+            if (mask)
+                maxfd = fd;
+        }
+
+        if (sleep_us >= 0) {
+            tvp = &tv;
+            tvp->tv_sec = sleep_us / 1000000;
+            tvp->tv_usec = sleep_us % 1000000;
+        }
+
+        retval = select(maxfd + 1, &rfds, &wfds, &efds, tvp);
+        if (retval <= 0) {
+            if (retval < 0 && errno == EINVAL) {
+                /* This can happen on mingw32 if a non-socket filehandle is passed */
+                Jim_SetResultString(interp, "non-waitable filehandle", -1);
+                return -1;
+            }
+            return 0;
+        }
+        for (i = 0; i <= maxfd && count < JIM_EVENT_BATCH; i++) {
+            int mask = 0;
+
+            fd = (eventLoop->nextScan + i) % (maxfd + 1);
+            if (FD_ISSET(fd, &rfds))
+                mask |= JIM_EVENT_READABLE;
+            if (FD_ISSET(fd, &wfds))
+                mask |= JIM_EVENT_WRITABLE;
+            if (FD_ISSET(fd, &efds))
+                mask |= JIM_EVENT_EXCEPTION;
+            if (mask) {
+                ready[count].fd = fd;
+                ready[count++].mask = mask;
+            }
+        }
+        eventLoop->nextScan = (eventLoop->nextScan + i) % (maxfd + 1);
+    }
+#endif
+    return count;
+}
+
 /**
  * Register a file event handler on the given file descriptor with the given mask
  * (may be 1 or more of JIM_EVENT_xxx)
@@ -164,14 +521,32 @@ void Jim_CreateFileHandler(Jim_Interp *interp, int fd, int mask,
     Jim_FileEvent *fe;
     Jim_EventLoop *eventLoop = Jim_GetAssocData(interp, "eventloop");
 
+    if (fd >= eventLoop->fdsSize) {
+        int size = eventLoop->fdsSize ? eventLoop->fdsSize : 16;
+        int i;
+
+        while (size <= fd) {
+            size *= 2;
+        }
+        eventLoop->fds = Jim_Realloc(eventLoop->fds, sizeof(*eventLoop->fds) * size);
+        for (i = eventLoop->fdsSize; i < size; i++) {
+            eventLoop->fds[i].head = NULL;
+            eventLoop->fds[i].mask = 0;
+            eventLoop->fds[i].index = -1;
+        }
+        eventLoop->fdsSize = size;
+    }
+
     fe = Jim_Alloc(sizeof(*fe));
     fe->fd = fd;
     fe->mask = mask;
     fe->fileProc = proc;
     fe->finalizerProc = finalizerProc;
     fe->clientData = clientData;
-    fe->next = eventLoop->fileEventHead;
-    eventLoop->fileEventHead = fe;
+    fe->next = eventLoop->fds[fd].head;
+    eventLoop->fds[fd].head = fe;
+
+    JimUpdateFileEvents(eventLoop, fd, eventLoop->fds[fd].mask | mask);
 }
 
 static int JimEventHandlerScript(Jim_Interp *interp, void *clientData, int mask)
@@ -205,8 +580,11 @@ void *Jim_FindFileHandler(Jim_Interp *interp, int fd, int mask)
     Jim_FileEvent *fe;
     Jim_EventLoop *eventLoop = Jim_GetAssocData(interp, "eventloop");
 
-    for (fe = eventLoop->fileEventHead; fe; fe = fe->next) {
-        if (fe->fd == fd && (fe->mask & mask)) {
+    if (fd < 0 || fd >= eventLoop->fdsSize) {
+        return NULL;
+    }
+    for (fe = eventLoop->fds[fd].head; fe; fe = fe->next) {
+        if (fe->mask & mask) {
             return fe->clientData;
         }
     }
@@ -219,23 +597,124 @@ void *Jim_FindFileHandler(Jim_Interp *interp, int fd, int mask)
 void Jim_DeleteFileHandler(Jim_Interp *interp, int fd, int mask)
 {
     Jim_FileEvent *fe, *next, *prev = NULL;
+    Jim_FileEvent *removed = NULL, **tail = &removed;
     Jim_EventLoop *eventLoop = Jim_GetAssocData(interp, "eventloop");
+    int remaining = 0;
 
-    for (fe = eventLoop->fileEventHead; fe; fe = next) {
+    if (fd < 0 || fd >= eventLoop->fdsSize) {
+        return;
+    }
+    for (fe = eventLoop->fds[fd].head; fe; fe = next) {
         next = fe->next;
-        if (fe->fd == fd && (fe->mask & mask)) {
+        if (fe->mask & mask) {
             /* Remove this entry from the list */
             if (prev == NULL)
-                eventLoop->fileEventHead = next;
+                eventLoop->fds[fd].head = next;
             else
                 prev->next = next;
-            if (fe->finalizerProc)
-                fe->finalizerProc(interp, fe->clientData);
-            Jim_Free(fe);
+            fe->next = NULL;
+            *tail = fe;
+            tail = &fe->next;
             continue;
         }
+        remaining |= fe->mask;
         prev = fe;
     }
+    JimUpdateFileEvents(eventLoop, fd, remaining);
+
+    /* Only call the finalizers once the handlers are consistent, since they may add new handlers */
+    for (fe = removed; fe; fe = next) {
+        next = fe->next;
+        if (fe->finalizerProc)
+            fe->finalizerProc(interp, fe->clientData);
+        Jim_Free(fe);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Time events are kept in a binary min-heap ordered by when they are due,
+ * then by id so that events due at the same time run in the order they were
+ * created. They are also indexed by id so that they can be found and removed
+ * without a search.
+ * ---------------------------------------------------------------------------*/
+
+static unsigned int JimTimeEventHashFunction(const void *key)
+{
+    jim_wide id = *(const jim_wide *)key;
+
+    /* Ids are allocated sequentially, so use them directly */
+    return (unsigned int)(id ^ (id >> 32));
+}
+
+static int JimTimeEventKeyCompare(void *privdata, const void *key1, const void *key2)
+{
+    JIM_NOTUSED(privdata);
+
+    return *(const jim_wide *)key1 == *(const jim_wide *)key2;
+}
+
+/* The key is a pointer to the id in the time event itself */
+static const Jim_HashTableType JimTimeEventHashTableType = {
+    JimTimeEventHashFunction,   /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    JimTimeEventKeyCompare,     /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Returns 1 if time event a is due before time event b */
+static int JimTimeEventBefore(const Jim_TimeEvent *a, const Jim_TimeEvent *b)
+{
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
+
+/* Stores te at position i in the heap */
+static void JimTimerHeapSet(Jim_EventLoop *eventLoop, int i, Jim_TimeEvent *te)
+{
+    eventLoop->timers[i] = te;
+    te->heapIndex = i;
+}
+
+/* Moves the event at position i up or down the heap to restore the heap order */
+static void JimTimerHeapFix(Jim_EventLoop *eventLoop, int i)
+{
+    Jim_TimeEvent *te = eventLoop->timers[i];
+
+    while (i > 0 && JimTimeEventBefore(te, eventLoop->timers[(i - 1) / 2])) {
+        JimTimerHeapSet(eventLoop, i, eventLoop->timers[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int child = 2 * i + 1;
+
+        if (child >= eventLoop->timersLen) {
+            break;
+        }
+        if (child + 1 < eventLoop->timersLen && JimTimeEventBefore(eventLoop->timers[child + 1], eventLoop->timers[child])) {
+            child++;
+        }
+        if (!JimTimeEventBefore(eventLoop->timers[child], te)) {
+            break;
+        }
+        JimTimerHeapSet(eventLoop, i, eventLoop->timers[child]);
+        i = child;
+    }
+    JimTimerHeapSet(eventLoop, i, te);
+}
+
+/* Removes the time event from the heap and the id index, but does not free it */
+static void JimRemoveTimeEvent(Jim_EventLoop *eventLoop, Jim_TimeEvent *te)
+{
+    int i = te->heapIndex;
+
+    Jim_DeleteHashEntry(&eventLoop->timersById, &te->id);
+    eventLoop->timersLen--;
+    if (i != eventLoop->timersLen) {
+        /* Move the last event into the hole */
+        JimTimerHeapSet(eventLoop, i, eventLoop->timers[eventLoop->timersLen]);
+        JimTimerHeapFix(eventLoop, i);
+    }
 }
 
 jim_wide Jim_CreateTimeHandler(Jim_Interp *interp, jim_wide us,
@@ -243,7 +722,7 @@ jim_wide Jim_CreateTimeHandler(Jim_Interp *interp, jim_wide us,
 {
     Jim_EventLoop *eventLoop = Jim_GetAssocData(interp, "eventloop");
     jim_wide id = ++eventLoop->timeEventNextId;
-    Jim_TimeEvent *te, *e, *prev;
+    Jim_TimeEvent *te;
 
     te = Jim_Alloc(sizeof(*te));
     te->id = id;
@@ -253,22 +732,13 @@ jim_wide Jim_CreateTimeHandler(Jim_Interp *interp, jim_wide us,
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
 
-    /* Add to the appropriate place in the list */
-    prev = NULL;
-    for (e = eventLoop->timeEventHead; e; e = e->next) {
-        if (te->when < e->when) {
-            break;
-        }
-        prev = e;
-    }
-    if (prev) {
-        te->next = prev->next;
-        prev->next = te;
-    }
-    else {
-        te->next = eventLoop->timeEventHead;
-        eventLoop->timeEventHead = te;
+    if (eventLoop->timersLen == eventLoop->timersSize) {
+        eventLoop->timersSize = eventLoop->timersSize ? eventLoop->timersSize * 2 : 16;
+        eventLoop->timers = Jim_Realloc(eventLoop->timers, sizeof(*eventLoop->timers) * eventLoop->timersSize);
     }
+    JimTimerHeapSet(eventLoop, eventLoop->timersLen++, te);
+    JimTimerHeapFix(eventLoop, te->heapIndex);
+    Jim_AddHashEntry(&eventLoop->timersById, &te->id, te);
 
     return id;
 }
@@ -285,48 +755,29 @@ static jim_wide JimParseAfterId(Jim_Obj *idObj)
     return -1;
 }
 
+/* Returns the id of the first 'after' event due with the given script, or -1 if none */
 static jim_wide JimFindAfterByScript(Jim_EventLoop *eventLoop, Jim_Obj *scriptObj)
 {
-    Jim_TimeEvent *te;
+    Jim_TimeEvent *found = NULL;
+    int i;
 
-    for (te = eventLoop->timeEventHead; te; te = te->next) {
+    for (i = 0; i < eventLoop->timersLen; i++) {
+        Jim_TimeEvent *te = eventLoop->timers[i];
         /* Is this an 'after' event? */
-        if (te->timeProc == JimAfterTimeHandler) {
+        if (te->timeProc == JimAfterTimeHandler && (found == NULL || JimTimeEventBefore(te, found))) {
             if (Jim_StringEqObj(scriptObj, te->clientData)) {
-                return te->id;
+                found = te;
             }
         }
     }
-    return -1;                  /* NO event with the specified ID found */
+    return found ? found->id : -1;
 }
 
 static Jim_TimeEvent *JimFindTimeHandlerById(Jim_EventLoop *eventLoop, jim_wide id)
 {
-    Jim_TimeEvent *te;
-
-    for (te = eventLoop->timeEventHead; te; te = te->next) {
-        if (te->id == id) {
-            return te;
-        }
-    }
-    return NULL;
-}
+    Jim_HashEntry *he = Jim_FindHashEntry(&eventLoop->timersById, &id);
 
-static Jim_TimeEvent *Jim_RemoveTimeHandler(Jim_EventLoop *eventLoop, jim_wide id)
-{
-    Jim_TimeEvent *te, *prev = NULL;
-
-    for (te = eventLoop->timeEventHead; te; te = te->next) {
-        if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            return te;
-        }
-        prev = te;
-    }
-    return NULL;
+    return he ? Jim_GetHashEntryVal(he) : NULL;
 }
 
 static void Jim_FreeTimeHandler(Jim_Interp *interp, Jim_TimeEvent *te)
@@ -345,10 +796,12 @@ jim_wide Jim_DeleteTimeHandler(Jim_Interp *interp, jim_wide id)
         return -2;              /* wrong event ID */
     }
 
-    te = Jim_RemoveTimeHandler(eventLoop, id);
+    te = JimFindTimeHandlerById(eventLoop, id);
     if (te) {
         jim_wide remain;
 
+        JimRemoveTimeEvent(eventLoop, te);
+
         remain = te->when - Jim_GetTimeUsec(CLOCK_MONOTONIC_RAW);
         remain = (remain < 0) ? 0 : remain;
 
@@ -358,7 +811,55 @@ jim_wide Jim_DeleteTimeHandler(Jim_Interp *interp, jim_wide id)
     return -1;                  /* NO event with the specified ID found */
 }
 
-/* --- POSIX version of Jim_ProcessEvents, for now the only available --- */
+/* A time event that is due to be processed */
+typedef struct {
+    jim_wide when;
+    jim_wide id;
+} JimDueTimer;
+
+typedef struct {
+    JimDueTimer *timers;
+    int count;
+    int size;
+} JimDueTimers;
+
+/* Collects the time events in the heap subtree at i that are due at now and have id <= maxId */
+static void JimCollectDueTimers(Jim_EventLoop *eventLoop, int i, jim_wide now, jim_wide maxId, JimDueTimers *due)
+{
+    Jim_TimeEvent *te;
+
+    if (i >= eventLoop->timersLen) {
+        return;
+    }
+    te = eventLoop->timers[i];
+    if (te->when > now) {
+        /* Nothing below here is due either */
+        return;
+    }
+    if (te->id <= maxId) {
+        if (due->count == due->size) {
+            due->size = due->size ? due->size * 2 : 16;
+            due->timers = Jim_Realloc(due->timers, sizeof(*due->timers) * due->size);
+        }
+        due->timers[due->count].when = te->when;
+        due->timers[due->count].id = te->id;
+        due->count++;
+    }
+    JimCollectDueTimers(eventLoop, 2 * i + 1, now, maxId, due);
+    JimCollectDueTimers(eventLoop, 2 * i + 2, now, maxId, due);
+}
+
+/* Orders due time events by when, then id */
+static int JimDueTimerCompare(const void *a, const void *b)
+{
+    const JimDueTimer *ta = a;
+    const JimDueTimer *tb = b;
+
+    if (ta->when != tb->when) {
+        return ta->when < tb->when ? -1 : 1;
+    }
+    return ta->id < tb->id ? -1 : ta->id > tb->id;
+}
 
 /* Process every pending time event, then every pending file event
  * (that may be registered by time event callbacks just processed).
@@ -379,19 +880,17 @@ int Jim_ProcessEvents(Jim_Interp *interp, int flags)
     jim_wide sleep_us = -1;
     int processed = 0;
     Jim_EventLoop *eventLoop = Jim_GetAssocData(interp, "eventloop");
-    Jim_FileEvent *fe = eventLoop->fileEventHead;
-    Jim_TimeEvent *te;
     jim_wide maxId;
 
-    if ((flags & JIM_FILE_EVENTS) == 0 || fe == NULL) {
+    if ((flags & JIM_FILE_EVENTS) == 0 || eventLoop->fileEventFds == 0) {
         /* No file events */
-        if ((flags & JIM_TIME_EVENTS) == 0 || eventLoop->timeEventHead == NULL) {
+        if ((flags & JIM_TIME_EVENTS) == 0 || eventLoop->timersLen == 0) {
             /* No time events */
             return -1;
         }
     }
 
-    /* Note that we want call select() even if there are no
+    /* Note that we want to wait for file events even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
@@ -401,9 +900,9 @@ int Jim_ProcessEvents(Jim_Interp *interp, int flags)
         sleep_us = 0;
     }
     else if (flags & JIM_TIME_EVENTS) {
-        /* The nearest timer is always at the head of the list */
-        if (eventLoop->timeEventHead) {
-            Jim_TimeEvent *shortest = eventLoop->timeEventHead;
+        /* The nearest timer is always at the top of the heap */
+        if (eventLoop->timersLen) {
+            Jim_TimeEvent *shortest = eventLoop->timers[0];
 
             /* Calculate the time missing for the nearest
              * timer to fire. */
@@ -418,77 +917,37 @@ int Jim_ProcessEvents(Jim_Interp *interp, int flags)
         }
     }
 
-#ifdef HAVE_SELECT
+#if defined(JIM_EVENT_EPOLL) || defined(JIM_EVENT_POLL) || defined(JIM_EVENT_SELECT)
     if (flags & JIM_FILE_EVENTS) {
-        int retval;
-        struct timeval tv, *tvp = NULL;
-        fd_set rfds, wfds, efds;
-        int maxfd = -1;
+        Jim_ReadyFd ready[JIM_EVENT_BATCH];
+        int count = JimWaitFileEvents(interp, eventLoop, sleep_us, ready);
+        int i;
 
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&efds);
-
-        /* Check file events */
-        while (fe != NULL) {
-            if (fe->mask & JIM_EVENT_READABLE)
-                FD_SET(fe->fd, &rfds);
-            if (fe->mask & JIM_EVENT_WRITABLE)
-                FD_SET(fe->fd, &wfds);
-            if (fe->mask & JIM_EVENT_EXCEPTION)
-                FD_SET(fe->fd, &efds);
-            if (maxfd < fe->fd)
-                maxfd = fe->fd;
-            fe = fe->next;
+        if (count < 0) {
+            return -2;
         }
+        for (i = 0; i < count; i++) {
+            int fd = ready[i].fd;
 
-        if (sleep_us >= 0) {
-            tvp = &tv;
-            tvp->tv_sec = sleep_us / 1000000;
-            tvp->tv_usec = sleep_us % 1000000;
-        }
-
-        retval = select(maxfd + 1, &rfds, &wfds, &efds, tvp);
-
-        if (retval < 0) {
-            if (errno == EINVAL) {
-                /* This can happen on mingw32 if a non-socket filehandle is passed */
-                Jim_SetResultString(interp, "non-waitable filehandle", -1);
-                return -2;
-            }
-        }
-        else if (retval > 0) {
-            fe = eventLoop->fileEventHead;
-            while (fe != NULL) {
-                int mask = 0;
-                int fd = fe->fd;
-
-                if ((fe->mask & JIM_EVENT_READABLE) && FD_ISSET(fd, &rfds))
-                    mask |= JIM_EVENT_READABLE;
-                if (fe->mask & JIM_EVENT_WRITABLE && FD_ISSET(fd, &wfds))
-                    mask |= JIM_EVENT_WRITABLE;
-                if (fe->mask & JIM_EVENT_EXCEPTION && FD_ISSET(fd, &efds))
-                    mask |= JIM_EVENT_EXCEPTION;
-
-                if (mask) {
-                    int ret = fe->fileProc(interp, fe->clientData, mask);
-                    if (ret != JIM_OK && ret != JIM_RETURN) {
-                        /* Remove the element on handler error */
-                        Jim_DeleteFileHandler(interp, fd, mask);
-                        /* At this point fe is no longer valid - it will be assigned below */
+            /* Handlers may have been added or removed by earlier handlers,
+             * so look up the current handlers for this fd. As before, only the
+             * first matching handler for each fd is called each time.
+             */
+            if (fd < eventLoop->fdsSize) {
+                Jim_FileEvent *fe;
+
+                for (fe = eventLoop->fds[fd].head; fe; fe = fe->next) {
+                    int mask = fe->mask & ready[i].mask;
+
+                    if (mask) {
+                        int ret = fe->fileProc(interp, fe->clientData, mask);
+                        if (ret != JIM_OK && ret != JIM_RETURN) {
+                            /* Remove the element on handler error */
+                            Jim_DeleteFileHandler(interp, fd, mask);
+                        }
+                        processed++;
+                        break;
                     }
-                    processed++;
-                    /* After an event is processed our file event list
-                     * may no longer be the same, so what we do
-                     * is to clear the bit for this file descriptor and
-                     * restart again from the head. */
-                    FD_CLR(fd, &rfds);
-                    FD_CLR(fd, &wfds);
-                    FD_CLR(fd, &efds);
-                    fe = eventLoop->fileEventHead;
-                }
-                else {
-                    fe = fe->next;
                 }
             }
         }
@@ -499,35 +958,39 @@ int Jim_ProcessEvents(Jim_Interp *interp, int flags)
     }
 #endif
 
-    /* Check time events */
-    te = eventLoop->timeEventHead;
+    /* Check time events.
+     * We make sure not to process events registered by event handlers
+     * themselves in order not to loop forever even in the case of an
+     * [after 0] that continuously registers itself. To do so we save
+     * the max id we want to handle.
+     */
     maxId = eventLoop->timeEventNextId;
-    while (te) {
-        jim_wide id;
-
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        if (Jim_GetTimeUsec(CLOCK_MONOTONIC_RAW) >= te->when) {
-            id = te->id;
-            /* Remove from the list before executing */
-            Jim_RemoveTimeHandler(eventLoop, id);
-            te->timeProc(interp, te->clientData);
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever
-             * even in case an [after 0] that continuously register
-             * itself. To do so we saved the max ID we want to handle. */
-            Jim_FreeTimeHandler(interp, te);
-
-            te = eventLoop->timeEventHead;
-            processed++;
+    while (eventLoop->timersLen) {
+        JimDueTimers due;
+        int i;
+
+        due.timers = NULL;
+        due.count = 0;
+        due.size = 0;
+        JimCollectDueTimers(eventLoop, 0, Jim_GetTimeUsec(CLOCK_MONOTONIC_RAW), maxId, &due);
+        if (due.count == 0) {
+            break;
         }
-        else {
-            te = te->next;
+        qsort(due.timers, due.count, sizeof(*due.timers), JimDueTimerCompare);
+
+        for (i = 0; i < due.count; i++) {
+            /* An earlier handler may have deleted this event */
+            Jim_TimeEvent *te = JimFindTimeHandlerById(eventLoop, due.timers[i].id);
+            if (te) {
+                /* Remove before executing */
+                JimRemoveTimeEvent(eventLoop, te);
+                te->timeProc(interp, te->clientData);
+                Jim_FreeTimeHandler(interp, te);
+                processed++;
+            }
         }
+        Jim_Free(due.timers);
+        /* Other events may have become due while the handlers ran, so check again */
     }
 
     return processed;
@@ -541,24 +1004,37 @@ static void JimELAssocDataDeleProc(Jim_Interp *interp, void *data)
     Jim_FileEvent *fe;
     Jim_TimeEvent *te;
     Jim_EventLoop *eventLoop = data;
+    int fd;
+    int i;
 
-    fe = eventLoop->fileEventHead;
-    while (fe) {
-        next = fe->next;
-        if (fe->finalizerProc)
-            fe->finalizerProc(interp, fe->clientData);
-        Jim_Free(fe);
-        fe = next;
+    for (fd = 0; fd < eventLoop->fdsSize; fd++) {
+        fe = eventLoop->fds[fd].head;
+        eventLoop->fds[fd].head = NULL;
+        while (fe) {
+            next = fe->next;
+            if (fe->finalizerProc)
+                fe->finalizerProc(interp, fe->clientData);
+            Jim_Free(fe);
+            fe = next;
+        }
     }
+    Jim_Free(eventLoop->fds);
+#if defined(JIM_EVENT_EPOLL)
+    if (eventLoop->epfd >= 0) {
+        close(eventLoop->epfd);
+    }
+#elif defined(JIM_EVENT_POLL)
+    Jim_Free(eventLoop->pollfds);
+#endif
 
-    te = eventLoop->timeEventHead;
-    while (te) {
-        next = te->next;
+    for (i = 0; i < eventLoop->timersLen; i++) {
+        te = eventLoop->timers[i];
         if (te->finalizerProc)
             te->finalizerProc(interp, te->clientData);
         Jim_Free(te);
-        te = next;
     }
+    Jim_Free(eventLoop->timers);
+    Jim_FreeHashTable(&eventLoop->timersById);
     Jim_Free(data);
 }
 
@@ -756,16 +1232,23 @@ static int JimELAfterCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 
         case AFTER_INFO:
             if (argc == 2) {
-                Jim_TimeEvent *te = eventLoop->timeEventHead;
                 Jim_Obj *listObj = Jim_NewListObj(interp, NULL, 0);
                 char buf[30];
                 const char *fmt = "after#%" JIM_WIDE_MODIFIER;
+                JimDueTimer *timers = Jim_Alloc(sizeof(*timers) * (eventLoop->timersLen + 1));
+                int i;
 
-                while (te) {
-                    snprintf(buf, sizeof(buf), fmt, te->id);
+                /* List the events in the order they are due */
+                for (i = 0; i < eventLoop->timersLen; i++) {
+                    timers[i].when = eventLoop->timers[i]->when;
+                    timers[i].id = eventLoop->timers[i]->id;
+                }
+                qsort(timers, eventLoop->timersLen, sizeof(*timers), JimDueTimerCompare);
+                for (i = 0; i < eventLoop->timersLen; i++) {
+                    snprintf(buf, sizeof(buf), fmt, timers[i].id);
                     Jim_ListAppendElement(interp, listObj, Jim_NewStringObj(interp, buf, -1));
-                    te = te->next;
                 }
+                Jim_Free(timers);
                 Jim_SetResult(interp, listObj);
             }
             else if (argc == 3) {
@@ -800,6 +1283,13 @@ int Jim_eventloopInit(Jim_Interp *interp)
 
     eventLoop = Jim_Alloc(sizeof(*eventLoop));
     memset(eventLoop, 0, sizeof(*eventLoop));
+#if defined(JIM_EVENT_EPOLL)
+    eventLoop->epfd = -1;
+#ifdef HAVE_PTHREAD_ATFORK
+    pthread_once(&JimAtForkOnce, JimRegisterAtFork);
+#endif
+#endif
+    Jim_InitHashTable(&eventLoop->timersById, &JimTimeEventHashTableType, NULL);
 
     Jim_SetAssocData(interp, "eventloop", JimELAssocDataDeleProc, eventLoop);
 
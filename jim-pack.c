@@ -349,6 +349,25 @@ static int Jim_UnpackCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
     }
 }
 
+/* Destination for copying a -str value into the packed string */
+struct JimPackCopy {
+    char *dest;
+    int remaining;
+};
+
+static int JimPackCopyChunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    struct JimPackCopy *copy = privData;
+
+    if (len > copy->remaining) {
+        len = copy->remaining;
+    }
+    memcpy(copy->dest, str, len);
+    copy->dest += len;
+    copy->remaining -= len;
+    return copy->remaining ? JIM_OK : JIM_BREAK;
+}
+
 /**
  * [pack]
  *
@@ -441,13 +460,12 @@ static int Jim_PackCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
         JimSetBitsIntLittleEndian((unsigned char *)stringObjPtr->bytes, value, pos, width);
     }
     else {
-        pos /= 8;
-        width /= 8;
+        struct JimPackCopy copy;
 
-        if (width > Jim_Length(argv[2])) {
-            width = Jim_Length(argv[2]);
-        }
-        memcpy(stringObjPtr->bytes + pos, Jim_String(argv[2]), width);
+        /* Copy up to width bytes of the value, piece by piece in case it is a rope */
+        copy.dest = stringObjPtr->bytes + pos / 8;
+        copy.remaining = width / 8;
+        Jim_StringForeachChunk(interp, argv[2], JimPackCopyChunk, &copy);
         /* No padding is needed since the string is already extended */
     }
 
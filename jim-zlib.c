@@ -32,6 +32,7 @@
  * official policies, either expressed or implied, of the Jim Tcl Project.
  */
 
+#include <string.h>
 #include <zlib.h>
 
 #include <jim.h>
@@ -50,11 +51,18 @@ static int JimZlibCheckBufSize(Jim_Interp *interp, jim_wide bufsiz)
     return JIM_OK;
 }
 
+static int JimCrc32Chunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    uLong *crc = privData;
+
+    *crc = crc32(*crc, (const Bytef *)str, (uInt)len);
+    return JIM_OK;
+}
+
 static int Jim_Crc32(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
     long init;
-    const char *in;
-    int len;
+    uLong crc;
 
     if (argc == 1) {
         init = crc32(0L, Z_NULL, 0);
@@ -64,67 +72,122 @@ static int Jim_Crc32(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
         }
     }
 
-    in = Jim_GetString(argv[0], &len);
-    Jim_SetResultInt(interp, crc32((uLong)init, (const Bytef *)in, (uInt)len) & 0xFFFFFFFF);
+    /* The data may be a rope, so checksum it piece by piece */
+    crc = (uLong)init;
+    Jim_StringForeachChunk(interp, argv[0], JimCrc32Chunk, &crc);
+    Jim_SetResultInt(interp, crc & 0xFFFFFFFF);
+
+    return JIM_OK;
+}
+
+/* State for feeding the chunks of the input to deflate() */
+struct JimDeflateState {
+    z_stream strm;
+    int total;              /* Total length of the input */
+    int done;               /* Length of the input passed to deflate() so far */
+};
+
+static int JimDeflateLengthChunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    struct JimDeflateState *state = privData;
 
+    state->total += len;
     return JIM_OK;
 }
 
-static int Jim_Compress(Jim_Interp *interp, const char *in, int len, long level, int wbits)
+/* Passes the given input to deflate() with the given flush mode */
+static int JimDeflateInput(struct JimDeflateState *state, const char *str, int len, int flush)
 {
-    z_stream strm = {0};
+    state->strm.next_in = (Bytef *)str;
+    state->strm.avail_in = (uInt)len;
+
+    if (flush == Z_FINISH) {
+        return deflate(&state->strm, Z_FINISH) == Z_STREAM_END ? JIM_OK : JIM_ERR;
+    }
+    /* There is always enough output space, so all the input is consumed */
+    if (deflate(&state->strm, flush) != Z_OK || state->strm.avail_in) {
+        return JIM_ERR;
+    }
+    return JIM_OK;
+}
+
+static int JimDeflateChunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    struct JimDeflateState *state = privData;
+
+    /* The chunk is only valid during this call, so it is deflated here,
+     * and the last one (often the only one) is passed with Z_FINISH
+     */
+    state->done += len;
+    return JimDeflateInput(state, str, len, state->done == state->total ? Z_FINISH : Z_NO_FLUSH);
+}
+
+static int Jim_Compress(Jim_Interp *interp, Jim_Obj *inObj, long level, int wbits)
+{
+    struct JimDeflateState state;
+    z_stream *strm = &state.strm;
     Bytef *buf;
+    int ret;
 
     if ((level != Z_DEFAULT_COMPRESSION) && ((level < Z_NO_COMPRESSION) || (level > Z_BEST_COMPRESSION))) {
         Jim_SetResultString(interp, "level must be 0 to 9", -1);
         return JIM_ERR;
     }
 
-    if (deflateInit2(&strm, level, Z_DEFLATED, wbits, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    memset(&state, 0, sizeof(state));
+    if (deflateInit2(strm, level, Z_DEFLATED, wbits, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
         return JIM_ERR;
     }
 
-    strm.avail_out = deflateBound(&strm, (uLong)len);
+    /* The input may be a rope, so it is passed to deflate() piece by piece
+     * rather than being flattened.
+     */
+    Jim_StringForeachChunk(interp, inObj, JimDeflateLengthChunk, &state);
+
+    strm->avail_out = deflateBound(strm, (uLong)state.total);
 
     /* Some compression methods may need a little more space */
-    strm.avail_out += 100;
+    strm->avail_out += 100;
 
-    if (strm.avail_out > INT_MAX) {
-        deflateEnd(&strm);
+    if (strm->avail_out > INT_MAX) {
+        deflateEnd(strm);
         return JIM_ERR;
     }
-    buf = (Bytef *)Jim_Alloc((int)strm.avail_out);
-    strm.next_out = buf;
-    strm.next_in = (Bytef *)in;
-    strm.avail_in = (uInt)len;
+    buf = (Bytef *)Jim_Alloc((int)strm->avail_out);
+    strm->next_out = buf;
 
-    /* always compress in one pass - the return value holds the entire
+    /* always compress into a single buffer - the return value holds the entire
      * decompressed data anyway, so there's no reason to do chunked
      * decompression */
-    if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+    if (state.total == 0) {
+        /* No chunks to deflate, but the stream must still be finished */
+        ret = JimDeflateInput(&state, "", 0, Z_FINISH);
+    }
+    else {
+        ret = Jim_StringForeachChunk(interp, inObj, JimDeflateChunk, &state);
+    }
+    if (ret != JIM_OK) {
         Jim_Free(buf);
-        deflateEnd(&strm);
+        deflateEnd(strm);
         Jim_SetResultString(interp, "not enough output space", -1);
         return JIM_ERR;
     }
 
-    deflateEnd(&strm);
+    deflateEnd(strm);
 
-    if (strm.total_out > INT_MAX) {
+    if (strm->total_out > INT_MAX) {
         Jim_Free(buf);
         Jim_SetResultString(interp, "too much output", -1);
         return JIM_ERR;
     }
 
-    Jim_SetResult(interp, Jim_NewStringObjNoAlloc(interp, (char *)buf, (int)strm.total_out));
+    Jim_SetResult(interp, Jim_NewStringObjNoAlloc(interp, (char *)buf, (int)strm->total_out));
     return JIM_OK;
 }
 
 static int Jim_Deflate(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
     long level = Z_DEFAULT_COMPRESSION;
-    const char *in;
-    int len;
 
     if (argc != 1) {
         if (Jim_GetLong(interp, argv[1], &level) != JIM_OK) {
@@ -132,15 +195,12 @@ static int Jim_Deflate(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
         }
     }
 
-    in = Jim_GetString(argv[0], &len);
-    return Jim_Compress(interp, in, len, level, -MAX_WBITS);
+    return Jim_Compress(interp, argv[0], level, -MAX_WBITS);
 }
 
 static int Jim_Gzip(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
     long level = Z_DEFAULT_COMPRESSION;
-    const char *in;
-    int len;
 
     if (argc == 3) {
         if (!Jim_CompareStringImmediate(interp, argv[1], "-level")) {
@@ -156,8 +216,7 @@ static int Jim_Gzip(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
         return -1;
     }
 
-    in = Jim_GetString(argv[0], &len);
-    return Jim_Compress(interp, in, len, level, WBITS_GZIP);
+    return Jim_Compress(interp, argv[0], level, WBITS_GZIP);
 }
 
 static int Jim_Decompress(Jim_Interp *interp, const char *in, int len, long bufsiz, int wbits)
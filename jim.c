@@ -106,9 +106,23 @@
  */
 /*#define JIM_DISABLE_OBJECT_POOL*/
 
+#ifdef JIM_COMPACT_OBJ
+#ifdef JIM_REFERENCES
+#error "JIM_COMPACT_OBJ requires references to be disabled"
+#endif
+/* Without the live list links, free objects are linked through the internal rep */
+#define JimNextFreeObj(O) (O)->internalRep.ptr
+#else
+#define JimNextFreeObj(O) (O)->nextObjPtr
+#endif
+
 /* Maximum size of an integer */
 #define JIM_INTEGER_SPACE 24
 
+/* Range of values kept in the small int cache */
+#define JIM_INT_CACHE_MIN -128
+#define JIM_INT_CACHE_MAX 1023
+
 #if defined(DEBUG_SHOW_SCRIPT) || defined(DEBUG_SHOW_SCRIPT_TOKENS) || defined(JIM_DEBUG_COMMAND) || defined(DEBUG_SHOW_EXPR_TOKENS) || defined(DEBUG_SHOW_EXPR)
 #define JIM_TT_NAME
 static const char *jim_tt_name(int type);
@@ -154,6 +168,19 @@ static int JimGetWideNoErr(Jim_Interp *interp, Jim_Obj *objPtr, jim_wide * wideP
 static int JimSign(jim_wide w);
 static void JimPrngSeed(Jim_Interp *interp, unsigned char *seed, int seedLen);
 static void JimRandomBytes(Jim_Interp *interp, void *dest, unsigned int len);
+
+/* The seed for hashing object keys in dicts and hash tables.
+ * This is random to avoid a hash collision attack. See: n.runs-SA-2011.004
+ * Since dicts preserve order, this is not visible.
+ * The seed is shared by all interpreters because hash values are cached
+ * in objects and the Jim_HashTableType hash function has no access to the interpreter.
+ */
+static unsigned int JimHashSeed;
+#ifdef HAVE_ATOMIC_BUILTINS
+#define JimGetHashSeed() __atomic_load_n(&JimHashSeed, __ATOMIC_RELAXED)
+#else
+#define JimGetHashSeed() JimHashSeed
+#endif
 static int JimSetNewVariable(Jim_HashTable *ht, Jim_Obj *nameObjPtr, Jim_VarVal *vv);
 static Jim_VarVal *JimFindVariable(Jim_HashTable *ht, Jim_Obj *nameObjPtr);
 static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr);
@@ -386,8 +413,19 @@ static int JimStringCompareUtf8(const char *s1, int l1, const char *s2, int l2,
     }
     while (minlen) {
         int c1, c2;
-        s1 += utf8_tounicode_case(s1, &c1, nocase);
-        s2 += utf8_tounicode_case(s2, &c2, nocase);
+        if ((UCHAR(*s1) | UCHAR(*s2)) < 0x80) {
+            /* Both chars are ascii, so no need to decode them */
+            c1 = *s1++;
+            c2 = *s2++;
+            if (c1 != c2 && nocase) {
+                c1 = toupper(c1);
+                c2 = toupper(c2);
+            }
+        }
+        else {
+            s1 += utf8_tounicode_case(s1, &c1, nocase);
+            s2 += utf8_tounicode_case(s2, &c2, nocase);
+        }
         if (c1 != c2) {
             return JimSign(c1 - c2);
         }
@@ -403,6 +441,16 @@ static int JimStringCompareUtf8(const char *s1, int l1, const char *s2, int l2,
     return 0;
 }
 
+/**
+ * Case sensitive comparison of two pure ascii strings
+ * giving the same result as JimStringCompareUtf8(), but using memcmp().
+ */
+static int JimStringCompareAscii(const char *s1, int l1, const char *s2, int l2)
+{
+    int n = memcmp(s1, s2, l1 < l2 ? l1 : l2);
+    return JimSign(n ? n : l1 - l2);
+}
+
 /* Search for 's1' inside 's2', starting to search from char 'index' of 's2'.
  * The index of the first occurrence of s1 in s2 is returned.
  * If s1 is not found inside s2, -1 is returned.
@@ -425,7 +473,7 @@ static int JimStringFirst(const char *s1, int l1, const char *s2, int l2, int id
 
     for (i = idx; i <= l2 - l1; i++) {
         int c;
-        if (memcmp(s2, s1, l1bytelen) == 0) {
+        if (*s2 == *s1 && memcmp(s2, s1, l1bytelen) == 0) {
             return i;
         }
         s2 += utf8_tounicode(s2, &c);
@@ -433,35 +481,86 @@ static int JimStringFirst(const char *s1, int l1, const char *s2, int l2, int id
     return -1;
 }
 
-/* Search for the last occurrence 's1' inside 's2', starting to search from char 'index' of 's2'.
+/**
+ * Per JimStringFirst() but 'l1' and 'l2' are byte lengths.
+ * This may only be used if 's2' is pure ascii, since then
+ * the byte offset of a match is also the char index.
+ * memchr() and memcmp() are typically vectorised, so this is
+ * much faster than stepping through the string a char at a time.
+ */
+static int JimStringFirstAscii(const char *s1, int l1, const char *s2, int l2, int idx)
+{
+    const char *p;
+    const char *end;
+
+    if (!l1 || !l2 || l1 > l2 || idx > l2) {
+        return -1;
+    }
+    if (idx < 0)
+        idx = 0;
+
+    /* The last possible starting position of a match is end - 1 */
+    end = s2 + l2 - l1 + 1;
+    for (p = s2 + idx; p < end; p++) {
+        p = memchr(p, *s1, end - p);
+        if (p == NULL) {
+            break;
+        }
+        if (memcmp(p, s1, l1) == 0) {
+            return p - s2;
+        }
+    }
+    return -1;
+}
+
+/* Search for the last occurrence 's1' inside 's2' which starts before 'idx'.
  * The index of the last occurrence of s1 in s2 is returned.
  * If s1 is not found inside s2, -1 is returned.
  *
- * Note: Lengths and return value are in bytes, not chars.
+ * Note: Lengths, idx and return value are in bytes, not chars.
  */
-static int JimStringLast(const char *s1, int l1, const char *s2, int l2)
+static int JimStringLast(const char *s1, int l1, const char *s2, int l2, int idx)
 {
-    const char *p;
+    /* Number of possible starting positions of a match */
+    int n;
 
-    if (!l1 || !l2 || l1 > l2)
+    if (!l1 || l1 > idx || l1 > l2)
         return -1;
 
+    n = l2 - l1 + 1;
+    if (n > idx) {
+        n = idx;
+    }
     /* Now search for the needle */
-    for (p = s2 + l2 - 1; p != s2 - 1; p--) {
-        if (*p == *s1 && memcmp(s1, p, l1) == 0) {
+#ifdef HAVE_MEMRCHR
+    /* As for JimStringFirstAscii(), but searching backwards */
+    while (n > 0) {
+        const char *p = memrchr(s2, *s1, n);
+        if (p == NULL) {
+            break;
+        }
+        if (memcmp(p, s1, l1) == 0) {
             return p - s2;
         }
+        n = p - s2;
     }
+#else
+    while (n-- > 0) {
+        if (s2[n] == *s1 && memcmp(s2 + n, s1, l1) == 0) {
+            return n;
+        }
+    }
+#endif
     return -1;
 }
 
 #ifdef JIM_UTF8
 /**
- * Per JimStringLast but lengths and return value are in chars, not bytes.
+ * Per JimStringLast but 'l1', 'idx' and the return value are in chars, not bytes.
  */
-static int JimStringLastUtf8(const char *s1, int l1, const char *s2, int l2)
+static int JimStringLastUtf8(const char *s1, int l1, const char *s2, int l2, int idx)
 {
-    int n = JimStringLast(s1, utf8_index(s1, l1), s2, utf8_index(s2, l2));
+    int n = JimStringLast(s1, utf8_index(s1, l1), s2, l2, utf8_index(s2, idx));
     if (n > 0) {
         n = utf8_strlen(s2, n);
     }
@@ -705,6 +804,22 @@ void *JimDefaultAllocator(void *ptr, size_t size)
 
 void *(*Jim_Allocator)(void *ptr, size_t size) = JimDefaultAllocator;
 
+/* Allocate zero-filled memory with Jim_Alloc().
+ * With the default allocator this uses calloc(), which avoids touching
+ * every page of a large allocation up front.
+ */
+static void *JimAllocZeroed(size_t size)
+{
+    void *ptr;
+
+    if (Jim_Allocator == JimDefaultAllocator) {
+        return calloc(1, size);
+    }
+    ptr = Jim_Alloc(size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
 char *Jim_StrDup(const char *s)
 {
     return Jim_StrDupLen(s, strlen(s));
@@ -760,6 +875,22 @@ jim_wide Jim_GetTimeUsec(unsigned type)
 static void JimExpandHashTableIfNeeded(Jim_HashTable *ht);
 static unsigned int JimHashTableNextPower(unsigned int size);
 static Jim_HashEntry *JimInsertHashEntry(Jim_HashTable *ht, const void *key, int replace);
+static Jim_HashEntry *JimHashTableProbe(Jim_HashTable *ht, const void *key, unsigned int h, struct Jim_HashIndex **slot);
+static struct Jim_HashIndex *JimHashIndexFreeSlot(struct Jim_HashIndex *index, unsigned int sizemask, unsigned int h);
+static struct Jim_HashIndex *JimHashTableEntrySlot(Jim_HashTable *ht, unsigned int i);
+static void JimHashTableRehashStep(Jim_HashTable *ht, unsigned int n);
+
+/* The number of entries in the entries table for an index of the given size.
+ * This keeps the index no more than 3/4 full, so probing always finds an empty slot.
+ */
+#define JimHashTableCapacity(size) ((size) / 4 * 3)
+
+/* Growing a hash table (or dict) index of at least this size is done
+ * incrementally, with each operation moving JIM_HT_REHASH_STEP slots of
+ * the old index to the new index, to avoid long pauses with large tables.
+ */
+#define JIM_HT_REHASH_MIN 65536
+#define JIM_HT_REHASH_STEP 64
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -775,10 +906,87 @@ unsigned int Jim_IntHashFunction(unsigned int key)
     return key;
 }
 
-/* Generic string hash function */
-unsigned int Jim_GenHashFunction(const unsigned char *string, int length)
+#ifdef HAVE_LONG_LONG
+/* A seeded string hash based on wyhash, which processes 8 bytes at a time.
+ * https://github.com/wangyi-fudan/wyhash
+ */
+#define JIM_HASH_P0 0xa0761d6478bd642fULL
+#define JIM_HASH_P1 0xe7037ed1a0b428dbULL
+#define JIM_HASH_P2 0x8ebc6af09c88c6e3ULL
+
+/* Returns the 128 bit product of a and b folded to 64 bits */
+static unsigned jim_wide JimHashMix(unsigned jim_wide a, unsigned jim_wide b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (unsigned jim_wide)r ^ (unsigned jim_wide)(r >> 64);
+#else
+    unsigned jim_wide ha = a >> 32, hb = b >> 32, la = (unsigned)a, lb = (unsigned)b;
+    unsigned jim_wide rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    unsigned jim_wide t = rl + (rm0 << 32);
+    unsigned jim_wide lo = t + (rm1 << 32);
+    unsigned jim_wide hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+    return lo ^ hi;
+#endif
+}
+
+static unsigned jim_wide JimHashRead8(const unsigned char *p)
+{
+    unsigned jim_wide v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned jim_wide JimHashRead4(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int JimHashBytes(const unsigned char *p, int len, unsigned int seed)
+{
+    unsigned jim_wide a, b;
+    unsigned jim_wide h = seed ^ JimHashMix(seed ^ JIM_HASH_P0, JIM_HASH_P1);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            int mid = (len >> 3) << 2;
+            a = (JimHashRead4(p) << 32) | JimHashRead4(p + mid);
+            b = (JimHashRead4(p + len - 4) << 32) | JimHashRead4(p + len - 4 - mid);
+        }
+        else if (len > 0) {
+            a = ((unsigned jim_wide)p[0] << 16) | ((unsigned jim_wide)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        int i = len;
+        while (i > 16) {
+            h = JimHashMix(JimHashRead8(p) ^ JIM_HASH_P1, JimHashRead8(p + 8) ^ h);
+            p += 16;
+            i -= 16;
+        }
+        a = JimHashRead8(p + i - 16);
+        b = JimHashRead8(p + i - 8);
+    }
+    h = JimHashMix(JimHashMix(a ^ JIM_HASH_P1, b ^ h) ^ JIM_HASH_P0 ^ len, JIM_HASH_P1);
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+/* Hashes an integer key */
+static unsigned int JimHashInt(jim_wide w, unsigned int seed)
+{
+    unsigned jim_wide h = JimHashMix((unsigned jim_wide)w ^ JIM_HASH_P2 ^ seed, JIM_HASH_P1 ^ seed);
+    return (unsigned int)(h ^ (h >> 32));
+}
+#else
+static unsigned int JimHashBytes(const unsigned char *string, int length, unsigned int seed)
 {
-    unsigned result = 0;
+    unsigned result = seed;
     string += length;
     while (length--) {
         result += (result << 3) + (unsigned char)(*--string);
@@ -786,6 +994,56 @@ unsigned int Jim_GenHashFunction(const unsigned char *string, int length)
     return result;
 }
 
+static unsigned int JimHashInt(jim_wide w, unsigned int seed)
+{
+    return Jim_IntHashFunction((unsigned)w ^ (unsigned)(w >> 16 >> 16) ^ seed);
+}
+#endif
+
+/* Generic string hash function */
+unsigned int Jim_GenHashFunction(const unsigned char *string, int length)
+{
+    return JimHashBytes(string, length, 0);
+}
+
+/* Integers less than this magnitude are hashed by value.
+ * The canonical form of these has at most JIM_HASH_INT_MAXLEN characters.
+ */
+#ifdef HAVE_LONG_LONG
+#define JIM_HASH_INT_LIMIT 100000000000000000LL
+#define JIM_HASH_INT_MAXLEN 18
+#else
+#define JIM_HASH_INT_LIMIT 100000000L
+#define JIM_HASH_INT_MAXLEN 9
+#endif
+
+/* Hashes a string key, which must give the same result as JimHashInt() for the
+ * canonical decimal form of an integer, so that integer objects can be hashed
+ * without generating the string rep.
+ */
+static unsigned int JimHashString(const char *str, int len, unsigned int seed)
+{
+    if (len && len <= JIM_HASH_INT_MAXLEN && ((*str >= '1' && *str <= '9') || *str == '-' || len == 1)) {
+        /* Possibly a canonical integer: no leading zeros or plus sign */
+        const char *p = str;
+        const char *end = str + len;
+        jim_wide w = 0;
+
+        if (*p == '-') {
+            p++;
+        }
+        if (p < end && (*p != '0' || (p + 1 == end && p == str))) {
+            while (p < end && *p >= '0' && *p <= '9') {
+                w = w * 10 + (*p++ - '0');
+            }
+            if (p == end && w < JIM_HASH_INT_LIMIT) {
+                return JimHashInt(*str == '-' ? -w : w, seed);
+            }
+        }
+    }
+    return JimHashBytes((const unsigned char *)str, len, seed);
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /*
@@ -798,10 +1056,15 @@ unsigned int Jim_GenHashFunction(const unsigned char *string, int length)
 static void JimResetHashTable(Jim_HashTable *ht)
 {
     ht->table = NULL;
+    ht->index = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
     ht->collisions = 0;
+    ht->len = 0;
+    ht->oldindex = NULL;
+    ht->oldsize = 0;
+    ht->rehashidx = 0;
 #ifdef JIM_RANDOMISE_HASH
     /* This is initialised to a random value to avoid a hash collision attack.
      * See: n.runs-SA-2011.004
@@ -817,8 +1080,6 @@ static void JimInitHashTableIterator(Jim_HashTable *ht, Jim_HashTableIterator *i
 {
     iter->ht = ht;
     iter->index = -1;
-    iter->entry = NULL;
-    iter->nextEntry = NULL;
 }
 
 /* Initialize the hash table */
@@ -830,10 +1091,19 @@ int Jim_InitHashTable(Jim_HashTable *ht, const Jim_HashTableType *type, void *pr
     return JIM_OK;
 }
 
-/* Expand or create the hashtable */
+/* Expand or create the hashtable.
+ * Normally the index is rebuilt with (at least) the given size, and the
+ * entries table is compacted to discard any removed entries.
+ * Entries remain in insertion order.
+ *
+ * Large tables with few removed entries are instead grown in place and
+ * the index is rehashed incrementally. See JimHashTableRehashStep().
+ */
 void Jim_ExpandHashTable(Jim_HashTable *ht, unsigned int size)
 {
-    Jim_HashTable n;            /* the new hashtable */
+    struct Jim_HashIndex *oldindex = ht->index;
+    Jim_HashEntry *oldtable = ht->table;
+    unsigned int oldlen = ht->len;
     unsigned int realsize = JimHashTableNextPower(size), i;
 
     /* the size is invalid if it is smaller than the number of
@@ -841,46 +1111,48 @@ void Jim_ExpandHashTable(Jim_HashTable *ht, unsigned int size)
      if (size <= ht->used)
         return;
 
-    Jim_InitHashTable(&n, ht->type, ht->privdata);
-    n.size = realsize;
-    n.sizemask = realsize - 1;
-    n.table = Jim_Alloc(realsize * sizeof(Jim_HashEntry *));
-    /* Keep the same 'uniq' as the original */
-    n.uniq = ht->uniq;
-
-    /* Initialize all the pointers to NULL */
-    memset(n.table, 0, realsize * sizeof(Jim_HashEntry *));
+    /* The entries table must have room for more than the current entries */
+    while (JimHashTableCapacity(realsize) <= ht->used && realsize < 2147483648U) {
+        realsize *= 2;
+    }
 
-    /* Copy all the elements from the old to the new table:
-     * note that if the old hash table is empty ht->used is zero,
-     * so Jim_ExpandHashTable just creates an empty hash table. */
-    n.used = ht->used;
-    for (i = 0; ht->used > 0; i++) {
-        Jim_HashEntry *he, *nextHe;
+    if (ht->size >= JIM_HT_REHASH_MIN && realsize > ht->size &&
+        JimHashTableCapacity(realsize) > ht->len && ht->len - ht->used <= ht->used / 4) {
+        /* Any previous incremental rehash must be complete before starting a new one */
+        JimHashTableRehashStep(ht, ht->oldsize);
 
-        if (ht->table[i] == NULL)
-            continue;
+        /* Keep the existing entries, so the offsets in the old index remain valid */
+        ht->table = Jim_Realloc(ht->table, JimHashTableCapacity(realsize) * sizeof(*ht->table));
+        ht->oldindex = ht->index;
+        ht->oldsize = ht->size;
+        ht->rehashidx = 0;
+        ht->index = JimAllocZeroed(realsize * sizeof(*ht->index));
+        ht->size = realsize;
+        ht->sizemask = realsize - 1;
+        return;
+    }
 
-        /* For each hash entry on this slot... */
-        he = ht->table[i];
-        while (he) {
-            unsigned int h;
+    /* An offset of 0 marks an empty slot */
+    ht->index = JimAllocZeroed(realsize * sizeof(*ht->index));
+    ht->table = Jim_Alloc(JimHashTableCapacity(realsize) * sizeof(*ht->table));
+    ht->size = realsize;
+    ht->sizemask = realsize - 1;
+    ht->len = 0;
 
-            nextHe = he->next;
-            /* Get the new element index */
-            h = Jim_HashKey(ht, he->key) & n.sizemask;
-            he->next = n.table[h];
-            n.table[h] = he;
-            ht->used--;
-            /* Pass to the next element */
-            he = nextHe;
+    /* Copy all the live elements from the old to the new table.
+     * The hash is stored in each entry, so there is no need to rehash the keys. */
+    for (i = 0; i < oldlen; i++) {
+        Jim_HashEntry *he = &oldtable[i];
+        if (he->key) {
+            ht->table[ht->len] = *he;
+            JimHashIndexFreeSlot(ht->index, ht->sizemask, he->hash)->offset = ++ht->len;
         }
     }
-    assert(ht->used == 0);
-    Jim_Free(ht->table);
-
-    /* Remap the new hashtable in the old */
-    *ht = n;
+    Jim_Free(oldindex);
+    Jim_Free(oldtable);
+    /* The new index is complete, so any incremental rehash in progress is abandoned */
+    Jim_Free(ht->oldindex);
+    ht->oldindex = NULL;
 }
 
 /* Add an element to the target hash table
@@ -909,18 +1181,16 @@ int Jim_ReplaceHashEntry(Jim_HashTable *ht, const void *key, void *val)
     entry = JimInsertHashEntry(ht, key, 1);
     if (entry->key) {
         /* It already exists, so only replace the value.
-         * Note if both a destructor and a duplicate function exist,
-         * need to dup before destroy. perhaps they are the same
-         * reference counted object
+         * Note that the new value is stored (and dup'ed) before the old value
+         * is destroyed since they may be the same reference counted object.
+         * Also the destructor may modify this hash table, which
+         * can move the entry.
          */
-        if (ht->type->valDestructor && ht->type->valDup) {
-            void *newval = ht->type->valDup(ht->privdata, val);
-            ht->type->valDestructor(ht->privdata, entry->u.val);
-            entry->u.val = newval;
-        }
-        else {
-            Jim_FreeEntryVal(ht, entry);
-            Jim_SetHashVal(ht, entry, val);
+        void *oldval = entry->u.val;
+
+        Jim_SetHashVal(ht, entry, val);
+        if (ht->type->valDestructor) {
+            ht->type->valDestructor(ht->privdata, oldval);
         }
         existed = 1;
     }
@@ -934,6 +1204,22 @@ int Jim_ReplaceHashEntry(Jim_HashTable *ht, const void *key, void *val)
     return existed;
 }
 
+/* Marks the live entry at the given index slot as removed and then frees the key and value.
+ * The entry is removed first in case a destructor modifies the hash table.
+ */
+static void JimRemoveHashEntry(Jim_HashTable *ht, struct Jim_HashIndex *slot)
+{
+    Jim_HashEntry *he = &ht->table[slot->offset - 1];
+    Jim_HashEntry removed = *he;
+
+    /* An index slot with offset -1 is a removed entry */
+    slot->offset = -1;
+    he->key = NULL;
+    ht->used--;
+    Jim_FreeEntryKey(ht, &removed);
+    Jim_FreeEntryVal(ht, &removed);
+}
+
 /**
  * Search the hash table for the given key.
  * If found, removes the hash entry and returns JIM_OK.
@@ -942,25 +1228,11 @@ int Jim_ReplaceHashEntry(Jim_HashTable *ht, const void *key, void *val)
 int Jim_DeleteHashEntry(Jim_HashTable *ht, const void *key)
 {
     if (ht->used) {
-        unsigned int h = Jim_HashKey(ht, key) & ht->sizemask;
-        Jim_HashEntry *prevHe = NULL;
-        Jim_HashEntry *he = ht->table[h];
-
-        while (he) {
-            if (Jim_CompareHashKeys(ht, key, he->key)) {
-                /* Unlink the element from the list */
-                if (prevHe)
-                    prevHe->next = he->next;
-                else
-                    ht->table[h] = he->next;
-                ht->used--;
-                Jim_FreeEntryKey(ht, he);
-                Jim_FreeEntryVal(ht, he);
-                Jim_Free(he);
-                return JIM_OK;
-            }
-            prevHe = he;
-            he = he->next;
+        struct Jim_HashIndex *slot;
+
+        if (JimHashTableProbe(ht, key, Jim_HashKey(ht, key), &slot)) {
+            JimRemoveHashEntry(ht, slot);
+            return JIM_OK;
         }
     }
     /* not found */
@@ -975,20 +1247,22 @@ void Jim_ClearHashTable(Jim_HashTable *ht)
 {
     unsigned int i;
 
-    /* Free all the elements */
-    for (i = 0; ht->used > 0; i++) {
-        Jim_HashEntry *he, *nextHe;
-
-        he = ht->table[i];
-        while (he) {
-            nextHe = he->next;
-            Jim_FreeEntryKey(ht, he);
-            Jim_FreeEntryVal(ht, he);
-            Jim_Free(he);
-            ht->used--;
-            he = nextHe;
+    /* Free all the elements. Rescan in case a destructor added new entries. */
+    while (ht->used) {
+        for (i = 0; ht->used > 0 && i < ht->len; i++) {
+            Jim_HashEntry *he = &ht->table[i];
+            if (he->key) {
+                JimRemoveHashEntry(ht, JimHashTableEntrySlot(ht, i));
+            }
         }
-        ht->table[i] = NULL;
+    }
+    if (ht->len) {
+        memset(ht->index, 0, ht->size * sizeof(*ht->index));
+        ht->len = 0;
+    }
+    if (ht->oldindex) {
+        Jim_Free(ht->oldindex);
+        ht->oldindex = NULL;
     }
 }
 
@@ -998,7 +1272,8 @@ void Jim_ClearHashTable(Jim_HashTable *ht)
 int Jim_FreeHashTable(Jim_HashTable *ht)
 {
     Jim_ClearHashTable(ht);
-    /* Free the table and the allocated cache structure */
+    /* Free the index and entries table */
+    Jim_Free(ht->index);
     Jim_Free(ht->table);
     /* Re-initialize the table */
     JimResetHashTable(ht);
@@ -1007,19 +1282,11 @@ int Jim_FreeHashTable(Jim_HashTable *ht)
 
 Jim_HashEntry *Jim_FindHashEntry(Jim_HashTable *ht, const void *key)
 {
-    Jim_HashEntry *he;
-    unsigned int h;
+    struct Jim_HashIndex *slot;
 
     if (ht->used == 0)
         return NULL;
-    h = Jim_HashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
-    while (he) {
-        if (Jim_CompareHashKeys(ht, key, he->key))
-            return he;
-        he = he->next;
-    }
-    return NULL;
+    return JimHashTableProbe(ht, key, Jim_HashKey(ht, key), &slot);
 }
 
 Jim_HashTableIterator *Jim_GetHashTableIterator(Jim_HashTable *ht)
@@ -1029,23 +1296,18 @@ Jim_HashTableIterator *Jim_GetHashTableIterator(Jim_HashTable *ht)
     return iter;
 }
 
+/* Entries are returned in insertion order.
+ * It is safe for the iterator user to delete the entry just returned
+ * since removed entries are not moved.
+ */
 Jim_HashEntry *Jim_NextHashEntry(Jim_HashTableIterator *iter)
 {
-    while (1) {
-        if (iter->entry == NULL) {
-            iter->index++;
-            if (iter->index >= (signed)iter->ht->size)
-                break;
-            iter->entry = iter->ht->table[iter->index];
-        }
-        else {
-            iter->entry = iter->nextEntry;
-        }
-        if (iter->entry) {
-            /* We need to save the 'next' here, the iterator user
-             * may delete the entry we are returning. */
-            iter->nextEntry = iter->entry->next;
-            return iter->entry;
+    Jim_HashTable *ht = iter->ht;
+
+    while (++iter->index < (signed)ht->len) {
+        Jim_HashEntry *he = &ht->table[iter->index];
+        if (he->key) {
+            return he;
         }
     }
     return NULL;
@@ -1056,12 +1318,14 @@ Jim_HashEntry *Jim_NextHashEntry(Jim_HashTableIterator *iter)
 /* Expand the hash table if needed */
 static void JimExpandHashTableIfNeeded(Jim_HashTable *ht)
 {
-    /* If the hash table is empty expand it to the intial size,
-     * if the table is "full" double its size. */
+    /* If the hash table is empty expand it to the intial size.
+     * If the entries table is full, including removed entries, rebuild it
+     * at twice the number of live entries. This grows the table or discards
+     * removed entries as appropriate. */
     if (ht->size == 0)
         Jim_ExpandHashTable(ht, JIM_HT_INITIAL_SIZE);
-    if (ht->size == ht->used)
-        Jim_ExpandHashTable(ht, ht->size * 2);
+    else if (ht->len >= JimHashTableCapacity(ht->size))
+        Jim_ExpandHashTable(ht, (ht->used + 1) * 2);
 }
 
 /* Our hash table capability is a power of two */
@@ -1078,7 +1342,139 @@ static unsigned int JimHashTableNextPower(unsigned int size)
     }
 }
 
-/* Returns the index of a free slot that can be populated with
+/* Returns the first empty slot in the probe sequence for hash 'h'
+ * in the given index, with the hash set.
+ */
+static struct Jim_HashIndex *JimHashIndexFreeSlot(struct Jim_HashIndex *index, unsigned int sizemask, unsigned int h)
+{
+    unsigned int idx = h & sizemask;
+    unsigned int peturb = h;
+
+    while (index[idx].offset) {
+        /* Use the Python algorithm for conflict resolution */
+        peturb >>= 5;
+        idx = (5 * idx + 1 + peturb) & sizemask;
+    }
+    index[idx].hash = h;
+    return &index[idx];
+}
+
+/* Moves up to 'n' slots of the old index into the new index during an incremental rehash.
+ * This is shared by Jim_HashTable and Jim_Dict.
+ *
+ * Moved slots are marked as removed in the old index so that lookups which
+ * still need to search the old index continue past them.
+ * Returns 1 if the rehash is complete, in which case the old index
+ * may be freed.
+ */
+static int JimHashIndexRehash(struct Jim_HashIndex *index, unsigned int sizemask,
+    struct Jim_HashIndex *oldindex, unsigned int oldsize, unsigned int *rehashidx, unsigned int n)
+{
+    while (n-- && *rehashidx < oldsize) {
+        struct Jim_HashIndex *old = &oldindex[(*rehashidx)++];
+        if (old->offset > 0) {
+            JimHashIndexFreeSlot(index, sizemask, old->hash)->offset = old->offset;
+            old->offset = -1;
+        }
+    }
+    return *rehashidx == oldsize;
+}
+
+/* Continues an incremental rehash (if any) by moving up to 'n' slots of the old index */
+static void JimHashTableRehashStep(Jim_HashTable *ht, unsigned int n)
+{
+    if (ht->oldindex && JimHashIndexRehash(ht->index, ht->sizemask, ht->oldindex, ht->oldsize, &ht->rehashidx, n)) {
+        Jim_Free(ht->oldindex);
+        ht->oldindex = NULL;
+    }
+}
+
+/* Searches the probe sequence for hash 'h' in the given index for the given key.
+ * Returns the index slot if found, or NULL if not.
+ * If not found, sets *freeslot to the first removed or empty slot in the
+ * probe sequence, where the key may be inserted.
+ */
+static struct Jim_HashIndex *JimHashTableProbeIndex(Jim_HashTable *ht, struct Jim_HashIndex *index,
+    unsigned int sizemask, const void *key, unsigned int h, struct Jim_HashIndex **freeslot)
+{
+    unsigned int idx = h & sizemask;
+    unsigned int peturb = h;
+    struct Jim_HashIndex *removed = NULL;
+    int offset;
+
+    while ((offset = index[idx].offset)) {
+        if (offset == -1) {
+            if (removed == NULL) {
+                removed = &index[idx];
+            }
+        }
+        else if (index[idx].hash == h && Jim_CompareHashKeys(ht, key, ht->table[offset - 1].key)) {
+            return &index[idx];
+        }
+        peturb >>= 5;
+        idx = (5 * idx + 1 + peturb) & sizemask;
+    }
+    *freeslot = removed ? removed : &index[idx];
+    return NULL;
+}
+
+/* Searches the hash table for the given key with hash 'h'.
+ * Returns the entry if found, or NULL if not.
+ * Sets *slot to the index slot of the entry if found, otherwise to the slot
+ * in the (new) index where the key may be inserted.
+ *
+ * During an incremental rehash, each search moves some of the old index,
+ * and keys not found in the new index are also searched in the old index.
+ */
+static Jim_HashEntry *JimHashTableProbe(Jim_HashTable *ht, const void *key, unsigned int h, struct Jim_HashIndex **slot)
+{
+    struct Jim_HashIndex *found;
+
+    if (ht->oldindex) {
+        JimHashTableRehashStep(ht, JIM_HT_REHASH_STEP);
+    }
+    found = JimHashTableProbeIndex(ht, ht->index, ht->sizemask, key, h, slot);
+    if (found == NULL && ht->oldindex) {
+        struct Jim_HashIndex *unused;
+        found = JimHashTableProbeIndex(ht, ht->oldindex, ht->oldsize - 1, key, h, &unused);
+    }
+    if (found) {
+        *slot = found;
+        return &ht->table[found->offset - 1];
+    }
+    return NULL;
+}
+
+/* Returns the slot in the given index which refers to offset 'i' in the entries table, or NULL if none */
+static struct Jim_HashIndex *JimHashIndexEntrySlot(struct Jim_HashIndex *index, unsigned int sizemask, unsigned int h, unsigned int i)
+{
+    unsigned int idx = h & sizemask;
+    unsigned int peturb = h;
+
+    while (index[idx].offset) {
+        if (index[idx].offset == (int)i + 1) {
+            return &index[idx];
+        }
+        peturb >>= 5;
+        idx = (5 * idx + 1 + peturb) & sizemask;
+    }
+    return NULL;
+}
+
+/* Returns the index slot which refers to the live entry at offset 'i' in the entries table */
+static struct Jim_HashIndex *JimHashTableEntrySlot(Jim_HashTable *ht, unsigned int i)
+{
+    unsigned int h = ht->table[i].hash;
+    struct Jim_HashIndex *slot = JimHashIndexEntrySlot(ht->index, ht->sizemask, h, i);
+
+    if (slot == NULL) {
+        /* Not yet moved from the old index */
+        slot = JimHashIndexEntrySlot(ht->oldindex, ht->oldsize - 1, h, i);
+    }
+    return slot;
+}
+
+/* Returns the entry that can be populated with
  * a hash entry for the given 'key'.
  * If the key already exists the result depends upon whether 'replace' is set.
  * If replace is false, returns NULL.
@@ -1090,26 +1486,30 @@ static Jim_HashEntry *JimInsertHashEntry(Jim_HashTable *ht, const void *key, int
 {
     unsigned int h;
     Jim_HashEntry *he;
+    struct Jim_HashIndex *slot;
 
     /* Expand the hashtable if needed */
     JimExpandHashTableIfNeeded(ht);
 
     /* Compute the key hash value */
-    h = Jim_HashKey(ht, key) & ht->sizemask;
-    /* Search if this slot does not already contain the given key */
-    he = ht->table[h];
-    while (he) {
-        if (Jim_CompareHashKeys(ht, key, he->key))
-            return replace ? he : NULL;
-        he = he->next;
-    }
-
-    /* Allocates the memory and stores key */
-    he = Jim_Alloc(sizeof(*he));
-    he->next = ht->table[h];
-    ht->table[h] = he;
-    ht->used++;
+    h = Jim_HashKey(ht, key);
+    /* Search if the table does not already contain the given key */
+    he = JimHashTableProbe(ht, key, h, &slot);
+    if (he) {
+        return replace ? he : NULL;
+    }
+
+    /* New entries are added at the end of the entries table,
+     * reusing a removed index slot if possible */
+    if (slot->offset == 0 && slot != &ht->index[h & ht->sizemask]) {
+        ht->collisions++;
+    }
+    he = &ht->table[ht->len++];
+    slot->offset = ht->len;
+    slot->hash = h;
     he->key = NULL;
+    he->hash = h;
+    ht->used++;
 
     return he;
 }
@@ -2231,6 +2631,33 @@ static int JimParseListStr(struct JimParserCtx *pc)
  * Jim_Obj related functions
  * ---------------------------------------------------------------------------*/
 
+#ifdef JIM_INLINE_STRINGS
+/* Returns 1 if the string rep of the object is held in the object itself */
+#define JimHasInlineBytes(O) ((O)->bytes == (O)->inlineBytes)
+#else
+#define JimHasInlineBytes(O) 0
+#endif
+
+/* Returns 1 if the string rep of the object was allocated with Jim_Alloc() */
+#define JimHasAllocatedBytes(O) \
+    ((O)->bytes != NULL && (O)->bytes != JimEmptyStringRep && !JimHasInlineBytes(O))
+
+/* Sets the string rep of the object to an uninitialised buffer with room
+ * for len bytes plus the null terminator, and returns the buffer.
+ * With JIM_INLINE_STRINGS, short strings use the buffer within the object.
+ */
+static char *JimAllocStringBytes(Jim_Obj *objPtr, int len)
+{
+#ifdef JIM_INLINE_STRINGS
+    if (len < JIM_OBJ_INLINE_BYTES) {
+        objPtr->bytes = objPtr->inlineBytes;
+        return objPtr->bytes;
+    }
+#endif
+    objPtr->bytes = Jim_Alloc(len + 1);
+    return objPtr->bytes;
+}
+
 /* Return a new initialized object. */
 Jim_Obj *Jim_NewObj(Jim_Interp *interp)
 {
@@ -2240,7 +2667,7 @@ Jim_Obj *Jim_NewObj(Jim_Interp *interp)
     if (interp->freeList != NULL) {
         /* -- Unlink the object from the free list -- */
         objPtr = interp->freeList;
-        interp->freeList = objPtr->nextObjPtr;
+        interp->freeList = JimNextFreeObj(objPtr);
     }
     else {
         /* -- No ready to use objects: allocate a new one -- */
@@ -2252,16 +2679,21 @@ Jim_Obj *Jim_NewObj(Jim_Interp *interp)
      * scanning objects with refCount == 0. */
     objPtr->refCount = 0;
     objPtr->taint = interp->taint;
+    objPtr->hash = 0;
     /* All the other fields are left uninitialized to save time.
      * The caller will probably want to set them to the right
      * value anyway. */
 
+#ifdef JIM_COMPACT_OBJ
+    interp->liveCount++;
+#else
     /* -- Put the object into the live list -- */
     objPtr->prevObjPtr = NULL;
     objPtr->nextObjPtr = interp->liveList;
     if (interp->liveList)
         interp->liveList->prevObjPtr = objPtr;
     interp->liveList = objPtr;
+#endif
 
     return objPtr;
 }
@@ -2278,10 +2710,12 @@ void Jim_FreeObj(Jim_Interp *interp, Jim_Obj *objPtr)
     /* Free the internal representation */
     Jim_FreeIntRep(interp, objPtr);
     /* Free the string representation */
-    if (objPtr->bytes != NULL) {
-        if (objPtr->bytes != JimEmptyStringRep)
-            Jim_Free(objPtr->bytes);
+    if (JimHasAllocatedBytes(objPtr)) {
+        Jim_Free(objPtr->bytes);
     }
+#ifdef JIM_COMPACT_OBJ
+    interp->liveCount--;
+#else
     /* Unlink the object from the live objects list */
     if (objPtr->prevObjPtr)
         objPtr->prevObjPtr->nextObjPtr = objPtr->nextObjPtr;
@@ -2289,14 +2723,12 @@ void Jim_FreeObj(Jim_Interp *interp, Jim_Obj *objPtr)
         objPtr->nextObjPtr->prevObjPtr = objPtr->prevObjPtr;
     if (interp->liveList == objPtr)
         interp->liveList = objPtr->nextObjPtr;
+#endif
 #ifdef JIM_DISABLE_OBJECT_POOL
     Jim_Free(objPtr);
 #else
     /* Link the object into the free objects list */
-    objPtr->prevObjPtr = NULL;
-    objPtr->nextObjPtr = interp->freeList;
-    if (interp->freeList)
-        interp->freeList->prevObjPtr = objPtr;
+    JimNextFreeObj(objPtr) = interp->freeList;
     interp->freeList = objPtr;
     objPtr->refCount = -1;
 #endif
@@ -2305,11 +2737,11 @@ void Jim_FreeObj(Jim_Interp *interp, Jim_Obj *objPtr)
 /* Invalidate the string representation of an object. */
 void Jim_InvalidateStringRep(Jim_Obj *objPtr)
 {
-    if (objPtr->bytes != NULL) {
-        if (objPtr->bytes != JimEmptyStringRep)
-            Jim_Free(objPtr->bytes);
+    if (JimHasAllocatedBytes(objPtr)) {
+        Jim_Free(objPtr->bytes);
     }
     objPtr->bytes = NULL;
+    objPtr->hash = 0;
 }
 
 /* Duplicate an object. The returned object has refcount = 0. */
@@ -2334,10 +2766,11 @@ Jim_Obj *Jim_DuplicateObj(Jim_Interp *interp, Jim_Obj *objPtr)
         return dupPtr;
     }
     else {
-        dupPtr->bytes = Jim_Alloc(objPtr->length + 1);
+        JimAllocStringBytes(dupPtr, objPtr->length);
         dupPtr->length = objPtr->length;
         /* Copy the null byte too */
         memcpy(dupPtr->bytes, objPtr->bytes, objPtr->length + 1);
+        dupPtr->hash = objPtr->hash;
     }
 
     /* By default, the new object has the same type as the old object */
@@ -2393,8 +2826,8 @@ const char *Jim_String(Jim_Obj *objPtr)
 /* Replace an object's string representation with a duplicated C string. */
 static void JimSetStringBytes(Jim_Obj *objPtr, const char *str)
 {
-    objPtr->bytes = Jim_StrDup(str);
     objPtr->length = strlen(str);
+    memcpy(JimAllocStringBytes(objPtr, objPtr->length), str, objPtr->length + 1);
 }
 
 static void FreeDictSubstInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
@@ -2440,14 +2873,48 @@ static void DupInterpolatedInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_
 static void DupStringInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
 static int SetStringFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr);
 
+#ifdef JIM_UTF8
+static void FreeStringInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
+#else
+#define FreeStringInternalRep NULL
+#endif
+
 static const Jim_ObjType stringObjType = {
     "string",
-    NULL,
+    FreeStringInternalRep,
     DupStringInternalRep,
     NULL,
     JIM_TYPE_REFERENCES,
 };
 
+#ifdef JIM_UTF8
+/* Indexing a utf-8 string by char needs a scan from the start of the string.
+ * To avoid this for long strings that aren't pure ascii, the string rep keeps
+ * a sparse index of the byte offset of every JIM_UTF8_INDEX_STEP'th char.
+ * This is built lazily, only as far as needed, and since the offsets only
+ * depend on the preceding bytes, it remains valid when the string is appended to.
+ */
+#define JIM_UTF8_INDEX_MIN 256
+#define JIM_UTF8_INDEX_STEP 64
+
+struct Jim_Utf8Index {
+    int count;          /* Number of checkpoints */
+    int size;           /* Allocated number of checkpoints */
+    int offset[1];      /* offset[i] is the byte offset of char i * JIM_UTF8_INDEX_STEP */
+};
+
+/* Free the char index of a string object, if any. */
+static void FreeStringInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    JIM_NOTUSED(interp);
+
+    if (objPtr->internalRep.strValue.utf8Index) {
+        Jim_Free(objPtr->internalRep.strValue.utf8Index);
+        objPtr->internalRep.strValue.utf8Index = NULL;
+    }
+}
+#endif
+
 /* Copy cached string metadata when duplicating a string object. */
 static void DupStringInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
 {
@@ -2460,6 +2927,7 @@ static void DupStringInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *d
      * srcPtr->length bytes. So we just set it to length. */
     dupPtr->internalRep.strValue.maxLength = srcPtr->length;
     dupPtr->internalRep.strValue.charLength = srcPtr->internalRep.strValue.charLength;
+    dupPtr->internalRep.strValue.utf8Index = NULL;
 }
 
 /* Convert an object to the canonical string internal representation. */
@@ -2479,6 +2947,7 @@ static int SetStringFromAny(Jim_Interp *interp, Jim_Obj *objPtr)
         objPtr->internalRep.strValue.maxLength = objPtr->length;
         /* Don't know the utf-8 length yet */
         objPtr->internalRep.strValue.charLength = -1;
+        objPtr->internalRep.strValue.utf8Index = NULL;
     }
     return JIM_OK;
 }
@@ -2502,22 +2971,78 @@ int Jim_Utf8Length(Jim_Interp *interp, Jim_Obj *objPtr)
 #endif
 }
 
-/* len is in bytes -- see also Jim_NewStringObjUtf8() */
-Jim_Obj *Jim_NewStringObj(Jim_Interp *interp, const char *s, int len)
+/**
+ * Returns the byte offset of char 'charindex' in the string object,
+ * which must already have its char length from Jim_Utf8Length().
+ */
+static int JimStringUtf8Index(Jim_Obj *objPtr, int charindex)
 {
-    Jim_Obj *objPtr = Jim_NewObj(interp);
+#ifdef JIM_UTF8
+    struct Jim_Utf8Index *index;
+    int i;
 
-    /* Need to find out how many bytes the string requires */
-    if (len == -1)
-        len = strlen(s);
-    /* Alloc/Set the string rep. */
-    if (len == 0) {
-        objPtr->bytes = JimEmptyStringRep;
+    if (objPtr->internalRep.strValue.charLength == objPtr->length) {
+        /* Pure ascii, so no need to decode anything */
+        return charindex;
     }
-    else {
-        objPtr->bytes = Jim_StrDupLen(s, len);
+    if (objPtr->length < JIM_UTF8_INDEX_MIN) {
+        return utf8_index(objPtr->bytes, charindex);
     }
-    objPtr->length = len;
+
+    index = objPtr->internalRep.strValue.utf8Index;
+    if (index == NULL) {
+        index = Jim_Alloc(sizeof(*index) + 15 * sizeof(index->offset[0]));
+        index->size = 16;
+        index->count = 1;
+        index->offset[0] = 0;
+        objPtr->internalRep.strValue.utf8Index = index;
+    }
+
+    /* Extend the index as far as needed, but not beyond the end of the string */
+    i = charindex / JIM_UTF8_INDEX_STEP;
+    while (index->count <= i) {
+        int offset = index->offset[index->count - 1];
+        int n;
+
+        for (n = 0; n < JIM_UTF8_INDEX_STEP && offset < objPtr->length; n++) {
+            offset += utf8_charlen(objPtr->bytes[offset]);
+        }
+        if (n < JIM_UTF8_INDEX_STEP || offset > objPtr->length) {
+            break;
+        }
+        if (index->count == index->size) {
+            index->size *= 2;
+            index = Jim_Realloc(index, sizeof(*index) + (index->size - 1) * sizeof(index->offset[0]));
+            objPtr->internalRep.strValue.utf8Index = index;
+        }
+        index->offset[index->count++] = offset;
+    }
+    if (i >= index->count) {
+        i = index->count - 1;
+    }
+    return index->offset[i] + utf8_index(objPtr->bytes + index->offset[i], charindex - i * JIM_UTF8_INDEX_STEP);
+#else
+    return charindex;
+#endif
+}
+
+/* len is in bytes -- see also Jim_NewStringObjUtf8() */
+Jim_Obj *Jim_NewStringObj(Jim_Interp *interp, const char *s, int len)
+{
+    Jim_Obj *objPtr = Jim_NewObj(interp);
+
+    /* Need to find out how many bytes the string requires */
+    if (len == -1)
+        len = strlen(s);
+    /* Alloc/Set the string rep. */
+    if (len == 0) {
+        objPtr->bytes = JimEmptyStringRep;
+    }
+    else {
+        memcpy(JimAllocStringBytes(objPtr, len), s, len);
+        objPtr->bytes[len] = '\0';
+    }
+    objPtr->length = len;
 
     /* No typePtr field for the vanilla string object. */
     objPtr->typePtr = NULL;
@@ -2537,6 +3062,7 @@ Jim_Obj *Jim_NewStringObjUtf8(Jim_Interp *interp, const char *s, int charlen)
     objPtr->typePtr = &stringObjType;
     objPtr->internalRep.strValue.maxLength = bytelen;
     objPtr->internalRep.strValue.charLength = charlen;
+    objPtr->internalRep.strValue.utf8Index = NULL;
 
     return objPtr;
 #else
@@ -2565,7 +3091,13 @@ static void StringAppendString(Jim_Obj *objPtr, const char *str, int len)
     if (len == -1)
         len = strlen(str);
     needlen = objPtr->length + len;
-    if (objPtr->internalRep.strValue.maxLength < needlen ||
+#ifdef JIM_INLINE_STRINGS
+    if (JimHasInlineBytes(objPtr) && needlen < JIM_OBJ_INLINE_BYTES) {
+        /* Still fits in the inline buffer */
+    }
+    else
+#endif
+    if (JimHasInlineBytes(objPtr) || objPtr->internalRep.strValue.maxLength < needlen ||
         objPtr->internalRep.strValue.maxLength == 0) {
         needlen *= 2;
         /* Inefficient to alloc for less than 8 bytes */
@@ -2573,8 +3105,14 @@ static void StringAppendString(Jim_Obj *objPtr, const char *str, int len)
             needlen = 7;
         }
         if (objPtr->bytes == JimEmptyStringRep) {
+            JimAllocStringBytes(objPtr, needlen);
+        }
+#ifdef JIM_INLINE_STRINGS
+        else if (JimHasInlineBytes(objPtr)) {
             objPtr->bytes = Jim_Alloc(needlen + 1);
+            memcpy(objPtr->bytes, objPtr->inlineBytes, objPtr->length);
         }
+#endif
         else {
             objPtr->bytes = Jim_Realloc(objPtr->bytes, needlen + 1);
         }
@@ -2588,6 +3126,313 @@ static void StringAppendString(Jim_Obj *objPtr, const char *str, int len)
         objPtr->internalRep.strValue.charLength += utf8_strlen(objPtr->bytes + objPtr->length, len);
     }
     objPtr->length += len;
+    objPtr->hash = 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Rope Object
+ * ---------------------------------------------------------------------------*/
+
+/* Appending to a shared string needs a copy of the string first, so building
+ * up a string that is also held elsewhere (e.g. append buf ...; lappend all $buf)
+ * is quadratic. Instead, appending to a shared string of at least JIM_ROPE_MIN
+ * bytes creates a rope that refers to the original value as its first chunk,
+ * followed by the appended values. Short appends are collected in a tail chunk
+ * owned by the rope, while long values are referenced as they are.
+ *
+ * A rope has no string rep until one is needed, at which point it is flattened
+ * and becomes a plain string. Consumers that can work piece by piece can use
+ * Jim_StringForeachChunk() to avoid flattening the rope at all.
+ */
+#define JIM_ROPE_MIN 1024
+
+typedef struct JimRope {
+    Jim_Interp *interp;     /* Needed to release the chunks when the rope is flattened */
+    int length;             /* Total length in bytes */
+    int charLength;         /* Total length in chars, or -1 if not yet known */
+    int len;                /* Number of chunks */
+    int maxLen;             /* Allocated chunks */
+    Jim_Obj **chunks;       /* Only the first chunk may be a rope. The others always have a string rep */
+} JimRope;
+
+static void FreeRopeInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
+static void DupRopeInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
+static void UpdateStringOfRope(struct Jim_Obj *objPtr);
+
+static const Jim_ObjType ropeObjType = {
+    "rope",
+    FreeRopeInternalRep,
+    DupRopeInternalRep,
+    UpdateStringOfRope,
+    /* The chunks are scanned for references in their own right,
+     * so there is no need to flatten ropes to scan them. */
+    JIM_TYPE_NONE,
+};
+
+/* Returns the char length of an object with a string rep if it is already known, or -1 if not. */
+static int JimKnownCharLength(Jim_Obj *objPtr)
+{
+#ifdef JIM_UTF8
+    if (objPtr->typePtr == &stringObjType) {
+        return objPtr->internalRep.strValue.charLength;
+    }
+    return -1;
+#else
+    return objPtr->length;
+#endif
+}
+
+/* Makes objPtr, which must have no string or internal rep, a rope
+ * with baseObjPtr as the first chunk.
+ */
+static void JimSetRope(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *baseObjPtr)
+{
+    JimRope *rope = Jim_Alloc(sizeof(*rope));
+
+    if (baseObjPtr->typePtr == &ropeObjType) {
+        JimRope *baseRope = baseObjPtr->internalRep.ptr;
+
+        rope->length = baseRope->length;
+        rope->charLength = baseRope->charLength;
+    }
+    else {
+        rope->length = Jim_Length(baseObjPtr);
+        rope->charLength = JimKnownCharLength(baseObjPtr);
+    }
+    rope->interp = interp;
+    rope->len = 1;
+    rope->maxLen = 4;
+    rope->chunks = Jim_Alloc(sizeof(*rope->chunks) * rope->maxLen);
+    rope->chunks[0] = baseObjPtr;
+    Jim_IncrRefCount(baseObjPtr);
+
+    objPtr->typePtr = &ropeObjType;
+    objPtr->internalRep.ptr = rope;
+}
+
+/* Releases a rope and its chunks.
+ * The first chunk is often a rope that is not referenced anywhere else,
+ * so a long chain of ropes is released iteratively rather than recursively.
+ */
+static void JimFreeRope(Jim_Interp *interp, JimRope *rope)
+{
+    while (rope) {
+        Jim_Obj *baseObjPtr = rope->chunks[0];
+        int i;
+
+        for (i = 1; i < rope->len; i++) {
+            Jim_DecrRefCount(interp, rope->chunks[i]);
+        }
+        Jim_Free(rope->chunks);
+        Jim_Free(rope);
+
+        rope = NULL;
+        if (baseObjPtr->refCount == 1 && baseObjPtr->typePtr == &ropeObjType) {
+            /* Take over the rope from the base object so it is released by this loop */
+            rope = baseObjPtr->internalRep.ptr;
+            baseObjPtr->typePtr = NULL;
+        }
+        Jim_DecrRefCount(interp, baseObjPtr);
+    }
+}
+
+static void FreeRopeInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    JimFreeRope(interp, objPtr->internalRep.ptr);
+}
+
+/* A rope is never modified once shared, so the duplicate is simply a rope on top of it */
+static void DupRopeInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+{
+    JimSetRope(interp, dupPtr, srcPtr);
+}
+
+/* Flattens the rope into a plain string and releases the chunks */
+static void UpdateStringOfRope(struct Jim_Obj *objPtr)
+{
+    JimRope *rope = objPtr->internalRep.ptr;
+    Jim_Obj *chunkObjPtr = objPtr;
+    char *buf = Jim_Alloc(rope->length + 1);
+    int end = rope->length;
+    const char *str;
+    int len;
+
+    /* Fill from the end, following the chain of first chunks */
+    while (chunkObjPtr->typePtr == &ropeObjType) {
+        JimRope *r = chunkObjPtr->internalRep.ptr;
+        int i;
+
+        for (i = r->len - 1; i > 0; i--) {
+            str = Jim_GetString(r->chunks[i], &len);
+            end -= len;
+            memcpy(buf + end, str, len);
+        }
+        chunkObjPtr = r->chunks[0];
+    }
+    str = Jim_GetString(chunkObjPtr, &len);
+    JimPanic((len != end, "Rope length mismatch"));
+    memcpy(buf, str, len);
+    buf[rope->length] = 0;
+
+    objPtr->bytes = buf;
+    objPtr->length = rope->length;
+    objPtr->typePtr = &stringObjType;
+    objPtr->internalRep.strValue.maxLength = rope->length;
+    objPtr->internalRep.strValue.charLength = rope->charLength;
+    objPtr->internalRep.strValue.utf8Index = NULL;
+
+    JimFreeRope(rope->interp, rope);
+}
+
+/* Adds a chunk with a string rep to the end of the rope */
+static void JimRopeAddChunk(JimRope *rope, Jim_Obj *chunkObjPtr)
+{
+    if (rope->len == rope->maxLen) {
+        rope->maxLen *= 2;
+        rope->chunks = Jim_Realloc(rope->chunks, sizeof(*rope->chunks) * rope->maxLen);
+    }
+    rope->chunks[rope->len++] = chunkObjPtr;
+    Jim_IncrRefCount(chunkObjPtr);
+}
+
+/* Appends to an unshared rope, adding to the tail chunk if it is owned by the rope */
+static void JimRopeAppendString(Jim_Interp *interp, Jim_Obj *objPtr, const char *str, int len)
+{
+    JimRope *rope = objPtr->internalRep.ptr;
+    Jim_Obj *tailObjPtr = rope->chunks[rope->len - 1];
+
+    if (len == -1) {
+        len = strlen(str);
+    }
+    if (rope->len > 1 && tailObjPtr->refCount == 1) {
+        Jim_AppendString(interp, tailObjPtr, str, len);
+    }
+    else {
+        JimRopeAddChunk(rope, Jim_NewStringObj(interp, str, len));
+    }
+    rope->length += len;
+    if (rope->charLength >= 0) {
+        rope->charLength += utf8_strlen(str, len);
+    }
+}
+
+/* Appends to an unshared rope, referencing long values rather than copying them */
+static void JimRopeAppendObj(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *appendObjPtr)
+{
+    JimRope *rope = objPtr->internalRep.ptr;
+    int len;
+    const char *str = Jim_GetString(appendObjPtr, &len);
+
+    if (len < JIM_ROPE_MIN) {
+        JimRopeAppendString(interp, objPtr, str, len);
+        return;
+    }
+    JimRopeAddChunk(rope, appendObjPtr);
+    rope->length += len;
+    if (rope->charLength >= 0) {
+        int charLength = JimKnownCharLength(appendObjPtr);
+        rope->charLength = charLength < 0 ? -1 : rope->charLength + charLength;
+    }
+}
+
+/* Returns a new object with the same value as the shared object objPtr, to be appended to.
+ * Long strings become the first chunk of a rope rather than being copied.
+ */
+static Jim_Obj *JimDuplicateObjForAppend(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    if (objPtr->typePtr != &ropeObjType && Jim_Length(objPtr) >= JIM_ROPE_MIN) {
+        Jim_Obj *ropeObjPtr = Jim_NewObj(interp);
+
+        ropeObjPtr->bytes = NULL;
+        ropeObjPtr->taint = objPtr->taint;
+        JimSetRope(interp, ropeObjPtr, objPtr);
+        return ropeObjPtr;
+    }
+    /* Note that duplicating a rope also creates a rope */
+    return Jim_DuplicateObj(interp, objPtr);
+}
+
+static int JimCountCharsChunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    JIM_NOTUSED(interp);
+    *(int *)privData += utf8_strlen(str, len);
+    return JIM_OK;
+}
+
+/* Returns the length of a rope in bytes, or chars if 'chars' is set, without flattening it */
+static int JimRopeLength(Jim_Interp *interp, Jim_Obj *objPtr, int chars)
+{
+    JimRope *rope = objPtr->internalRep.ptr;
+
+    if (!chars) {
+        return rope->length;
+    }
+    if (rope->charLength < 0) {
+        int charLength = 0;
+        Jim_StringForeachChunk(interp, objPtr, JimCountCharsChunk, &charLength);
+        rope->charLength = charLength;
+    }
+    return rope->charLength;
+}
+
+int Jim_StringForeachChunk(Jim_Interp *interp, Jim_Obj *objPtr, Jim_StringChunkProc *chunkProc, void *privData)
+{
+    Jim_Obj *chunkObjPtr;
+    Jim_Obj **chunks;
+    int count;
+    int i;
+    int ret = JIM_OK;
+
+    if (objPtr->typePtr != &ropeObjType) {
+        int len;
+        const char *str = Jim_GetString(objPtr, &len);
+        return chunkProc(interp, privData, str, len);
+    }
+
+    /* Collect the chunks first, in order, holding a reference to each
+     * in case chunkProc causes the rope to be flattened.
+     */
+    count = 1;
+    for (chunkObjPtr = objPtr; chunkObjPtr->typePtr == &ropeObjType; ) {
+        JimRope *rope = chunkObjPtr->internalRep.ptr;
+        count += rope->len - 1;
+        chunkObjPtr = rope->chunks[0];
+    }
+    chunks = Jim_Alloc(sizeof(*chunks) * count);
+    i = count;
+    for (chunkObjPtr = objPtr; chunkObjPtr->typePtr == &ropeObjType; ) {
+        JimRope *rope = chunkObjPtr->internalRep.ptr;
+        int j;
+
+        for (j = rope->len - 1; j > 0; j--) {
+            chunks[--i] = rope->chunks[j];
+        }
+        chunkObjPtr = rope->chunks[0];
+    }
+    chunks[0] = chunkObjPtr;
+
+    for (i = 0; i < count; i++) {
+        Jim_IncrRefCount(chunks[i]);
+    }
+    for (i = 0; i < count && ret == JIM_OK; i++) {
+        int len;
+        const char *str = Jim_GetString(chunks[i], &len);
+        if (len) {
+            ret = chunkProc(interp, privData, str, len);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        Jim_DecrRefCount(interp, chunks[i]);
+    }
+    Jim_Free(chunks);
+    return ret;
+}
+
+static int JimAppendChunk(Jim_Interp *interp, void *privData, const char *str, int len)
+{
+    JIM_NOTUSED(interp);
+    StringAppendString(privData, str, len);
+    return JIM_OK;
 }
 
 /* Higher level API to append strings to objects.
@@ -2596,15 +3441,37 @@ static void StringAppendString(Jim_Obj *objPtr, const char *str, int len)
 void Jim_AppendString(Jim_Interp *interp, Jim_Obj *objPtr, const char *str, int len)
 {
     JimPanic((Jim_IsShared(objPtr), "Jim_AppendString called with shared object"));
+    if (objPtr->typePtr == &ropeObjType) {
+        JimRopeAppendString(interp, objPtr, str, len);
+        return;
+    }
     SetStringFromAny(interp, objPtr);
     StringAppendString(objPtr, str, len);
 }
 
 void Jim_AppendObj(Jim_Interp *interp, Jim_Obj *objPtr, Jim_Obj *appendObjPtr)
 {
-    int len;
-    const char *str = Jim_GetString(appendObjPtr, &len);
-    Jim_AppendString(interp, objPtr, str, len);
+    if (appendObjPtr == objPtr) {
+        /* Appending to itself, so always use a flat copy */
+        int len;
+        const char *str = Jim_GetString(appendObjPtr, &len);
+        Jim_AppendString(interp, objPtr, str, len);
+    }
+    else if (objPtr->typePtr == &ropeObjType) {
+        JimPanic((Jim_IsShared(objPtr), "Jim_AppendObj called with shared object"));
+        JimRopeAppendObj(interp, objPtr, appendObjPtr);
+    }
+    else if (appendObjPtr->typePtr == &ropeObjType) {
+        /* Append the chunks of the rope rather than flattening it */
+        JimPanic((Jim_IsShared(objPtr), "Jim_AppendObj called with shared object"));
+        SetStringFromAny(interp, objPtr);
+        Jim_StringForeachChunk(interp, appendObjPtr, JimAppendChunk, objPtr);
+    }
+    else {
+        int len;
+        const char *str = Jim_GetString(appendObjPtr, &len);
+        Jim_AppendString(interp, objPtr, str, len);
+    }
     objPtr->taint |= appendObjPtr->taint;
 }
 
@@ -2655,6 +3522,11 @@ int Jim_StringCompareObj(Jim_Interp *interp, Jim_Obj *firstObjPtr, Jim_Obj *seco
     int l1 = Jim_Utf8Length(interp, firstObjPtr);
     const char *s2 = Jim_String(secondObjPtr);
     int l2 = Jim_Utf8Length(interp, secondObjPtr);
+
+    if (!nocase && l1 == Jim_Length(firstObjPtr) && l2 == Jim_Length(secondObjPtr)) {
+        /* Both strings are pure ascii */
+        return JimStringCompareAscii(s1, l1, s2, l2);
+    }
     return JimStringCompareUtf8(s1, l1, s2, l2, nocase);
 }
 
@@ -2761,7 +3633,7 @@ Jim_Obj *Jim_StringRangeObj(Jim_Interp *interp,
         /* ASCII optimisation */
         return Jim_NewStringObj(interp, str + first, rangeLen);
     }
-    return Jim_NewStringObjUtf8(interp, str + utf8_index(str, first), rangeLen);
+    return Jim_NewStringObjUtf8(interp, str + JimStringUtf8Index(strObjPtr, first), rangeLen);
 #else
     return Jim_StringByteRangeObj(interp, strObjPtr, firstObjPtr, lastObjPtr);
 #endif
@@ -2796,7 +3668,8 @@ Jim_Obj *JimStringReplaceObj(Jim_Interp *interp,
     }
 
     /* After part */
-    Jim_AppendString(interp, objPtr, str + utf8_index(str, last + 1), len - last - 1);
+    last = JimStringUtf8Index(strObjPtr, last + 1);
+    Jim_AppendString(interp, objPtr, str + last, Jim_Length(strObjPtr) - last);
 
     return objPtr;
 }
@@ -2908,6 +3781,17 @@ static const char *utf8_memchr(const char *str, int len, int c)
 #endif
 }
 
+/* Returns 1 if the string (str, len) is pure ascii */
+static int JimIsAscii(const char *str, int len)
+{
+    while (len--) {
+        if (UCHAR(*str++) >= 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /**
  * Searches for the first non-trim char in string (str, len)
  *
@@ -2917,6 +3801,14 @@ static const char *utf8_memchr(const char *str, int len, int c)
  */
 static const char *JimFindTrimLeft(const char *str, int len, const char *trimchars, int trimlen)
 {
+    if (JimIsAscii(trimchars, trimlen)) {
+        /* A non-ascii char can't match, so simply compare bytes */
+        while (len && memchr(trimchars, *str, trimlen)) {
+            str++;
+            len--;
+        }
+        return str;
+    }
     while (len) {
         int c;
         int n = utf8_tounicode(str, &c);
@@ -2940,6 +3832,14 @@ static const char *JimFindTrimLeft(const char *str, int len, const char *trimcha
  */
 static const char *JimFindTrimRight(const char *str, int len, const char *trimchars, int trimlen)
 {
+    if (JimIsAscii(trimchars, trimlen)) {
+        /* A non-ascii char can't match, so simply compare bytes */
+        while (len && memchr(trimchars, str[len - 1], trimlen)) {
+            len--;
+        }
+        return len ? str + len : NULL;
+    }
+
     str += len;
 
     while (len) {
@@ -3017,6 +3917,11 @@ static Jim_Obj *JimStringTrimRight(Jim_Interp *interp, Jim_Obj *strObjPtr, Jim_O
         /* Can modify this string in place */
         strObjPtr->bytes[nontrim - strObjPtr->bytes] = 0;
         strObjPtr->length = (nontrim - strObjPtr->bytes);
+        strObjPtr->hash = 0;
+        strObjPtr->internalRep.strValue.charLength = -1;
+#ifdef JIM_UTF8
+        FreeStringInternalRep(interp, strObjPtr);
+#endif
     }
 
     return strObjPtr;
@@ -3385,6 +4290,9 @@ static void JimSetScriptFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr);
 static int JimParseCheckMissing(Jim_Interp *interp, int ch);
 static ScriptObj *JimGetScript(Jim_Interp *interp, Jim_Obj *objPtr);
 static void JimSetErrorStack(Jim_Interp *interp, ScriptObj *script);
+#ifdef JIM_COMPILED_LOCALS
+static void JimFreeProcLocals(Jim_Interp *interp, struct Jim_ProcLocals *pl);
+#endif
 
 void FreeScriptInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
 {
@@ -3895,6 +4803,11 @@ static void JimDecrCmdRefCount(Jim_Interp *interp, Jim_Cmd *cmdPtr)
                 Jim_FreeHashTable(cmdPtr->u.proc.staticVars);
                 Jim_Free(cmdPtr->u.proc.staticVars);
             }
+#ifdef JIM_COMPILED_LOCALS
+            if (cmdPtr->u.proc.locals) {
+                JimFreeProcLocals(interp, cmdPtr->u.proc.locals);
+            }
+#endif
         }
         else {
             /* native (C) */
@@ -3948,40 +4861,45 @@ static void JimVariablesHTValDestructor(void *interp, void *val)
     JimDecrVarRef(interp, val);
 }
 
-/* Hash an object key using its string representation. */
-static unsigned int JimObjectHTHashFunction(const void *key)
+/* Hash a string with the global seed.
+ * The result is never zero since zero means "not cached" in objPtr->hash.
+ */
+static unsigned int JimHashStringSeeded(const char *str, int len)
 {
-    Jim_Obj *keyObj = (Jim_Obj *)key;
-    int length;
-    const char *string;
+    unsigned int h = JimHashString(str, len, JimGetHashSeed());
+    return h ? h : 1;
+}
 
+/* Hash an object key using its string value.
+ * The hash is cached in the object until the string rep changes.
+ */
+static unsigned int JimObjectHash(Jim_Obj *keyObj)
+{
+    if (keyObj->hash) {
+        return keyObj->hash;
+    }
 #ifdef JIM_OPTIMIZATION
     if (JimIsWide(keyObj) && keyObj->bytes == NULL) {
-        /* Special case: we can compute the hash of integers numerically. */
+        /* Special case: we can compute the hash of integers numerically.
+         * This isn't cached since the value of an unshared integer
+         * may be changed in place.
+         */
         jim_wide objValue = JimWideValue(keyObj);
-        if (objValue > INT_MIN && objValue < INT_MAX) {
-            unsigned result = 0;
-            unsigned value = (unsigned)objValue;
-
-            if (objValue < 0) { /* wrap to positive (remove sign) */
-                value = (unsigned)-objValue;
-            }
-
-            /* important: use do-cycle, because value could be 0 */
-            do {
-                result += (result << 3) + (value % 10 + '0');
-                value /= 10;
-            } while (value);
-
-            if (objValue < 0) { /* negative, sign as char */
-                result += (result << 3) + '-';
-            }
-            return result;
+        if (objValue > -JIM_HASH_INT_LIMIT && objValue < JIM_HASH_INT_LIMIT) {
+            unsigned int h = JimHashInt(objValue, JimGetHashSeed());
+            return h ? h : 1;
         }
     }
 #endif
-    string = Jim_GetString(keyObj, &length);
-    return Jim_GenHashFunction((const unsigned char *)string, length);
+    Jim_String(keyObj);
+    keyObj->hash = JimHashStringSeeded(keyObj->bytes, keyObj->length);
+    return keyObj->hash;
+}
+
+/* Hash an object key using its string representation. */
+static unsigned int JimObjectHTHashFunction(const void *key)
+{
+    return JimObjectHash((Jim_Obj *)key);
 }
 
 /* Compare two object keys by string value. */
@@ -4041,12 +4959,17 @@ static const char *Jim_GetStringNoQualifier(Jim_Obj *objPtr, int *length)
     return str;
 }
 
-/* Hash a command-table key, ignoring any namespace prefix. */
+/* Hash a command-table key, ignoring any namespace prefix.
+ * Unqualified names use the cached object hash.
+ */
 static unsigned int JimCommandsHT_HashFunction(const void *key)
 {
     int len;
     const char *str = Jim_GetStringNoQualifier((Jim_Obj *)key, &len);
-    return Jim_GenHashFunction((const unsigned char *)str, len);
+    if (str == ((Jim_Obj *)key)->bytes) {
+        return JimObjectHash((Jim_Obj *)key);
+    }
+    return JimHashStringSeeded(str, len);
 }
 
 /* Compare command names, allowing namespace-qualified lookups to match local entries. */
@@ -4615,6 +5538,81 @@ static const Jim_ObjType variableObjType = {
     JIM_TYPE_REFERENCES,
 };
 
+#ifdef JIM_COMPILED_LOCALS
+/* The compiled local variables of a proc: the argument names, followed by
+ * the literal variable names set by set and foreach in the body.
+ * A call frame of the proc keeps these variables in frame->locals[], indexed
+ * by slot, instead of in the vars hash table, and a variable name object
+ * caches its slot across calls.
+ */
+typedef struct Jim_ProcLocals {
+    unsigned long id;   /* Unique id (from callFrameEpoch) for caching the slot */
+    int len;
+    Jim_Obj **names;    /* One reference each */
+} Jim_ProcLocals;
+
+#define JIM_MAX_LOCALS 64
+
+static void JimFreeProcLocals(Jim_Interp *interp, Jim_ProcLocals *pl)
+{
+    int i;
+
+    for (i = 0; i < pl->len; i++) {
+        Jim_DecrRefCount(interp, pl->names[i]);
+    }
+    Jim_Free(pl->names);
+    Jim_Free(pl);
+}
+
+/* Returns the compiled local slot for the variable name in the given frame, or -1 */
+static int JimLocalSlot(Jim_CallFrame *framePtr, Jim_Obj *nameObjPtr)
+{
+    const Jim_ProcLocals *pl = framePtr->procLocals;
+
+    if (pl) {
+        int i;
+
+        if (nameObjPtr->typePtr == &variableObjType && nameObjPtr->internalRep.varValue.slot >= 0
+            && nameObjPtr->internalRep.varValue.callFrameId == pl->id) {
+            return nameObjPtr->internalRep.varValue.slot;
+        }
+        for (i = 0; i < pl->len; i++) {
+            if (pl->names[i] == nameObjPtr || Jim_StringEqObj(pl->names[i], nameObjPtr)) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/* The id used for caching a variable in the frame */
+#define JimVarCacheId(F, S) ((S) >= 0 ? (F)->procLocals->id : (F)->id)
+
+/* Move the compiled locals of the frame into the vars hash table.
+ * This is needed by anything that enumerates the variables of the frame.
+ */
+static void JimSpillLocals(Jim_Interp *interp, Jim_CallFrame *framePtr)
+{
+    Jim_ProcLocals *pl = framePtr->procLocals;
+
+    if (pl) {
+        int i;
+
+        for (i = 0; i < pl->len; i++) {
+            Jim_VarVal *vv = framePtr->locals[i];
+            if (vv) {
+                Jim_AddHashEntry(&framePtr->vars, pl->names[i], vv);
+                JimDecrVarRef(interp, vv);
+                framePtr->locals[i] = NULL;
+            }
+        }
+        framePtr->procLocals = NULL;
+    }
+}
+#else
+#define JimVarCacheId(F, S) (F)->id
+#endif
+
 /* This method should be called only by the variable API.
  * It returns JIM_OK on success (variable already exists),
  * JIM_ERR if it does not exist, JIM_DICT_SUGAR if it's not
@@ -4626,6 +5624,7 @@ static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     Jim_CallFrame *framePtr;
     int global;
     int len;
+    int slot = -1;
     Jim_VarVal *vv;
 
     /* Check if the object is already an uptodate variable */
@@ -4635,6 +5634,15 @@ static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
             /* nothing to do */
             return JIM_OK;
         }
+#ifdef JIM_COMPILED_LOCALS
+        /* A compiled local of the same proc is in the same slot in every call */
+        if (objPtr->internalRep.varValue.slot >= 0 && framePtr->procLocals
+            && objPtr->internalRep.varValue.callFrameId == framePtr->procLocals->id
+            && (vv = framePtr->locals[objPtr->internalRep.varValue.slot]) != NULL) {
+            objPtr->internalRep.varValue.vv = vv;
+            return JIM_OK;
+        }
+#endif
         /* Need to re-resolve the variable in the updated callframe */
     }
     else if (objPtr->typePtr == &dictSubstObjType) {
@@ -4663,25 +5671,40 @@ static int SetVariableFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     else {
         global = 0;
         framePtr = interp->framePtr;
-        /* Resolve this name in the variables hash table */
-        vv = JimFindVariable(&framePtr->vars, objPtr);
+#ifdef JIM_COMPILED_LOCALS
+        slot = JimLocalSlot(framePtr, objPtr);
+        if (slot >= 0) {
+            vv = framePtr->locals[slot];
+        }
+        else
+#endif
+        {
+            /* Resolve this name in the variables hash table */
+            vv = JimFindVariable(&framePtr->vars, objPtr);
+        }
         if (vv == NULL && framePtr->staticVars) {
             /* Try with static vars. */
             vv = JimFindVariable(framePtr->staticVars, objPtr);
+            if (vv) {
+                slot = -1;
+            }
         }
     }
 
-    if (vv == NULL) {
+    if (vv == NULL && slot < 0) {
         return JIM_ERR;
     }
 
-    /* Free the old internal repr and set the new one. */
+    /* Free the old internal repr and set the new one.
+     * For a compiled local, the slot is remembered even if the variable is not set.
+     */
     Jim_FreeIntRep(interp, objPtr);
     objPtr->typePtr = &variableObjType;
-    objPtr->internalRep.varValue.callFrameId = framePtr->id;
+    objPtr->internalRep.varValue.callFrameId = JimVarCacheId(framePtr, slot);
     objPtr->internalRep.varValue.vv = vv;
     objPtr->internalRep.varValue.global = global;
-    return JIM_OK;
+    objPtr->internalRep.varValue.slot = slot;
+    return vv ? JIM_OK : JIM_ERR;
 }
 
 /* -------------------- Variables related functions ------------------------- */
@@ -4717,6 +5740,7 @@ static Jim_VarVal *JimCreateVariable(Jim_Interp *interp, Jim_Obj *nameObjPtr, Ji
     Jim_CallFrame *framePtr;
     int global;
     int len;
+    int slot = -1;
 
     /* New variable to create */
     Jim_VarVal *vv = Jim_Alloc(sizeof(*vv));
@@ -4739,15 +5763,24 @@ static Jim_VarVal *JimCreateVariable(Jim_Interp *interp, Jim_Obj *nameObjPtr, Ji
     else {
         framePtr = interp->framePtr;
         global = 0;
+#ifdef JIM_COMPILED_LOCALS
+        slot = JimLocalSlot(framePtr, nameObjPtr);
+        if (slot >= 0) {
+            JimIncrVarRef(vv);
+            framePtr->locals[slot] = vv;
+        }
+        else
+#endif
         JimSetNewVariable(&framePtr->vars, nameObjPtr, vv);
     }
 
     /* Make the object int rep a variable */
     Jim_FreeIntRep(interp, nameObjPtr);
     nameObjPtr->typePtr = &variableObjType;
-    nameObjPtr->internalRep.varValue.callFrameId = framePtr->id;
+    nameObjPtr->internalRep.varValue.callFrameId = JimVarCacheId(framePtr, slot);
     nameObjPtr->internalRep.varValue.vv = vv;
     nameObjPtr->internalRep.varValue.global = global;
+    nameObjPtr->internalRep.varValue.slot = slot;
 
     return vv;
 }
@@ -5050,6 +6083,13 @@ int Jim_UnsetVariable(Jim_Interp *interp, Jim_Obj *nameObjPtr, int flags)
             }
             else {
                 framePtr = interp->framePtr;
+#ifdef JIM_COMPILED_LOCALS
+                if (nameObjPtr->internalRep.varValue.slot >= 0) {
+                    framePtr->locals[nameObjPtr->internalRep.varValue.slot] = NULL;
+                    JimDecrVarRef(interp, vv);
+                }
+                else
+#endif
                 retval = JimUnsetVariable(&framePtr->vars, nameObjPtr);
             }
 
@@ -5307,11 +6347,12 @@ static int JimDeleteLocalProcs(Jim_Interp *interp, Jim_Stack *localCommands)
                     Jim_Cmd *prevCmd = cmd->prevCmd;
                     cmd->prevCmd = NULL;
 
-                    /* Delete the old command */
-                    JimDecrCmdRefCount(interp, cmd);
-
-                    /* And restore the original */
+                    /* Restore the original. Do this before deleting the old command
+                     * since that may modify the commands table */
                     Jim_SetHashVal(ht, he, prevCmd);
+
+                    /* And delete the old command */
+                    JimDecrCmdRefCount(interp, cmd);
                 }
                 else {
                     Jim_DeleteHashEntry(ht, cmdNameObj);
@@ -5393,6 +6434,17 @@ static void JimFreeCallFrame(Jim_Interp *interp, Jim_CallFrame *cf, int action)
     if (cf->procBodyObjPtr)
         Jim_DecrRefCount(interp, cf->procBodyObjPtr);
     Jim_DecrRefCount(interp, cf->nsObj);
+#ifdef JIM_COMPILED_LOCALS
+    if (cf->procLocals) {
+        int i;
+        for (i = 0; i < cf->procLocals->len; i++) {
+            if (cf->locals[i]) {
+                JimDecrVarRef(interp, cf->locals[i]);
+            }
+        }
+        cf->procLocals = NULL;
+    }
+#endif
     if (action == JIM_FCF_FULL || cf->vars.size != JIM_HT_INITIAL_SIZE)
         Jim_FreeHashTable(&cf->vars);
     else {
@@ -5855,6 +6907,38 @@ int Jim_IsBigEndian(void)
  * Interpreter related functions
  * ---------------------------------------------------------------------------*/
 
+/* Choose the shared hash seed when the first interpreter is created.
+ * Interpreters may be created concurrently in different threads, and the seed
+ * must never change once a hash has been cached, so only the first nonzero seed
+ * is stored. Without compare-and-swap, create the first interpreter before
+ * starting any other threads.
+ */
+static void JimInitHashSeed(Jim_Interp *interp)
+{
+    unsigned int seed;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+    if (__atomic_load_n(&JimHashSeed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+#else
+    if (JimHashSeed) {
+        return;
+    }
+#endif
+    do {
+        JimRandomBytes(interp, &seed, sizeof(seed));
+    } while (seed == 0);
+#ifdef HAVE_ATOMIC_BUILTINS
+    {
+        unsigned int expected = 0;
+        __atomic_compare_exchange_n(&JimHashSeed, &expected, seed, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+#else
+    JimHashSeed = seed;
+#endif
+}
+
 Jim_Interp *Jim_CreateInterp(void)
 {
     Jim_Interp *i = Jim_Alloc(sizeof(*i));
@@ -5864,6 +6948,7 @@ Jim_Interp *Jim_CreateInterp(void)
     i->maxCallFrameDepth = JIM_MAX_CALLFRAME_DEPTH;
     i->maxEvalDepth = JIM_MAX_EVAL_DEPTH;
     i->lastCollectTime = Jim_GetTimeUsec(CLOCK_MONOTONIC_RAW);
+    JimInitHashSeed(i);
 
     /* Note that we can create objects only after the
      * interpreter liveList and freeList pointers are
@@ -5886,6 +6971,8 @@ Jim_Interp *Jim_CreateInterp(void)
     i->nullScriptObj = Jim_NewEmptyStringObj(i);
     i->evalFrame = &i->topEvalFrame;
     i->currentFilenameObj = Jim_NewEmptyStringObj(i);
+    i->intCache = Jim_Alloc(sizeof(*i->intCache) * (JIM_INT_CACHE_MAX - JIM_INT_CACHE_MIN + 1));
+    memset(i->intCache, 0, sizeof(*i->intCache) * (JIM_INT_CACHE_MAX - JIM_INT_CACHE_MIN + 1));
     Jim_IncrRefCount(i->emptyObj);
     Jim_IncrRefCount(i->result);
     Jim_IncrRefCount(i->stackTrace);
@@ -5918,8 +7005,7 @@ Jim_Interp *Jim_CreateInterp(void)
 void Jim_FreeInterp(Jim_Interp *i)
 {
     Jim_CallFrame *cf, *cfx;
-
-    Jim_Obj *objPtr, *nextObjPtr;
+    int n;
 
     i->quitting = 1;
 
@@ -5944,6 +7030,12 @@ void Jim_FreeInterp(Jim_Interp *i)
     Jim_DecrRefCount(i, i->defer);
     Jim_DecrRefCount(i, i->nullScriptObj);
     Jim_DecrRefCount(i, i->currentFilenameObj);
+    for (n = 0; n <= JIM_INT_CACHE_MAX - JIM_INT_CACHE_MIN; n++) {
+        if (i->intCache[n]) {
+            Jim_DecrRefCount(i, i->intCache[n]);
+        }
+    }
+    Jim_Free(i->intCache);
 
     /* This will disard any cached commands */
     Jim_InterpIncrProcEpoch(i);
@@ -5961,8 +7053,14 @@ void Jim_FreeInterp(Jim_Interp *i)
     /* Check that the live object list is empty, otherwise
      * there is a memory leak. */
 #ifdef JIM_MAINTAINER
+#ifdef JIM_COMPACT_OBJ
+    if (i->liveCount != 0) {
+        printf("\n%ld objects are still live\n", i->liveCount);
+        JimPanic((1, "Live objects remain freeing the interpreter! Leak?"));
+    }
+#else
     if (i->liveList != NULL) {
-        objPtr = i->liveList;
+        Jim_Obj *objPtr = i->liveList;
 
         printf("\n-------------------------------------\n");
         printf("Objects still in the free list:\n");
@@ -5988,14 +7086,14 @@ void Jim_FreeInterp(Jim_Interp *i)
         printf("-------------------------------------\n\n");
         JimPanic((1, "Live list non empty freeing the interpreter! Leak?"));
     }
+#endif
 #endif
 
     /* Free all the freed objects. */
-    objPtr = i->freeList;
-    while (objPtr) {
-        nextObjPtr = objPtr->nextObjPtr;
-        Jim_Free(objPtr);
-        objPtr = nextObjPtr;
+    while (i->freeList) {
+        Jim_Obj *nextObjPtr = JimNextFreeObj(i->freeList);
+        Jim_Free(i->freeList);
+        i->freeList = nextObjPtr;
     }
 
     /* Free the free call frames list */
@@ -6003,6 +7101,7 @@ void Jim_FreeInterp(Jim_Interp *i)
         cfx = cf->next;
         if (cf->vars.table)
             Jim_FreeHashTable(&cf->vars);
+        Jim_Free(cf->locals);
         Jim_Free(cf);
     }
 
@@ -6417,6 +7516,41 @@ Jim_Obj *Jim_NewIntObj(Jim_Interp *interp, jim_wide wideValue)
     return objPtr;
 }
 
+/* Returns an int object with the given value.
+ * Small values come from a per-interp cache of shared objects, so unlike
+ * Jim_NewIntObj() the object must be treated as shared. It may not be
+ * modified and must not be freed with Jim_FreeNewObj().
+ */
+static Jim_Obj *JimIntObj(Jim_Interp *interp, jim_wide wideValue)
+{
+    Jim_Obj **cachePtr;
+
+    if (wideValue < JIM_INT_CACHE_MIN || wideValue > JIM_INT_CACHE_MAX) {
+        return Jim_NewIntObj(interp, wideValue);
+    }
+    cachePtr = &interp->intCache[wideValue - JIM_INT_CACHE_MIN];
+    if (*cachePtr && (*cachePtr)->typePtr == &stringObjType) {
+        /* Commonly converted by [string length], etc. so simply restore the int rep. */
+        Jim_FreeIntRep(interp, *cachePtr);
+        (*cachePtr)->typePtr = &intObjType;
+        (*cachePtr)->internalRep.wideValue = wideValue;
+    }
+    if (*cachePtr == NULL || (*cachePtr)->typePtr != &intObjType || (*cachePtr)->taint) {
+        /* Not yet created, or the cached object has since been converted
+         * to another type or tainted, so replace it.
+         */
+        if (*cachePtr) {
+            Jim_DecrRefCount(interp, *cachePtr);
+        }
+        *cachePtr = Jim_NewIntObj(interp, wideValue);
+        Jim_IncrRefCount(*cachePtr);
+    }
+    return *cachePtr;
+}
+
+/* Like Jim_SetResultInt() but uses the small int cache */
+#define JimSetResultInt(I, W) Jim_SetResult((I), JimIntObj((I), (W)))
+
 /* -----------------------------------------------------------------------------
  * Double object
  * ---------------------------------------------------------------------------*/
@@ -6633,10 +7767,348 @@ static const Jim_ObjType listObjType = {
     JIM_TYPE_NONE,
 };
 
+/* Large lists may instead hold their elements in a sequence of fixed capacity
+ * chunks. Both the chunks and the spine that holds them are reference counted
+ * and shared between list objects, so duplicating such a list is cheap and
+ * modifying the copy only copies the spine and the affected chunks.
+ *
+ * A list is only created in this form when it is duplicated or a large range
+ * is taken with lrange, and is converted back to a flat vector as required by
+ * JimListGetElements().
+ *
+ * The list is the range of 'len' elements starting at JimListOffset() in the
+ * spine, so a range of a chunked list can share the same spine.
+ */
+#define JIM_LIST_CHUNK_LEN 64
+/* Lists at least this long are duplicated into chunks */
+#define JIM_LIST_CHUNKED_MIN 256
+
+typedef struct Jim_ListChunk {
+    int refCount;
+    int len;
+    Jim_Obj *ele[JIM_LIST_CHUNK_LEN];
+} Jim_ListChunk;
+
+typedef struct Jim_ListSpine {
+    int refCount;
+    int count;          /* Number of chunks */
+    int size;           /* Allocated size of 'chunks' */
+    struct {
+        int first;      /* List index of the first element in the chunk */
+        Jim_ListChunk *chunk;
+    } *chunks;
+} Jim_ListSpine;
+
+static int JimListFindChunk(Jim_ListSpine *spine, int idx);
+
+/* For a chunked list, maxLen is not needed and holds the offset into the spine */
+#define JimListOffset(L) ((L)->internalRep.listValue.maxLen)
+
+static Jim_ListSpine *JimListNewSpine(int size)
+{
+    Jim_ListSpine *spine = Jim_Alloc(sizeof(*spine));
+
+    spine->refCount = 1;
+    spine->count = 0;
+    spine->size = size;
+    spine->chunks = Jim_Alloc(sizeof(*spine->chunks) * size);
+    return spine;
+}
+
+/* Inserts a new, empty chunk at position c in the spine */
+static Jim_ListChunk *JimListSpineInsertChunk(Jim_ListSpine *spine, int c, int first)
+{
+    Jim_ListChunk *chunk = Jim_Alloc(sizeof(*chunk));
+
+    chunk->refCount = 1;
+    chunk->len = 0;
+    if (spine->count == spine->size) {
+        spine->size = spine->size * 2 + 4;
+        spine->chunks = Jim_Realloc(spine->chunks, sizeof(*spine->chunks) * spine->size);
+    }
+    memmove(&spine->chunks[c + 1], &spine->chunks[c], sizeof(*spine->chunks) * (spine->count - c));
+    spine->chunks[c].first = first;
+    spine->chunks[c].chunk = chunk;
+    spine->count++;
+    return chunk;
+}
+
+static void JimListFreeSpine(Jim_Interp *interp, Jim_ListSpine *spine)
+{
+    int c, i;
+
+    if (--spine->refCount > 0) {
+        return;
+    }
+    for (c = 0; c < spine->count; c++) {
+        Jim_ListChunk *chunk = spine->chunks[c].chunk;
+        if (--chunk->refCount == 0) {
+            for (i = 0; i < chunk->len; i++) {
+                Jim_DecrRefCount(interp, chunk->ele[i]);
+            }
+            Jim_Free(chunk);
+        }
+    }
+    Jim_Free(spine->chunks);
+    Jim_Free(spine);
+}
+
+/* Returns the total number of elements in the spine */
+static int JimListSpineLen(Jim_ListSpine *spine)
+{
+    if (spine->count == 0) {
+        return 0;
+    }
+    return spine->chunks[spine->count - 1].first + spine->chunks[spine->count - 1].chunk->len;
+}
+
+/* Creates a new spine holding (new references to) the given elements */
+static Jim_ListSpine *JimListSpineFromVector(Jim_Obj *const *ele, int len)
+{
+    Jim_ListSpine *spine = JimListNewSpine(len / JIM_LIST_CHUNK_LEN + 4);
+    int i, j;
+
+    for (i = 0; i < len; i += JIM_LIST_CHUNK_LEN) {
+        Jim_ListChunk *chunk = JimListSpineInsertChunk(spine, spine->count, i);
+
+        chunk->len = len - i < JIM_LIST_CHUNK_LEN ? len - i : JIM_LIST_CHUNK_LEN;
+        for (j = 0; j < chunk->len; j++) {
+            chunk->ele[j] = ele[i + j];
+            Jim_IncrRefCount(ele[i + j]);
+        }
+    }
+    return spine;
+}
+
+/* Copies n elements of the spine starting at first into vec, without
+ * adding references.
+ */
+static void JimListSpineCopy(Jim_ListSpine *spine, int first, int n, Jim_Obj **vec)
+{
+    int c = n ? JimListFindChunk(spine, first) : 0;
+
+    for (; n > 0; c++) {
+        Jim_ListChunk *chunk = spine->chunks[c].chunk;
+        int offset = first - spine->chunks[c].first;
+        int len = chunk->len - offset;
+
+        if (len > n) {
+            len = n;
+        }
+        memcpy(vec, chunk->ele + offset, sizeof(*vec) * len);
+        vec += len;
+        first += len;
+        n -= len;
+    }
+}
+
+/* Returns the index of the chunk holding element idx, which must be valid */
+static int JimListFindChunk(Jim_ListSpine *spine, int idx)
+{
+    int lo = 0;
+    int hi = spine->count - 1;
+    int c = idx / JIM_LIST_CHUNK_LEN;
+
+    /* Chunks are usually full, so try the simple case first */
+    if (c < spine->count && spine->chunks[c].first <= idx
+        && idx < spine->chunks[c].first + spine->chunks[c].chunk->len) {
+        return c;
+    }
+    while (lo < hi) {
+        c = (lo + hi + 1) / 2;
+        if (spine->chunks[c].first <= idx) {
+            lo = c;
+        }
+        else {
+            hi = c - 1;
+        }
+    }
+    return lo;
+}
+
+/* Ensures that the list has its own copy of the spine */
+static Jim_ListSpine *JimListUnshareSpine(Jim_Obj *listPtr)
+{
+    Jim_ListSpine *spine = listPtr->internalRep.listValue.spine;
+
+    if (spine->refCount > 1) {
+        Jim_ListSpine *newSpine = JimListNewSpine(spine->count + 4);
+        int c;
+
+        for (c = 0; c < spine->count; c++) {
+            newSpine->chunks[c] = spine->chunks[c];
+            newSpine->chunks[c].chunk->refCount++;
+        }
+        newSpine->count = spine->count;
+        spine->refCount--;
+        listPtr->internalRep.listValue.spine = spine = newSpine;
+    }
+    return spine;
+}
+
+/* Ensures that chunk c is not shared with any other spine */
+static Jim_ListChunk *JimListUnshareChunk(Jim_ListSpine *spine, int c)
+{
+    Jim_ListChunk *chunk = spine->chunks[c].chunk;
+
+    if (chunk->refCount > 1) {
+        Jim_ListChunk *newChunk = Jim_Alloc(sizeof(*newChunk));
+        int i;
+
+        newChunk->refCount = 1;
+        newChunk->len = chunk->len;
+        for (i = 0; i < chunk->len; i++) {
+            newChunk->ele[i] = chunk->ele[i];
+            Jim_IncrRefCount(newChunk->ele[i]);
+        }
+        chunk->refCount--;
+        spine->chunks[c].chunk = chunk = newChunk;
+    }
+    return chunk;
+}
+
+/* Returns element idx of a list object, which must be valid */
+static Jim_Obj *ListGetElement(Jim_Obj *listPtr, int idx)
+{
+    Jim_ListSpine *spine = listPtr->internalRep.listValue.spine;
+
+    if (spine) {
+        int c;
+
+        idx += JimListOffset(listPtr);
+        c = JimListFindChunk(spine, idx);
+        return spine->chunks[c].chunk->ele[idx - spine->chunks[c].first];
+    }
+    return listPtr->internalRep.listValue.ele[idx];
+}
+
+/* Converts a chunked list back to a flat vector of elements */
+static void JimListFlatten(Jim_Interp *interp, Jim_Obj *listPtr)
+{
+    Jim_ListSpine *spine = listPtr->internalRep.listValue.spine;
+    int len = listPtr->internalRep.listValue.len;
+    Jim_Obj **ele;
+    int c, i;
+    int n = 0;
+
+    if (spine == NULL) {
+        return;
+    }
+    ele = Jim_Alloc(sizeof(*ele) * (len + 1));
+    if (spine->refCount == 1 && JimListOffset(listPtr) == 0 && len == JimListSpineLen(spine)) {
+        for (c = 0; c < spine->count; c++) {
+            Jim_ListChunk *chunk = spine->chunks[c].chunk;
+            int chunklen = chunk->len;
+
+            memcpy(ele + n, chunk->ele, sizeof(*ele) * chunklen);
+            if (chunk->refCount == 1) {
+                /* The only owner, so the references move to the new vector */
+                Jim_Free(chunk);
+            }
+            else {
+                for (i = 0; i < chunklen; i++) {
+                    Jim_IncrRefCount(ele[n + i]);
+                }
+                chunk->refCount--;
+            }
+            n += chunklen;
+        }
+        Jim_Free(spine->chunks);
+        Jim_Free(spine);
+    }
+    else {
+        JimListSpineCopy(spine, JimListOffset(listPtr), len, ele);
+        for (i = 0; i < len; i++) {
+            Jim_IncrRefCount(ele[i]);
+        }
+        JimListFreeSpine(interp, spine);
+    }
+    listPtr->internalRep.listValue.ele = ele;
+    listPtr->internalRep.listValue.maxLen = len + 1;
+    listPtr->internalRep.listValue.spine = NULL;
+}
+
+/* Inserts elements into a chunked list. See ListInsertElements() */
+static void ListInsertChunkedElements(Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *const *elemVec)
+{
+    Jim_ListSpine *spine = JimListUnshareSpine(listPtr);
+    Jim_ListChunk *chunk;
+    int c, i, n, start;
+
+    /* Note that if this list is a range of the spine, appending to the list
+     * is an insertion into the spine.
+     */
+    idx += JimListOffset(listPtr);
+    if (idx == JimListSpineLen(spine)) {
+        /* Appending, so fill the final chunk */
+        c = spine->count - 1;
+        listPtr->internalRep.listValue.len += elemc;
+    }
+    else {
+        int offset;
+
+        c = JimListFindChunk(spine, idx);
+        chunk = JimListUnshareChunk(spine, c);
+        listPtr->internalRep.listValue.len += elemc;
+        offset = idx - spine->chunks[c].first;
+        if (chunk->len + elemc > JIM_LIST_CHUNK_LEN) {
+            /* No room, so split the chunk at the insertion point, moving the tail
+             * to a new chunk. The new elements are then appended to the head.
+             */
+            Jim_ListChunk *tail = JimListSpineInsertChunk(spine, c + 1, idx);
+
+            tail->len = chunk->len - offset;
+            memcpy(tail->ele, chunk->ele + offset, sizeof(*tail->ele) * tail->len);
+            chunk->len = offset;
+        }
+        else {
+            memmove(chunk->ele + offset + elemc, chunk->ele + offset, sizeof(*chunk->ele) * (chunk->len - offset));
+            for (i = 0; i < elemc; i++) {
+                chunk->ele[offset + i] = elemVec[i];
+                listPtr->taint |= elemVec[i]->taint;
+                Jim_IncrRefCount(elemVec[i]);
+            }
+            chunk->len += elemc;
+            elemc = 0;
+        }
+    }
+    start = c;
+
+    while (elemc) {
+        if (spine->chunks[c].chunk->len == JIM_LIST_CHUNK_LEN) {
+            c++;
+            chunk = JimListSpineInsertChunk(spine, c, spine->chunks[c - 1].first + JIM_LIST_CHUNK_LEN);
+        }
+        else {
+            chunk = JimListUnshareChunk(spine, c);
+        }
+        n = JIM_LIST_CHUNK_LEN - chunk->len;
+        if (n > elemc) {
+            n = elemc;
+        }
+        for (i = 0; i < n; i++) {
+            chunk->ele[chunk->len++] = elemVec[i];
+            listPtr->taint |= elemVec[i]->taint;
+            Jim_IncrRefCount(elemVec[i]);
+        }
+        elemVec += n;
+        elemc -= n;
+    }
+
+    /* Now renumber the chunks following the insertion */
+    for (c = start + 1; c < spine->count; c++) {
+        spine->chunks[c].first = spine->chunks[c - 1].first + spine->chunks[c - 1].chunk->len;
+    }
+}
+
 void FreeListInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
 {
     int i;
 
+    if (objPtr->internalRep.listValue.spine) {
+        JimListFreeSpine(interp, objPtr->internalRep.listValue.spine);
+        return;
+    }
     for (i = 0; i < objPtr->internalRep.listValue.len; i++) {
         Jim_DecrRefCount(interp, objPtr->internalRep.listValue.ele[i]);
     }
@@ -6646,10 +8118,29 @@ void FreeListInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
 void DupListInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
 {
     int i;
+    int len = srcPtr->internalRep.listValue.len;
 
     JIM_NOTUSED(interp);
 
-    dupPtr->internalRep.listValue.len = srcPtr->internalRep.listValue.len;
+    dupPtr->internalRep.listValue.len = len;
+    dupPtr->typePtr = &listObjType;
+
+    if (srcPtr->internalRep.listValue.spine) {
+        /* Share the chunks until one of the lists is modified */
+        dupPtr->internalRep.listValue.ele = NULL;
+        JimListOffset(dupPtr) = JimListOffset(srcPtr);
+        dupPtr->internalRep.listValue.spine = srcPtr->internalRep.listValue.spine;
+        dupPtr->internalRep.listValue.spine->refCount++;
+        return;
+    }
+    dupPtr->internalRep.listValue.spine = NULL;
+    if (len >= JIM_LIST_CHUNKED_MIN) {
+        /* The copy is likely to be modified and duplicated again, so use chunks */
+        dupPtr->internalRep.listValue.ele = NULL;
+        JimListOffset(dupPtr) = 0;
+        dupPtr->internalRep.listValue.spine = JimListSpineFromVector(srcPtr->internalRep.listValue.ele, len);
+        return;
+    }
     dupPtr->internalRep.listValue.maxLen = srcPtr->internalRep.listValue.maxLen;
     dupPtr->internalRep.listValue.ele =
         Jim_Alloc(sizeof(Jim_Obj *) * srcPtr->internalRep.listValue.maxLen);
@@ -6658,7 +8149,6 @@ void DupListInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
     for (i = 0; i < dupPtr->internalRep.listValue.len; i++) {
         Jim_IncrRefCount(dupPtr->internalRep.listValue.ele[i]);
     }
-    dupPtr->typePtr = &listObjType;
 }
 
 /* The following function checks if a given string can be encoded
@@ -6863,7 +8353,7 @@ static void JimMakeListStringRep(Jim_Obj *objPtr, Jim_Obj **objv, int objc)
     bufLen++;
 
     /* Generate the string rep. */
-    p = objPtr->bytes = Jim_Alloc(bufLen + 1);
+    p = JimAllocStringBytes(objPtr, bufLen);
     realLength = 0;
     for (i = 0; i < objc; i++) {
         int len, qlen;
@@ -6910,6 +8400,16 @@ static void JimMakeListStringRep(Jim_Obj *objPtr, Jim_Obj **objv, int objc)
 /* Rebuild the string representation of a list object. */
 static void UpdateStringOfList(struct Jim_Obj *objPtr)
 {
+    if (objPtr->internalRep.listValue.spine) {
+        /* Use a temporary vector so that the chunks remain shared */
+        int len = objPtr->internalRep.listValue.len;
+        Jim_Obj **ele = Jim_Alloc(sizeof(*ele) * (len + 1));
+
+        JimListSpineCopy(objPtr->internalRep.listValue.spine, JimListOffset(objPtr), len, ele);
+        JimMakeListStringRep(objPtr, ele, len);
+        Jim_Free(ele);
+        return;
+    }
     JimMakeListStringRep(objPtr, objPtr->internalRep.listValue.ele, objPtr->internalRep.listValue.len);
 }
 
@@ -6940,9 +8440,11 @@ static int SetListFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
         objPtr->internalRep.listValue.len = dict->len;
         objPtr->internalRep.listValue.maxLen = dict->maxLen;
         objPtr->internalRep.listValue.ele = dict->table;
+        objPtr->internalRep.listValue.spine = NULL;
 
         /* 2. Discard the hash table */
         Jim_Free(dict->ht);
+        Jim_Free(dict->oldht);
 
         /* 3. Free the dict structure */
         Jim_Free(dict);
@@ -6963,6 +8465,7 @@ static int SetListFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
     objPtr->internalRep.listValue.len = 0;
     objPtr->internalRep.listValue.maxLen = 0;
     objPtr->internalRep.listValue.ele = NULL;
+    objPtr->internalRep.listValue.spine = NULL;
 
     /* Convert into a list */
     if (strLen) {
@@ -6994,6 +8497,7 @@ Jim_Obj *Jim_NewListObj(Jim_Interp *interp, Jim_Obj *const *elements, int len)
     objPtr->internalRep.listValue.ele = NULL;
     objPtr->internalRep.listValue.len = 0;
     objPtr->internalRep.listValue.maxLen = 0;
+    objPtr->internalRep.listValue.spine = NULL;
 
     if (len) {
         ListInsertElements(objPtr, 0, len, elements);
@@ -7012,6 +8516,7 @@ static void JimListGetElements(Jim_Interp *interp, Jim_Obj *listObj, int *listLe
     Jim_Obj ***listVec)
 {
     *listLen = Jim_ListLength(interp, listObj);
+    JimListFlatten(interp, listObj);
     *listVec = listObj->internalRep.listValue.ele;
 }
 
@@ -7212,6 +8717,7 @@ static int ListSortElements(Jim_Interp *interp, Jim_Obj *listObjPtr, struct lsor
 
     JimPanic((Jim_IsShared(listObjPtr), "ListSortElements called with shared object"));
     SetListFromAny(interp, listObjPtr);
+    JimListFlatten(interp, listObjPtr);
 
     /* Allow lsort to be called reentrantly */
     prev_info = sort_info;
@@ -7302,6 +8808,11 @@ static void ListInsertElements(Jim_Obj *listPtr, int idx, int elemc, Jim_Obj *co
         return;
     }
 
+    if (listPtr->internalRep.listValue.spine) {
+        ListInsertChunkedElements(listPtr, idx < 0 ? currentLen : idx, elemc, elemVec);
+        return;
+    }
+
     if (requiredLen > listPtr->internalRep.listValue.maxLen) {
         if (currentLen) {
             /* Assume that we will need extra space for future expansion */
@@ -7329,14 +8840,40 @@ static void ListAppendElement(Jim_Obj *listPtr, Jim_Obj *objPtr)
     ListInsertElements(listPtr, -1, 1, &objPtr);
 }
 
+/* Appends n elements of srcPtr, starting at first, to listPtr.
+ * Both have to be of the list type.
+ */
+static void ListAppendRange(Jim_Obj *listPtr, Jim_Obj *srcPtr, int first, int n)
+{
+    Jim_ListSpine *spine = srcPtr->internalRep.listValue.spine;
+    int c;
+
+    if (spine == NULL) {
+        ListInsertElements(listPtr, -1, n, srcPtr->internalRep.listValue.ele + first);
+        return;
+    }
+    first += JimListOffset(srcPtr);
+    for (c = n ? JimListFindChunk(spine, first) : 0; n > 0; c++) {
+        Jim_ListChunk *chunk = spine->chunks[c].chunk;
+        int offset = first - spine->chunks[c].first;
+        int len = chunk->len - offset;
+
+        if (len > n) {
+            len = n;
+        }
+        ListInsertElements(listPtr, -1, len, chunk->ele + offset);
+        first += len;
+        n -= len;
+    }
+}
+
 /* Appends every element of appendListPtr into listPtr.
  * Both have to be of the list type.
  * Convenience call to ListInsertElements()
  */
 static void ListAppendList(Jim_Obj *listPtr, Jim_Obj *appendListPtr)
 {
-    ListInsertElements(listPtr, -1,
-        appendListPtr->internalRep.listValue.len, appendListPtr->internalRep.listValue.ele);
+    ListAppendRange(listPtr, appendListPtr, 0, appendListPtr->internalRep.listValue.len);
 }
 
 void Jim_ListAppendElement(Jim_Interp *interp, Jim_Obj *listPtr, Jim_Obj *objPtr)
@@ -7384,7 +8921,7 @@ Jim_Obj *Jim_ListGetIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx)
     }
     if (idx < 0)
         idx = listPtr->internalRep.listValue.len + idx;
-    return listPtr->internalRep.listValue.ele[idx];
+    return ListGetElement(listPtr, idx);
 }
 
 int Jim_ListIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx, Jim_Obj **objPtrPtr, int flags)
@@ -7464,8 +9001,23 @@ static int ListSetIndex(Jim_Interp *interp, Jim_Obj *listPtr, int idx,
     }
     if (idx < 0)
         idx = listPtr->internalRep.listValue.len + idx;
-    Jim_DecrRefCount(interp, listPtr->internalRep.listValue.ele[idx]);
-    listPtr->internalRep.listValue.ele[idx] = newObjPtr;
+    if (listPtr->internalRep.listValue.spine) {
+        Jim_ListSpine *spine = JimListUnshareSpine(listPtr);
+        int c;
+        Jim_ListChunk *chunk;
+
+        idx += JimListOffset(listPtr);
+        c = JimListFindChunk(spine, idx);
+        chunk = JimListUnshareChunk(spine, c);
+
+        idx -= spine->chunks[c].first;
+        Jim_DecrRefCount(interp, chunk->ele[idx]);
+        chunk->ele[idx] = newObjPtr;
+    }
+    else {
+        Jim_DecrRefCount(interp, listPtr->internalRep.listValue.ele[idx]);
+        listPtr->internalRep.listValue.ele[idx] = newObjPtr;
+    }
     listPtr->taint |= newObjPtr->taint;
     Jim_IncrRefCount(newObjPtr);
     return JIM_OK;
@@ -7600,6 +9152,51 @@ Jim_Obj *Jim_ConcatObj(Jim_Interp *interp, int objc, Jim_Obj *const *objv)
     }
 }
 
+/* Returns a new list of the rangeLen elements of listObjPtr (which must be a list)
+ * starting at first.
+ *
+ * Large ranges are returned in chunked form. If listObjPtr is already chunked, the
+ * result simply refers to the range of the same spine, so taking a range is cheap,
+ * and is never converted to a string or flat list unless required.
+ */
+static Jim_Obj *JimListRange(Jim_Interp *interp, Jim_Obj *listObjPtr, int first, int rangeLen)
+{
+    Jim_ListSpine *spine = listObjPtr->internalRep.listValue.spine;
+    Jim_Obj *objPtr = Jim_NewListObj(interp, NULL, 0);
+    int i;
+
+    if (rangeLen < JIM_LIST_CHUNKED_MIN) {
+        ListAppendRange(objPtr, listObjPtr, first, rangeLen);
+        return objPtr;
+    }
+
+    if (spine && rangeLen >= JimListSpineLen(spine) / 4) {
+        spine->refCount++;
+        JimListOffset(objPtr) = JimListOffset(listObjPtr) + first;
+    }
+    else if (spine) {
+        /* Don't keep a large spine alive for a small range, so copy the range */
+        Jim_Obj **ele = Jim_Alloc(sizeof(*ele) * rangeLen);
+
+        JimListSpineCopy(spine, JimListOffset(listObjPtr) + first, rangeLen, ele);
+        spine = JimListSpineFromVector(ele, rangeLen);
+        Jim_Free(ele);
+    }
+    else {
+        spine = JimListSpineFromVector(listObjPtr->internalRep.listValue.ele + first, rangeLen);
+    }
+    objPtr->internalRep.listValue.spine = spine;
+    objPtr->internalRep.listValue.len = rangeLen;
+
+    if (listObjPtr->taint) {
+        /* The range is only tainted if it contains a tainted element */
+        for (i = 0; i < rangeLen && !objPtr->taint; i++) {
+            objPtr->taint |= ListGetElement(objPtr, i)->taint;
+        }
+    }
+    return objPtr;
+}
+
 /* Returns a list composed of the elements in the specified range.
  * first and start are directly accepted as Jim_Objects and
  * processed for the end?-index? case. */
@@ -7619,7 +9216,7 @@ Jim_Obj *Jim_ListRange(Jim_Interp *interp, Jim_Obj *listObjPtr, Jim_Obj *firstOb
     if (first == 0 && last == len) {
         return listObjPtr;
     }
-    return Jim_NewListObj(interp, listObjPtr->internalRep.listValue.ele + first, rangeLen);
+    return JimListRange(interp, listObjPtr, first, rangeLen);
 }
 
 /* -----------------------------------------------------------------------------
@@ -7660,6 +9257,7 @@ static void JimFreeDict(Jim_Interp *interp, Jim_Dict *dict)
     }
     Jim_Free(dict->table);
     Jim_Free(dict->ht);
+    Jim_Free(dict->oldht);
     Jim_Free(dict);
 }
 
@@ -7669,6 +9267,54 @@ enum {
     DICT_HASH_ADD = -3,
 };
 
+/* Continues an incremental rehash of the dict hash table (if any)
+ * by moving up to 'n' entries of the old hash table
+ */
+static void JimDictRehashStep(Jim_Dict *dict, unsigned int n)
+{
+    if (dict->oldht && JimHashIndexRehash(dict->ht, dict->sizemask, dict->oldht, dict->oldsize, &dict->rehashidx, n)) {
+        Jim_Free(dict->oldht);
+        dict->oldht = NULL;
+    }
+}
+
+/* Searches the probe sequence for hash 'h' in the given dict hash table for the given key.
+ * Returns the hash table entry if found, or NULL if not.
+ * If not found, sets *freeslot to the first removed or empty entry in the
+ * probe sequence, where the key may be added.
+ */
+static struct Jim_HashIndex *JimDictProbe(Jim_Dict *dict, struct Jim_HashIndex *ht, unsigned int sizemask,
+    Jim_Obj *keyObjPtr, unsigned int h, struct Jim_HashIndex **freeslot)
+{
+    unsigned idx = h & sizemask;
+    unsigned peturb = h;
+    struct Jim_HashIndex *removed = NULL;
+    int tvoffset;
+
+    while ((tvoffset = ht[idx].offset)) {
+        if (tvoffset == -1) {
+            /* An entry with offset=-1 is a removed entry
+             * Need to keep going in case there is a non-removed entry later.
+             * But for adds we prefer to use the first available removed entry
+             * for performance reasons
+             */
+            if (removed == NULL) {
+                removed = &ht[idx];
+            }
+        }
+        else if (ht[idx].hash == h) {
+            if (Jim_StringEqObj(keyObjPtr, dict->table[tvoffset - 1])) {
+                return &ht[idx];
+            }
+        }
+        /* Use the Python algorithm for conflict resolution */
+        peturb >>= 5;
+        idx = (5 * idx + 1 + peturb) & sizemask;
+    }
+    *freeslot = removed ? removed : &ht[idx];
+    return NULL;
+}
+
 /**
  * Search for the given key in the dict hash table and perform the given operation.
  *
@@ -7687,33 +9333,30 @@ enum {
  */
 static int JimDictHashFind(Jim_Dict *dict, Jim_Obj *keyObjPtr, int op_tvoffset)
 {
-    unsigned h = (JimObjectHTHashFunction(keyObjPtr) + dict->uniq);
-    unsigned idx = h & dict->sizemask;
+    unsigned h;
+    struct Jim_HashIndex *slot;
+    struct Jim_HashIndex *freeslot;
+    int inold = 0;
     int tvoffset = 0;
-    unsigned peturb = h;
-    unsigned first_removed = ~0;
-
-    if (dict->len) {
-        while ((tvoffset = dict->ht[idx].offset)) {
-            if (tvoffset == -1) {
-                /* An entry with offset=-1 is a removed entry
-                 * Need to keep going in case there is a non-removed entry later.
-                 * But for adds we prefer to use the first available removed entry
-                 * for performance reasons
-                 */
-                if (first_removed == ~0) {
-                    first_removed = idx;
-                }
-            }
-            else if (dict->ht[idx].hash == h) {
-                if (Jim_StringEqObj(keyObjPtr, dict->table[tvoffset - 1])) {
-                    break;
-                }
-            }
-            /* Use the Python algorithm for conflict resolution */
-            peturb >>= 5;
-            idx = (5 * idx + 1 + peturb) & dict->sizemask;
-        }
+
+    if (dict->len == 0 && op_tvoffset != DICT_HASH_ADD) {
+        /* Nothing to find (and note that the hash table may not exist) */
+        return 0;
+    }
+
+    h = JimObjectHash(keyObjPtr);
+    if (dict->oldht) {
+        JimDictRehashStep(dict, JIM_HT_REHASH_STEP);
+    }
+    slot = JimDictProbe(dict, dict->ht, dict->sizemask, keyObjPtr, h, &freeslot);
+    if (slot == NULL && dict->oldht) {
+        /* During an incremental rehash, the entry may not yet have been moved */
+        struct Jim_HashIndex *unused;
+        slot = JimDictProbe(dict, dict->oldht, dict->oldsize - 1, keyObjPtr, h, &unused);
+        inold = 1;
+    }
+    if (slot) {
+        tvoffset = slot->offset;
     }
 
     switch (op_tvoffset) {
@@ -7723,67 +9366,62 @@ static int JimDictHashFind(Jim_Dict *dict, Jim_Obj *keyObjPtr, int op_tvoffset)
         case DICT_HASH_REMOVE:
             if (tvoffset) {
                 /* Found, remove with -1 meaning a removed entry */
-                dict->ht[idx].offset = -1;
-                dict->dummy++;
+                slot->offset = -1;
+                if (!inold) {
+                    dict->dummy++;
+                }
             }
             /* else if not found, return 0 */
             break;
         case DICT_HASH_ADD:
             if (tvoffset == 0) {
                 /* Not found so add it at the the first removed entry, or the end */
-                if (first_removed != ~0) {
-                    idx = first_removed;
+                if (freeslot->offset == -1) {
                     dict->dummy--;
                 }
-                dict->ht[idx].offset = dict->len + 1;
-                dict->ht[idx].hash = h;
+                freeslot->offset = dict->len + 1;
+                freeslot->hash = h;
             }
             /* else if found, return tvoffset */
             break;
         default:
             assert(tvoffset);
             /* Found so replace the tvoffset */
-            dict->ht[idx].offset = op_tvoffset;
+            slot->offset = op_tvoffset;
             break;
     }
 
     return tvoffset;
 }
 
-/* Expand or create the hashtable to at least size 'size'
+/* Expand, shrink or create the hashtable to at least size 'size'
  * The hash table size should have room for twice the number
- * of keys to reduce collisions
+ * of keys to reduce collisions. Removed (dummy) entries are discarded.
+ * Large hash tables are rehashed incrementally. See JimDictRehashStep()
  */
 static void JimDictExpandHashTable(Jim_Dict *dict, unsigned int size)
 {
-    int i;
-    struct JimDictHashEntry *prevht = dict->ht;
-    int prevsize = dict->size;
+    struct Jim_HashIndex *prevht = dict->ht;
+    unsigned int prevsize = dict->size;
+
+    /* Any previous incremental rehash must be complete before starting a new one */
+    JimDictRehashStep(dict, dict->oldsize);
 
     dict->size = JimHashTableNextPower(size);
     dict->sizemask = dict->size - 1;
 
     /* Allocate a new table so that we don't need to recalulate hashes */
-    dict->ht = Jim_Alloc(dict->size * sizeof(*dict->ht));
-    memset(dict->ht, 0, dict->size * sizeof(*dict->ht));
+    dict->ht = JimAllocZeroed(dict->size * sizeof(*dict->ht));
+    dict->dummy = 0;
 
-    /* Now add all the table entries to the new table */
-    for (i = 0; i < prevsize; i++) {
-        if (prevht[i].offset > 0) {
-            /* Find the location in the new table for this entry */
-            unsigned h = prevht[i].hash;
-            unsigned idx = h & dict->sizemask;
-            unsigned peturb = h;
-
-            while (dict->ht[idx].offset) {
-                peturb >>= 5;
-                idx = (5 * idx + 1 + peturb) & dict->sizemask;
-            }
-            dict->ht[idx].offset = prevht[i].offset;
-            dict->ht[idx].hash = h;
-        }
+    if (prevht) {
+        /* Now add all the table entries to the new table, or just some
+         * of them if the rehash is incremental */
+        dict->oldht = prevht;
+        dict->oldsize = prevsize;
+        dict->rehashidx = 0;
+        JimDictRehashStep(dict, prevsize >= JIM_HT_REHASH_MIN ? JIM_HT_REHASH_STEP : prevsize);
     }
-    Jim_Free(prevht);
 }
 
 /**
@@ -7807,12 +9445,82 @@ static int JimDictAdd(Jim_Dict *dict, Jim_Obj *keyObjPtr)
     if (dict->size <= dict->len + dict->dummy) {
         /* The first add grows the size to 8, and thereafter it is doubled
          * in size. Note that hash table sizes are always powers of two.
+         * But if most of the space is taken by dummy entries, as happens when
+         * a dict has many keys added and removed, rebuild at the same size instead.
          */
-        JimDictExpandHashTable(dict, dict->size ? dict->size * 2 : 8);
+        unsigned int size = 8;
+        if (dict->size) {
+            size = dict->len >= dict->size / 2 ? dict->size * 2 : dict->size;
+        }
+        JimDictExpandHashTable(dict, size);
     }
     return JimDictHashFind(dict, keyObjPtr, DICT_HASH_ADD);
 }
 
+/* Only shrink a dict whose hash table or table of entries is bigger than this */
+#define JIM_DICT_SHRINK_MIN 64
+
+/**
+ * Called after removing an entry to shrink the hash table and
+ * the table of entries once the dict is well below its peak size.
+ */
+static void JimDictShrink(Jim_Dict *dict)
+{
+    if (dict->size > JIM_DICT_SHRINK_MIN && dict->len < dict->size / 8) {
+        JimDictExpandHashTable(dict, dict->len * 2);
+    }
+    if (dict->maxLen > JIM_DICT_SHRINK_MIN && dict->len < dict->maxLen / 4) {
+        dict->maxLen /= 2;
+        dict->table = Jim_Realloc(dict->table, dict->maxLen * sizeof(*dict->table));
+    }
+}
+
+/**
+ * Shrink the dict to fit the current entries, discarding
+ * any dummy entries in the hash table.
+ */
+static void JimDictCompact(Jim_Dict *dict)
+{
+    JimDictExpandHashTable(dict, dict->len + 2);
+    /* Complete any incremental rehash now */
+    JimDictRehashStep(dict, dict->oldsize);
+
+    if (dict->maxLen != dict->len) {
+        dict->maxLen = dict->len;
+        if (dict->len) {
+            dict->table = Jim_Realloc(dict->table, dict->maxLen * sizeof(*dict->table));
+        }
+        else {
+            Jim_Free(dict->table);
+            dict->table = NULL;
+        }
+    }
+}
+
+/* Size hints larger than this are capped, since they may come from a script
+ * (dict create -size). Larger dicts still grow as usual.
+ */
+#define JIM_DICT_MAX_RESERVE 65536
+
+/**
+ * Make room in the dict for a total of 'keys' keys (up to JIM_DICT_MAX_RESERVE)
+ * so that adding them allocates neither the hash table nor the table of entries again.
+ */
+static void JimDictReserve(Jim_Dict *dict, int keys)
+{
+    if (keys > JIM_DICT_MAX_RESERVE) {
+        keys = JIM_DICT_MAX_RESERVE;
+    }
+    /* See JimDictAdd(). The last key is added when dict->len is keys * 2 - 2 */
+    if (dict->size < (unsigned)keys * 2 + dict->dummy) {
+        JimDictExpandHashTable(dict, keys * 2);
+    }
+    if (dict->maxLen < keys * 2) {
+        dict->maxLen = keys * 2;
+        dict->table = Jim_Realloc(dict->table, dict->maxLen * sizeof(*dict->table));
+    }
+}
+
 /**
  * Allocate and return a new Jim_Dict structure
  * with space for 'table_size' (key, object) entries
@@ -7831,12 +9539,6 @@ static Jim_Dict *JimDictNew(Jim_Interp *interp, int table_size, int ht_size)
         dict->table = Jim_Alloc(table_size * sizeof(*dict->table));
         dict->maxLen = table_size;
     }
-#ifdef JIM_RANDOMISE_HASH
-    /* This is initialised to a random value to avoid a hash collision attack.
-     * See: n.runs-SA-2011.004
-     */
-    dict->uniq = (rand() ^ time(NULL) ^ clock());
-#endif
     return dict;
 }
 
@@ -7852,6 +9554,9 @@ static void DupDictInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dup
     Jim_Dict *oldDict = srcPtr->internalRep.dictValue;
     int i;
 
+    /* Complete any incremental rehash so that the hash table can simply be copied */
+    JimDictRehashStep(oldDict, oldDict->oldsize);
+
     /* Create a new hash table */
     Jim_Dict *newDict = JimDictNew(interp, oldDict->maxLen, oldDict->size);
 
@@ -7862,9 +9567,6 @@ static void DupDictInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dup
     }
     newDict->len = oldDict->len;
 
-    /* Must keep the same uniq so that the hashes agree */
-    newDict->uniq = oldDict->uniq;
-
     /* Now copy the the hash table efficiently */
     memcpy(newDict->ht, oldDict->ht, sizeof(*oldDict->ht) * oldDict->size);
 
@@ -7909,6 +9611,7 @@ static int SetDictFromAny(Jim_Interp *interp, struct Jim_Obj *objPtr)
         int i;
 
         /* Take ownership of the list array */
+        JimListFlatten(interp, objPtr);
         dict->table = objPtr->internalRep.listValue.ele;
         dict->maxLen = objPtr->internalRep.listValue.maxLen;
 
@@ -7976,6 +9679,7 @@ static int DictAddElement(Jim_Interp *interp, Jim_Obj *objPtr,
                 /* Now we need to update the hash table for the swapped entry */
                 JimDictHashFind(dict, dict->table[tvoffset - 1], tvoffset);
             }
+            JimDictShrink(dict);
             return JIM_OK;
         }
         return JIM_ERR;
@@ -8028,6 +9732,19 @@ int Jim_DictAddElement(Jim_Interp *interp, Jim_Obj *objPtr,
     return DictAddElement(interp, objPtr, keyObjPtr, valueObjPtr);
 }
 
+/* Pre-size a dict so that it can hold 'size' keys without growing.
+ * This is useful when the final size of a dict being built is known in advance.
+ * Returns JIM_ERR if objPtr is not a valid dict.
+ */
+int Jim_DictReserve(Jim_Interp *interp, Jim_Obj *objPtr, int size)
+{
+    if (SetDictFromAny(interp, objPtr) != JIM_OK) {
+        return JIM_ERR;
+    }
+    JimDictReserve(objPtr->internalRep.dictValue, size);
+    return JIM_OK;
+}
+
 Jim_Obj *Jim_NewDictObj(Jim_Interp *interp, Jim_Obj *const *elements, int len)
 {
     Jim_Obj *objPtr;
@@ -8616,7 +10333,7 @@ static int JimExprOpNumUnary(Jim_Interp *interp, struct JimExprNode *node)
 
     if (rc == JIM_OK) {
         if (intresult) {
-            Jim_SetResultInt(interp, wC);
+            JimSetResultInt(interp, wC);
         }
         else {
             Jim_SetResult(interp, Jim_NewDoubleObj(interp, dC));
@@ -8652,7 +10369,7 @@ static int JimExprOpIntUnary(Jim_Interp *interp, struct JimExprNode *node)
     if (rc == JIM_OK) {
         switch (node->type) {
             case JIM_EXPROP_BITNOT:
-                Jim_SetResultInt(interp, ~wA);
+                JimSetResultInt(interp, ~wA);
                 break;
             case JIM_EXPROP_FUNC_SRAND:
                 JimPrngSeed(interp, (unsigned char *)&wA, sizeof(wA));
@@ -8838,7 +10555,7 @@ static int JimExprOpIntBin(Jim_Interp *interp, struct JimExprNode *node)
             default:
                 abort();
         }
-        Jim_SetResultInt(interp, wC);
+        JimSetResultInt(interp, wC);
     }
 
     Jim_DecrRefCount(interp, A);
@@ -9035,7 +10752,7 @@ done:
     Jim_DecrRefCount(interp, B);
     return rc;
 intresult:
-    Jim_SetResultInt(interp, wC);
+    JimSetResultInt(interp, wC);
     goto done;
 doubleresult:
     Jim_SetResult(interp, Jim_NewDoubleObj(interp, dC));
@@ -9134,7 +10851,7 @@ static int JimExprOpStrBin(Jim_Interp *interp, struct JimExprNode *node)
         default:
             abort();
     }
-    Jim_SetResultInt(interp, wC);
+    JimSetResultInt(interp, wC);
 
 error:
     Jim_DecrRefCount(interp, A);
@@ -9171,9 +10888,14 @@ static int ExprBool(Jim_Interp *interp, Jim_Obj *obj)
 /* Evaluate a logical AND expression with short-circuiting. */
 static int JimExprOpAnd(Jim_Interp *interp, struct JimExprNode *node)
 {
-    /* evaluate left */
-    int result = JimExprGetTermBoolean(interp, node->left);
+    int result;
 
+    /* A chain of && is arranged as a && (b && c) by ExprTreeOptimise(),
+     * so evaluate the left operands until one is false.
+     */
+    while ((result = JimExprGetTermBoolean(interp, node->left)) == 1 && node->right->type == JIM_EXPROP_LOGICAND) {
+        node = node->right;
+    }
     if (result == 1) {
         /* true so evaluate right */
         result = JimExprGetTermBoolean(interp, node->right);
@@ -9181,16 +10903,19 @@ static int JimExprOpAnd(Jim_Interp *interp, struct JimExprNode *node)
     if (result == -1) {
         return JIM_ERR;
     }
-    Jim_SetResultInt(interp, result);
+    JimSetResultInt(interp, result);
     return JIM_OK;
 }
 
 /* Evaluate a logical OR expression with short-circuiting. */
 static int JimExprOpOr(Jim_Interp *interp, struct JimExprNode *node)
 {
-    /* evaluate left */
-    int result = JimExprGetTermBoolean(interp, node->left);
+    int result;
 
+    /* As for JimExprOpAnd(), evaluate the left operands until one is true */
+    while ((result = JimExprGetTermBoolean(interp, node->left)) == 0 && node->right->type == JIM_EXPROP_LOGICOR) {
+        node = node->right;
+    }
     if (result == 0) {
         /* false so evaluate right */
         result = JimExprGetTermBoolean(interp, node->right);
@@ -9198,7 +10923,7 @@ static int JimExprOpOr(Jim_Interp *interp, struct JimExprNode *node)
     if (result == -1) {
         return JIM_ERR;
     }
-    Jim_SetResultInt(interp, result);
+    JimSetResultInt(interp, result);
     return JIM_OK;
 }
 
@@ -9594,8 +11319,10 @@ struct ExprTree
 {
     struct JimExprNode *expr;   /* The first operator or term */
     struct JimExprNode *nodes;  /* Storage of all nodes in the tree */
+    int size;                   /* Number of nodes in storage */
     int len;                    /* Number of nodes in use */
     int inUse;                  /* Used for sharing. */
+    int numeric;                /* Can be evaluated by JimExprEvalNumeric() */
 };
 
 /* Free an array of expression nodes. */
@@ -9613,7 +11340,7 @@ static void ExprTreeFreeNodes(Jim_Interp *interp, struct JimExprNode *nodes, int
 /* Free a parsed expression tree. */
 static void ExprTreeFree(Jim_Interp *interp, struct ExprTree *expr)
 {
-    ExprTreeFreeNodes(interp, expr->nodes, expr->len);
+    ExprTreeFreeNodes(interp, expr->nodes, expr->size);
     Jim_Free(expr);
 }
 
@@ -9941,6 +11668,175 @@ missingoperand:
     return JIM_ERR;
 }
 
+/* Returns 1 if the expression tree consists only of numeric operators
+ * on constants and variables, and so may be evaluated by JimExprEvalNumeric()
+ */
+static int JimExprIsNumeric(const struct JimExprNode *node)
+{
+    switch (node->type) {
+        case JIM_TT_EXPR_INT:
+        case JIM_TT_EXPR_DOUBLE:
+        case JIM_TT_STR:
+        case JIM_TT_VAR:
+            return 1;
+
+        case JIM_EXPROP_MUL:
+        case JIM_EXPROP_DIV:
+        case JIM_EXPROP_MOD:
+        case JIM_EXPROP_SUB:
+        case JIM_EXPROP_ADD:
+        case JIM_EXPROP_LSHIFT:
+        case JIM_EXPROP_RSHIFT:
+        case JIM_EXPROP_LT:
+        case JIM_EXPROP_GT:
+        case JIM_EXPROP_LTE:
+        case JIM_EXPROP_GTE:
+        case JIM_EXPROP_NUMEQ:
+        case JIM_EXPROP_NUMNE:
+        case JIM_EXPROP_BITAND:
+        case JIM_EXPROP_BITXOR:
+        case JIM_EXPROP_BITOR:
+        case JIM_EXPROP_LOGICAND:
+        case JIM_EXPROP_LOGICOR:
+            return JimExprIsNumeric(node->left) && JimExprIsNumeric(node->right);
+
+        case JIM_EXPROP_NOT:
+        case JIM_EXPROP_BITNOT:
+        case JIM_EXPROP_UNARYMINUS:
+        case JIM_EXPROP_UNARYPLUS:
+        case JIM_EXPROP_FUNC_INT:
+        case JIM_EXPROP_FUNC_WIDE:
+        case JIM_EXPROP_FUNC_ABS:
+        case JIM_EXPROP_FUNC_DOUBLE:
+        case JIM_EXPROP_FUNC_ROUND:
+            return JimExprIsNumeric(node->left);
+
+        default:
+            return 0;
+    }
+}
+
+/* Returns 1 if the node is a numeric literal.
+ * String and boolean literals are not considered since a failed
+ * conversion may change the internal representation of the literal
+ * and hence the result of a later evaluation.
+ */
+static int JimExprIsConst(struct JimExprNode *node)
+{
+    return node->type == JIM_TT_EXPR_INT || node->type == JIM_TT_EXPR_DOUBLE;
+}
+
+/* Evaluates an operator whose operands are all numeric literals and,
+ * if successful, replaces the node with a term holding the result.
+ * On error the node is left as is so that the error is raised
+ * when the expression is evaluated.
+ */
+static void ExprTreeFoldNode(Jim_Interp *interp, struct JimExprNode *node)
+{
+    Jim_Obj *savedResultObj = Jim_GetResult(interp);
+
+    Jim_IncrRefCount(savedResultObj);
+    if (JimExprEvalTermNode(interp, node) == JIM_OK) {
+        Jim_Obj *objPtr = Jim_GetResult(interp);
+        struct JimExprNode *operands[3];
+        int i;
+
+        operands[0] = node->left;
+        operands[1] = node->right;
+        operands[2] = node->ternary;
+        for (i = 0; i < 3; i++) {
+            /* The operand nodes are no longer referenced */
+            if (operands[i]) {
+                Jim_DecrRefCount(interp, operands[i]->objPtr);
+                operands[i]->objPtr = NULL;
+            }
+        }
+        if (objPtr->typePtr == &intObjType) {
+            node->type = JIM_TT_EXPR_INT;
+        }
+        else if (objPtr->typePtr == &doubleObjType) {
+            node->type = JIM_TT_EXPR_DOUBLE;
+        }
+        else {
+            node->type = JIM_TT_STR;
+        }
+        node->objPtr = objPtr;
+        Jim_IncrRefCount(objPtr);
+        node->left = node->right = node->ternary = NULL;
+    }
+    Jim_SetResult(interp, savedResultObj);
+    Jim_DecrRefCount(interp, savedResultObj);
+}
+
+/* Optimises the (sub)tree at node and returns the new top node.
+ *
+ * Operators with only numeric literal operands are evaluated once here
+ * rather than every time the expression is evaluated. rand() and srand()
+ * are not pure so they are never folded.
+ *
+ * Chains of && and || are rearranged from (a && b) && c to a && (b && c)
+ * so that JimExprOpAnd() and JimExprOpOr() can walk the chain iteratively
+ * rather than recursing for each operand.
+ */
+static struct JimExprNode *ExprTreeOptimise(Jim_Interp *interp, struct JimExprNode *node)
+{
+    struct JimExprNode *top;
+
+    if (!TOKEN_IS_EXPR_OP(node->type)) {
+        return node;
+    }
+    if (node->left) {
+        node->left = ExprTreeOptimise(interp, node->left);
+    }
+    if (node->right) {
+        node->right = ExprTreeOptimise(interp, node->right);
+    }
+    if (node->ternary) {
+        node->ternary = ExprTreeOptimise(interp, node->ternary);
+    }
+
+    if (node->type != JIM_EXPROP_FUNC_RAND && node->type != JIM_EXPROP_FUNC_SRAND
+        && (!node->left || JimExprIsConst(node->left))
+        && (!node->right || JimExprIsConst(node->right))
+        && (!node->ternary || JimExprIsConst(node->ternary))) {
+        ExprTreeFoldNode(interp, node);
+        return node;
+    }
+
+    if ((node->type == JIM_EXPROP_LOGICAND || node->type == JIM_EXPROP_LOGICOR) && node->left->type == node->type) {
+        /* The left chain has already been rearranged, so append
+         * this node at the end of it, taking the last operand as left.
+         */
+        struct JimExprNode *tail;
+
+        top = tail = node->left;
+        while (tail->right->type == node->type) {
+            tail = tail->right;
+        }
+        node->left = tail->right;
+        tail->right = node;
+        return top;
+    }
+    return node;
+}
+
+/* Returns the number of nodes in the (sub)tree at node */
+static int ExprTreeCountNodes(struct JimExprNode *node)
+{
+    int count = 1;
+
+    if (node->left) {
+        count += ExprTreeCountNodes(node->left);
+    }
+    if (node->right) {
+        count += ExprTreeCountNodes(node->right);
+    }
+    if (node->ternary) {
+        count += ExprTreeCountNodes(node->ternary);
+    }
+    return count;
+}
+
 static struct ExprTree *ExprTreeCreateTree(Jim_Interp *interp, const ParseTokenList *tokenlist, Jim_Obj *exprObjPtr, Jim_Obj *fileNameObj)
 {
     struct ExprTree *expr;
@@ -9982,9 +11878,13 @@ static struct ExprTree *ExprTreeCreateTree(Jim_Interp *interp, const ParseTokenL
     expr->inUse = 1;
     expr->expr = top;
     expr->nodes = builder.nodes;
-    expr->len = builder.next - builder.nodes;
+    expr->size = builder.next - builder.nodes;
+    expr->expr = top = ExprTreeOptimise(interp, top);
+    expr->len = ExprTreeCountNodes(top);
+    /* A single term must be returned as is, so only consider operators */
+    expr->numeric = TOKEN_IS_EXPR_OP(top->type) && JimExprIsNumeric(top);
 
-    assert(expr->len <= tokenlist->count - 1);
+    assert(expr->size <= tokenlist->count - 1);
 
     return expr;
 }
@@ -10200,6 +12100,257 @@ static int JimExprGetTermBoolean(Jim_Interp *interp, struct JimExprNode *node)
     return -1;
 }
 
+#ifdef JIM_OPTIMIZATION
+/* An unboxed intermediate result of JimExprEvalNumeric() */
+typedef struct JimExprNum {
+    int isdouble;
+    jim_wide w;
+    double d;
+} JimExprNum;
+
+/* Get the numeric value of a term, following the same rules as JimExprOpBin().
+ * Returns 0 if the term is not a number.
+ */
+static int JimExprNumTerm(Jim_Interp *interp, Jim_Obj *objPtr, JimExprNum *n)
+{
+    if ((objPtr->typePtr != &doubleObjType || objPtr->bytes) && JimGetWideNoErr(interp, objPtr, &n->w) == JIM_OK) {
+        n->isdouble = 0;
+        return 1;
+    }
+    if (Jim_GetDouble(interp, objPtr, &n->d) == JIM_OK) {
+        n->isdouble = 1;
+        return 1;
+    }
+    return 0;
+}
+
+#define JimExprNumTrue(N) ((N)->isdouble ? (N)->d != 0 : (N)->w != 0)
+
+/* Evaluate an expression for which JimExprIsNumeric() is true, keeping
+ * intermediate results as unboxed jim_wide or double values rather than
+ * creating an object for each operator.
+ *
+ * This never sets an error. Instead it returns 0 if the expression must be evaluated
+ * by the generic engine, e.g. for a non-numeric operand, a missing variable or
+ * division by zero. Since terms are only constants and variables, there are
+ * no side effects from evaluating the expression twice.
+ */
+static int JimExprEvalNumeric(Jim_Interp *interp, struct JimExprNode *node, JimExprNum *n)
+{
+    JimExprNum a, b;
+
+    switch (node->type) {
+        case JIM_TT_EXPR_INT:
+        case JIM_TT_EXPR_DOUBLE:
+        case JIM_TT_STR:
+            return JimExprNumTerm(interp, node->objPtr, n);
+
+        case JIM_TT_VAR: {
+            Jim_Obj *objPtr = Jim_GetVariable(interp, node->objPtr, JIM_NONE);
+            return objPtr && JimExprNumTerm(interp, objPtr, n);
+        }
+
+        case JIM_EXPROP_LOGICAND:
+        case JIM_EXPROP_LOGICOR:
+            if (!JimExprEvalNumeric(interp, node->left, &a)) {
+                return 0;
+            }
+            n->isdouble = 0;
+            n->w = JimExprNumTrue(&a);
+            if (n->w == (node->type == JIM_EXPROP_LOGICAND)) {
+                /* Not short circuited */
+                if (!JimExprEvalNumeric(interp, node->right, &b)) {
+                    return 0;
+                }
+                n->w = JimExprNumTrue(&b);
+            }
+            return 1;
+    }
+
+    if (!JimExprEvalNumeric(interp, node->left, &a)) {
+        return 0;
+    }
+    n->isdouble = 0;
+
+    /* Unary operators */
+    switch (node->type) {
+        case JIM_EXPROP_NOT:
+            n->w = !JimExprNumTrue(&a);
+            return 1;
+        case JIM_EXPROP_BITNOT:
+            n->w = ~a.w;
+            return !a.isdouble;
+        case JIM_EXPROP_UNARYPLUS:
+            *n = a;
+            return 1;
+        case JIM_EXPROP_UNARYMINUS:
+            *n = a;
+            if (a.isdouble) {
+                n->d = -a.d;
+            }
+            else {
+                n->w = -a.w;
+            }
+            return 1;
+        case JIM_EXPROP_FUNC_ABS:
+            *n = a;
+            if (a.isdouble) {
+                n->d = a.d >= 0 ? a.d : -a.d;
+            }
+            else {
+                n->w = a.w >= 0 ? a.w : -a.w;
+            }
+            return 1;
+        case JIM_EXPROP_FUNC_INT:
+        case JIM_EXPROP_FUNC_WIDE:
+            n->w = a.isdouble ? (jim_wide)a.d : a.w;
+            return 1;
+        case JIM_EXPROP_FUNC_ROUND:
+            if (a.isdouble) {
+                n->w = a.d < 0 ? (a.d - 0.5) : (a.d + 0.5);
+            }
+            else {
+                n->w = a.w;
+            }
+            return 1;
+        case JIM_EXPROP_FUNC_DOUBLE:
+            n->isdouble = 1;
+            n->d = a.isdouble ? a.d : a.w;
+            return 1;
+    }
+
+    /* Binary operators */
+    if (!JimExprEvalNumeric(interp, node->right, &b)) {
+        return 0;
+    }
+    if (!a.isdouble && !b.isdouble) {
+        switch (node->type) {
+            case JIM_EXPROP_ADD:
+                n->w = a.w + b.w;
+                return 1;
+            case JIM_EXPROP_SUB:
+                n->w = a.w - b.w;
+                return 1;
+            case JIM_EXPROP_MUL:
+                n->w = a.w * b.w;
+                return 1;
+            case JIM_EXPROP_DIV:
+            case JIM_EXPROP_MOD: {
+                /* Rounding as for JimExprOpBin() and JimExprOpIntBin() */
+                int negative = 0;
+
+                if (b.w == 0) {
+                    return 0;
+                }
+                if (b.w < 0) {
+                    b.w = -b.w;
+                    a.w = -a.w;
+                    negative = 1;
+                }
+                if (node->type == JIM_EXPROP_DIV) {
+                    n->w = a.w / b.w;
+                    if (a.w % b.w < 0) {
+                        n->w--;
+                    }
+                }
+                else {
+                    n->w = a.w % b.w;
+                    if (n->w < 0) {
+                        n->w += b.w;
+                    }
+                    if (negative) {
+                        n->w = -n->w;
+                    }
+                }
+                return 1;
+            }
+            case JIM_EXPROP_LSHIFT:
+                n->w = a.w << b.w;
+                return 1;
+            case JIM_EXPROP_RSHIFT:
+                n->w = a.w >> b.w;
+                return 1;
+            case JIM_EXPROP_BITAND:
+                n->w = a.w & b.w;
+                return 1;
+            case JIM_EXPROP_BITXOR:
+                n->w = a.w ^ b.w;
+                return 1;
+            case JIM_EXPROP_BITOR:
+                n->w = a.w | b.w;
+                return 1;
+            case JIM_EXPROP_LT:
+                n->w = a.w < b.w;
+                return 1;
+            case JIM_EXPROP_GT:
+                n->w = a.w > b.w;
+                return 1;
+            case JIM_EXPROP_LTE:
+                n->w = a.w <= b.w;
+                return 1;
+            case JIM_EXPROP_GTE:
+                n->w = a.w >= b.w;
+                return 1;
+            case JIM_EXPROP_NUMEQ:
+                n->w = a.w == b.w;
+                return 1;
+            case JIM_EXPROP_NUMNE:
+                n->w = a.w != b.w;
+                return 1;
+        }
+        return 0;
+    }
+
+    if (!a.isdouble) {
+        a.d = a.w;
+    }
+    if (!b.isdouble) {
+        b.d = b.w;
+    }
+    n->isdouble = 1;
+    switch (node->type) {
+        case JIM_EXPROP_ADD:
+            n->d = a.d + b.d;
+            return 1;
+        case JIM_EXPROP_SUB:
+            n->d = a.d - b.d;
+            return 1;
+        case JIM_EXPROP_MUL:
+            n->d = a.d * b.d;
+            return 1;
+        case JIM_EXPROP_DIV:
+            if (b.d == 0) {
+                return 0;
+            }
+            n->d = a.d / b.d;
+            return 1;
+    }
+    n->isdouble = 0;
+    switch (node->type) {
+        case JIM_EXPROP_LT:
+            n->w = a.d < b.d;
+            return 1;
+        case JIM_EXPROP_GT:
+            n->w = a.d > b.d;
+            return 1;
+        case JIM_EXPROP_LTE:
+            n->w = a.d <= b.d;
+            return 1;
+        case JIM_EXPROP_GTE:
+            n->w = a.d >= b.d;
+            return 1;
+        case JIM_EXPROP_NUMEQ:
+            n->w = a.d == b.d;
+            return 1;
+        case JIM_EXPROP_NUMNE:
+            n->w = a.d != b.d;
+            return 1;
+    }
+    /* Integer-only operator */
+    return 0;
+}
+#endif
+
 int Jim_EvalExpression(Jim_Interp *interp, Jim_Obj *exprObjPtr)
 {
     struct ExprTree *expr;
@@ -10289,6 +12440,19 @@ int Jim_EvalExpression(Jim_Interp *interp, Jim_Obj *exprObjPtr)
         }
     }
 noopt:
+    if (expr->numeric && !interp->safeexpr) {
+        JimExprNum n;
+
+        if (JimExprEvalNumeric(interp, expr->expr, &n)) {
+            if (n.isdouble) {
+                Jim_SetResult(interp, Jim_NewDoubleObj(interp, n.d));
+            }
+            else {
+                JimSetResultInt(interp, n.w);
+            }
+            goto done;
+        }
+    }
 #endif
 
     /* In order to avoid the internal repr being freed due to
@@ -11389,7 +13553,7 @@ static Jim_Obj *JimInterpolateTokens(Jim_Interp *interp, const ScriptToken * tok
     }
 
 
-    s = objPtr->bytes = Jim_Alloc(totlen + 1);
+    s = JimAllocStringBytes(objPtr, totlen);
     objPtr->length = totlen;
     for (i = 0; i < tokens; i++) {
         if (intv[i]) {
@@ -11534,6 +13698,7 @@ static int JimEvalObjList(Jim_Interp *interp, Jim_Obj *listPtr)
 
     if (listPtr->internalRep.listValue.len) {
         Jim_IncrRefCount(listPtr);
+        JimListFlatten(interp, listPtr);
         retcode = JimInvokeCommand(interp,
             listPtr->internalRep.listValue.len,
             listPtr->internalRep.listValue.ele);
@@ -11734,8 +13899,9 @@ int Jim_EvalObj(Jim_Interp *interp, Jim_Obj *scriptObjPtr)
 
                 /* Now copy in the expanded version */
                 for (k = 0; k < len; k++) {
-                    argv[j++] = wordObjPtr->internalRep.listValue.ele[k];
-                    Jim_IncrRefCount(wordObjPtr->internalRep.listValue.ele[k]);
+                    argv[j] = ListGetElement(wordObjPtr, k);
+                    Jim_IncrRefCount(argv[j]);
+                    j++;
                 }
 
                 /* The original object reference is no longer needed,
@@ -11744,50 +13910,260 @@ int Jim_EvalObj(Jim_Interp *interp, Jim_Obj *scriptObjPtr)
                  * in its place. */
                 Jim_DecrRefCount(interp, wordObjPtr);
 
-                /* And update the indexes */
-                j--;
-                argc += len - 1;
-            }
+                /* And update the indexes */
+                j--;
+                argc += len - 1;
+            }
+        }
+
+        if (retcode == JIM_OK && argc) {
+            /* Invoke the command */
+            retcode = JimInvokeCommand(interp, argc, argv);
+            interp->taint = 0;
+            /* Check for a signal after each command */
+            if (Jim_CheckSignal(interp)) {
+                retcode = JIM_SIGNAL;
+            }
+        }
+
+        /* Finished with the command, so decrement ref counts of each argument */
+        while (j-- > 0) {
+            Jim_DecrRefCount(interp, argv[j]);
+        }
+
+        if (argv != sargv) {
+            Jim_Free(argv);
+            argv = sargv;
+        }
+    }
+
+    /* Possibly add to the error stack trace */
+    if (retcode == JIM_ERR) {
+        JimSetErrorStack(interp, NULL);
+    }
+
+    JimPopEvalFrame(interp);
+
+    /* Note that we don't have to decrement inUse, because the
+     * following code transfers our use of the reference again to
+     * the script object. */
+    Jim_FreeIntRep(interp, scriptObjPtr);
+    scriptObjPtr->typePtr = &scriptObjType;
+    Jim_SetIntRepPtr(scriptObjPtr, script);
+    Jim_DecrRefCount(interp, scriptObjPtr);
+
+    return retcode;
+}
+
+#ifdef JIM_COMPILED_LOCALS
+/* Returns 1 if the literal variable name may be a compiled local.
+ * Not a namespace-qualified name (including jim::defer, which JimInvokeDefer()
+ * looks up by name) or an array element.
+ */
+static int JimIsLocalVarName(Jim_Obj *nameObjPtr)
+{
+    int len;
+    const char *name = Jim_GetString(nameObjPtr, &len);
+
+    if (len == 0 || strstr(name, "::") || nameObjPtr->taint) {
+        return 0;
+    }
+    return name[len - 1] != ')' || strchr(name, '(') == NULL;
+}
+
+/* Add a compiled local unless it is a duplicate, or a static variable */
+static void JimAddProcLocal(Jim_Cmd *cmd, Jim_ProcLocals *pl, Jim_Obj *nameObjPtr)
+{
+    int i;
+
+    if (pl->len == JIM_MAX_LOCALS || !JimIsLocalVarName(nameObjPtr)
+        || Jim_String(nameObjPtr)[0] == '&') {
+        return;
+    }
+    if (cmd->u.proc.staticVars && JimFindVariable(cmd->u.proc.staticVars, nameObjPtr)) {
+        return;
+    }
+    for (i = 0; i < pl->len; i++) {
+        if (Jim_StringEqObj(pl->names[i], nameObjPtr)) {
+            return;
+        }
+    }
+    Jim_IncrRefCount(nameObjPtr);
+    pl->names[pl->len++] = nameObjPtr;
+}
+
+/* Returns the word as a literal if it is a single unsubstituted token, or NULL */
+static Jim_Obj *JimLiteralWord(const ScriptToken *token)
+{
+    if ((token->type == JIM_TT_ESC || token->type == JIM_TT_STR) && !token->objPtr->taint) {
+        return token->objPtr;
+    }
+    return NULL;
+}
+
+static void JimScanProcLocals(Jim_Interp *interp, Jim_Cmd *cmd, Jim_ProcLocals *pl, Jim_Obj *scriptObj);
+
+/* Add the compiled locals for one command line, given its literal words (or NULL) */
+static void JimScanProcLocalsLine(Jim_Interp *interp, Jim_Cmd *cmd, Jim_ProcLocals *pl,
+    int argc, Jim_Obj **words)
+{
+    int i;
+
+    if (argc < 3 || words[0] == NULL) {
+        return;
+    }
+    if (Jim_CompareStringImmediate(interp, words[0], "set")) {
+        if (argc == 3 && words[1]) {
+            JimAddProcLocal(cmd, pl, words[1]);
+        }
+    }
+    else if (Jim_CompareStringImmediate(interp, words[0], "foreach")) {
+        for (i = 1; i < argc - 1; i += 2) {
+            if (words[i]) {
+                int j;
+                int len = Jim_ListLength(interp, words[i]);
+
+                for (j = 0; j < len; j++) {
+                    JimAddProcLocal(cmd, pl, Jim_ListGetIndex(interp, words[i], j));
+                }
+            }
+        }
+        JimScanProcLocals(interp, cmd, pl, words[argc - 1]);
+    }
+    else if (Jim_CompareStringImmediate(interp, words[0], "while")) {
+        if (argc == 3) {
+            JimScanProcLocals(interp, cmd, pl, words[2]);
+        }
+    }
+    else if (Jim_CompareStringImmediate(interp, words[0], "for")) {
+        if (argc == 5) {
+            JimScanProcLocals(interp, cmd, pl, words[1]);
+            JimScanProcLocals(interp, cmd, pl, words[3]);
+            JimScanProcLocals(interp, cmd, pl, words[4]);
+        }
+    }
+    else if (Jim_CompareStringImmediate(interp, words[0], "if")) {
+        /* if expr1 ?then? body1 elseif expr2 ?then? body2 elseif ... ?else? ?bodyN? */
+        i = 2;
+        while (i < argc) {
+            if (words[i] && Jim_CompareStringImmediate(interp, words[i], "then")) {
+                i++;
+            }
+            if (i < argc) {
+                JimScanProcLocals(interp, cmd, pl, words[i++]);
+            }
+            if (i >= argc || words[i] == NULL) {
+                break;
+            }
+            if (Jim_CompareStringImmediate(interp, words[i], "elseif")) {
+                i += 2;
+                continue;
+            }
+            if (Jim_CompareStringImmediate(interp, words[i], "else")) {
+                i++;
+            }
+            if (i < argc) {
+                JimScanProcLocals(interp, cmd, pl, words[i]);
+            }
+            break;
+        }
+    }
+}
+
+/* Add the literal variable names set by set and foreach in the script as compiled locals,
+ * including in the literal bodies of if, while, for and foreach.
+ * A NULL or unparsable script is ignored.
+ */
+static void JimScanProcLocals(Jim_Interp *interp, Jim_Cmd *cmd, Jim_ProcLocals *pl, Jim_Obj *scriptObj)
+{
+    Jim_Obj *swords[JIM_EVAL_SARGV_LEN], **words = swords;
+    ScriptObj *script;
+    ScriptToken *token;
+    int i = 0;
+
+    if (scriptObj == NULL || scriptObj == interp->emptyObj) {
+        return;
+    }
+    script = JimGetScript(interp, scriptObj);
+    if (script->missing != ' ' && script->missing != '\\') {
+        return;
+    }
+    token = script->token;
+
+    while (i < script->len) {
+        int argc = token[i].objPtr->internalRep.scriptLineValue.argc;
+        int j;
+
+        if (argc > JIM_EVAL_SARGV_LEN) {
+            words = Jim_Alloc(sizeof(*words) * argc);
         }
 
-        if (retcode == JIM_OK && argc) {
-            /* Invoke the command */
-            retcode = JimInvokeCommand(interp, argc, argv);
-            interp->taint = 0;
-            /* Check for a signal after each command */
-            if (Jim_CheckSignal(interp)) {
-                retcode = JIM_SIGNAL;
+        /* Skip the JIM_TT_LINE token and find the literal words */
+        i++;
+        for (j = 0; j < argc; j++) {
+            if (token[i].type == JIM_TT_WORD) {
+                long wordtokens = JimWideValue(token[i++].objPtr);
+                words[j] = NULL;
+                i += wordtokens < 0 ? -wordtokens : wordtokens;
+            }
+            else {
+                words[j] = JimLiteralWord(&token[i++]);
             }
         }
 
-        /* Finished with the command, so decrement ref counts of each argument */
-        while (j-- > 0) {
-            Jim_DecrRefCount(interp, argv[j]);
-        }
+        JimScanProcLocalsLine(interp, cmd, pl, argc, words);
 
-        if (argv != sargv) {
-            Jim_Free(argv);
-            argv = sargv;
+        if (words != swords) {
+            Jim_Free(words);
+            words = swords;
         }
     }
+}
 
-    /* Possibly add to the error stack trace */
-    if (retcode == JIM_ERR) {
-        JimSetErrorStack(interp, NULL);
-    }
+/* Returns the compiled locals of the proc, determining them on the first call */
+static Jim_ProcLocals *JimGetProcLocals(Jim_Interp *interp, Jim_Cmd *cmd)
+{
+    if (cmd->u.proc.locals == NULL) {
+        Jim_ProcLocals *pl = Jim_Alloc(sizeof(*pl));
+        Jim_Obj *bodyObjPtr = cmd->u.proc.bodyObjPtr;
+        int i;
 
-    JimPopEvalFrame(interp);
+        pl->id = interp->callFrameEpoch++;
+        pl->len = 0;
+        pl->names = Jim_Alloc(sizeof(*pl->names) * JIM_MAX_LOCALS);
 
-    /* Note that we don't have to decrement inUse, because the
-     * following code transfers our use of the reference again to
-     * the script object. */
-    Jim_FreeIntRep(interp, scriptObjPtr);
-    scriptObjPtr->typePtr = &scriptObjType;
-    Jim_SetIntRepPtr(scriptObjPtr, script);
-    Jim_DecrRefCount(interp, scriptObjPtr);
+        for (i = 0; i < cmd->u.proc.argListLen; i++) {
+            if (i == cmd->u.proc.argsPos && cmd->u.proc.arglist[i].defaultObjPtr) {
+                /* args may be renamed */
+                JimAddProcLocal(cmd, pl, cmd->u.proc.arglist[i].defaultObjPtr);
+            }
+            else {
+                JimAddProcLocal(cmd, pl, cmd->u.proc.arglist[i].nameObjPtr);
+            }
+        }
+        if (!Jim_IsList(bodyObjPtr) || bodyObjPtr->bytes) {
+            JimScanProcLocals(interp, cmd, pl, bodyObjPtr);
+        }
+        cmd->u.proc.locals = pl;
+    }
+    return cmd->u.proc.locals;
+}
 
-    return retcode;
+/* Set up empty compiled locals in a new call frame for the proc */
+static void JimInitFrameLocals(Jim_Interp *interp, Jim_CallFrame *cf, Jim_Cmd *cmd)
+{
+    Jim_ProcLocals *pl = JimGetProcLocals(interp, cmd);
+
+    if (pl->len) {
+        if (cf->localsSize < pl->len) {
+            cf->locals = Jim_Realloc(cf->locals, sizeof(*cf->locals) * pl->len);
+            cf->localsSize = pl->len;
+        }
+        memset(cf->locals, 0, sizeof(*cf->locals) * pl->len);
+        cf->procLocals = pl;
+    }
 }
+#endif /* JIM_COMPILED_LOCALS */
 
 /* Bind one proc argument, applying list expansion when required. */
 static int JimSetProcArg(Jim_Interp *interp, Jim_Obj *argNameObj, Jim_Obj *argValObj)
@@ -11954,6 +14330,9 @@ static int JimCallProcedure(Jim_Interp *interp, Jim_Cmd *cmd, int argc, Jim_Obj
     callFramePtr->procArgsObjPtr = cmd->u.proc.argListObjPtr;
     callFramePtr->procBodyObjPtr = cmd->u.proc.bodyObjPtr;
     callFramePtr->staticVars = cmd->u.proc.staticVars;
+#ifdef JIM_COMPILED_LOCALS
+    JimInitFrameLocals(interp, callFramePtr, cmd);
+#endif
 
     interp->procLevel++;
 
@@ -12497,6 +14876,9 @@ static Jim_Obj *JimVariablesList(Jim_Interp *interp, Jim_Obj *patternObjPtr, int
     }
     else {
         Jim_CallFrame *framePtr = (mode & JIM_VARLIST_GLOBALS) ? interp->topFramePtr : interp->framePtr;
+#ifdef JIM_COMPILED_LOCALS
+        JimSpillLocals(interp, framePtr);
+#endif
         return JimHashtablePatternMatch(interp, &framePtr->vars, patternObjPtr, JimVariablesMatch,
             mode);
     }
@@ -13108,7 +15490,7 @@ static Jim_Obj *JimListIterNext(Jim_Interp *interp, Jim_ListIter *iter)
     if (iter->idx >= Jim_ListLength(interp, iter->objPtr)) {
         return NULL;
     }
-    return iter->objPtr->internalRep.listValue.ele[iter->idx++];
+    return ListGetElement(iter->objPtr, iter->idx++);
 }
 
 /**
@@ -13253,10 +15635,8 @@ static int Jim_LassignCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
         }
     }
 
-    resultObj = Jim_NewListObj(interp, NULL, 0);
-    while (!JimListIterDone(interp, &iter)) {
-        Jim_ListAppendElement(interp, resultObj, JimListIterNext(interp, &iter));
-    }
+    /* The remaining elements, which may share the original list */
+    resultObj = JimListRange(interp, argv[1], iter.idx, Jim_ListLength(interp, argv[1]) - iter.idx);
 
     Jim_SetResult(interp, resultObj);
 
@@ -13488,7 +15868,7 @@ static int Jim_LindexCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
 /* [llength] */
 static int Jim_LlengthCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
-    Jim_SetResultInt(interp, Jim_ListLength(interp, argv[1]));
+    JimSetResultInt(interp, Jim_ListLength(interp, argv[1]));
     return JIM_OK;
 }
 
@@ -13586,6 +15966,9 @@ static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
         Jim_SetResultString(interp, "list size must be a multiple of the stride length", -1);
         return JIM_ERR;
     }
+    if (stride > 1) {
+        JimListFlatten(interp, argv[0]);
+    }
 
     if (opt_all) {
         listObjPtr = Jim_NewListObj(interp, NULL, 0);
@@ -13605,6 +15988,7 @@ static int Jim_LsearchCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
 
         if (indexObj) {
             int indexlen = Jim_ListLength(interp, indexObj);
+            JimListFlatten(interp, indexObj);
             if (stride == 1) {
                 searchListObj = Jim_ListGetIndex(interp, argv[0], i);
             }
@@ -13796,13 +16180,14 @@ static int Jim_LreplaceCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const
     }
 
     /* Add the first set of elements */
-    newListObj = Jim_NewListObj(interp, listObj->internalRep.listValue.ele, first);
+    newListObj = Jim_NewListObj(interp, NULL, 0);
+    ListAppendRange(newListObj, listObj, 0, first);
 
     /* Add supplied elements */
     ListInsertElements(newListObj, -1, argc - 4, argv + 4);
 
     /* Add the remaining elements */
-    ListInsertElements(newListObj, -1, len - first - rangeLen, listObj->internalRep.listValue.ele + first + rangeLen);
+    ListAppendRange(newListObj, listObj, first + rangeLen, len - first - rangeLen);
 
     Jim_SetResult(interp, newListObj);
     return JIM_OK;
@@ -13981,7 +16366,7 @@ static int Jim_AppendCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
             stringObjPtr = Jim_NewEmptyStringObj(interp);
         }
         else if (Jim_IsShared(stringObjPtr)) {
-            stringObjPtr = Jim_DuplicateObj(interp, stringObjPtr);
+            stringObjPtr = JimDuplicateObjForAppend(interp, stringObjPtr);
         }
         for (i = 2; i < argc; i++) {
             Jim_AppendObj(interp, stringObjPtr, argv[i]);
@@ -14023,6 +16408,32 @@ static Jim_Obj *JimGetExprAsList(Jim_Interp *interp, struct JimExprNode *node)
 
 /* [debug] */
 #if defined(JIM_DEBUG_COMMAND) && !defined(JIM_BOOTSTRAP)
+/* Count the free and live objects, for [debug objcount] and [debug objstats] */
+static void JimCountObjects(Jim_Interp *interp, long *freePtr, long *livePtr)
+{
+    Jim_Obj *objPtr;
+
+    *freePtr = 0;
+    for (objPtr = interp->freeList; objPtr; objPtr = JimNextFreeObj(objPtr)) {
+        (*freePtr)++;
+    }
+#ifdef JIM_COMPACT_OBJ
+    *livePtr = interp->liveCount;
+#else
+    *livePtr = 0;
+    for (objPtr = interp->liveList; objPtr; objPtr = objPtr->nextObjPtr) {
+        (*livePtr)++;
+    }
+#endif
+}
+
+/* Append a name, value pair to a list, for [debug objstats] */
+static void JimListAppendStat(Jim_Interp *interp, Jim_Obj *listObjPtr, const char *name, long value)
+{
+    Jim_ListAppendElement(interp, listObjPtr, Jim_NewStringObj(interp, name, -1));
+    Jim_ListAppendElement(interp, listObjPtr, Jim_NewIntObj(interp, value));
+}
+
 /* Implement the internal debug command used by the test suite and diagnostics. */
 static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
@@ -14033,6 +16444,7 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
         OPT_INVSTR,
         OPT_OBJCOUNT,
         OPT_OBJECTS,
+        OPT_OBJSTATS,
         OPT_REFCOUNT,
         OPT_SCRIPTLEN,
         OPT_SHOW,
@@ -14044,6 +16456,7 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
         JIM_DEF_SUBCMD("invstr", "object", 1, 1),
         JIM_DEF_SUBCMD("objcount", NULL, 0, 0),
         JIM_DEF_SUBCMD("objects", "?-taint?", 0, 1),
+        JIM_DEF_SUBCMD("objstats", NULL, 0, 0),
         JIM_DEF_SUBCMD("refcount", "object", 1, 1),
         JIM_DEF_SUBCMD("scriptlen", "script", 1, 1),
         JIM_DEF_SUBCMD("show", "object", 1, 1),
@@ -14065,24 +16478,12 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
             return JIM_OK;
 
         case OPT_OBJCOUNT:{
-            int freeobj = 0, liveobj = 0;
+            long freeobj, liveobj;
             char buf[256];
-            Jim_Obj *objPtr;
 
-            /* Count the number of free objects. */
-            objPtr = interp->freeList;
-            while (objPtr) {
-                freeobj++;
-                objPtr = objPtr->nextObjPtr;
-            }
-            /* Count the number of live objects. */
-            objPtr = interp->liveList;
-            while (objPtr) {
-                liveobj++;
-                objPtr = objPtr->nextObjPtr;
-            }
+            JimCountObjects(interp, &freeobj, &liveobj);
             /* Set the result string and return. */
-            sprintf(buf, "free %d used %d", freeobj, liveobj);
+            sprintf(buf, "free %ld used %ld", freeobj, liveobj);
             Jim_SetResultString(interp, buf, -1);
             return JIM_OK;
         }
@@ -14103,6 +16504,14 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
             }
 #endif
 
+#ifdef JIM_COMPACT_OBJ
+            JIM_NOTUSED(objPtr);
+            JIM_NOTUSED(listObjPtr);
+            JIM_NOTUSED(subListObjPtr);
+            JIM_NOTUSED(tainted);
+            Jim_SetResultString(interp, "live objects are not tracked in this build", -1);
+            return JIM_ERR;
+#else
             /* Return a list of the objects */
             listObjPtr = Jim_NewListObj(interp, NULL, 0);
             for (objPtr = interp->liveList; objPtr; objPtr = objPtr->nextObjPtr) {
@@ -14123,6 +16532,21 @@ static int Jim_DebugCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *ar
             }
             Jim_SetResult(interp, listObjPtr);
             return JIM_OK;
+#endif
+        }
+
+        case OPT_OBJSTATS:{
+            Jim_Obj *statsObjPtr = Jim_NewListObj(interp, NULL, 0);
+            Jim_Obj *objStatsObjPtr = Jim_NewListObj(interp, NULL, 0);
+            long freeobj, liveobj;
+
+            JimCountObjects(interp, &freeobj, &liveobj);
+            JimListAppendStat(interp, objStatsObjPtr, "used", liveobj);
+            JimListAppendStat(interp, objStatsObjPtr, "free", freeobj);
+            Jim_ListAppendElement(interp, statsObjPtr, Jim_NewStringObj(interp, "objects", -1));
+            Jim_ListAppendElement(interp, statsObjPtr, objStatsObjPtr);
+            Jim_SetResult(interp, statsObjPtr);
+            return JIM_OK;
         }
 
         case OPT_INVSTR:{
@@ -14696,54 +17120,420 @@ static int Jim_GlobalCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
     return JIM_OK;
 }
 
+/* A [string map] with at least this many keys caches a table of the keys
+ * in the internal rep of the mapping list, so that at each position of the
+ * string, only the keys that may match there are tried.
+ *
+ * For a case sensitive map, the table is a trie of the keys, so matching at
+ * each position costs at most the length of the longest key, however many
+ * keys share a prefix (e.g. {{name}} or &name; keys).
+ * For -nocase, the keys are grouped by first byte instead, since a char
+ * may match chars with different bytes.
+ */
+#define JIM_STRING_MAP_TABLE_MIN 8
+
+/* A node of the trie. The children of each node are contiguous and sorted by byte */
+typedef struct JimStringMapNode {
+    int child;          /* Index of the first child */
+    int numChildren;
+    int key;            /* Index into 'ele' of the first listed key ending here, or -1 */
+    unsigned char c;    /* The byte leading to this node */
+} JimStringMapNode;
+
+typedef struct JimStringMapTable {
+    int refCount;
+    int nocase;
+    int len;            /* Number of keys and values in 'ele' */
+    Jim_Obj **ele;      /* The keys and values, as in the mapping list */
+    JimStringMapNode *nodes; /* The trie of the keys if case sensitive, otherwise NULL.
+                         * nodes[0] is the root and nodes[first[b]] is the node for byte b, if first[b] > 0 */
+    int *keys;          /* Indexes into 'ele' of the keys, grouped by first byte, in order.
+                         * NULL if every key must be tried at every position */
+    int first[257];     /* The keys that may match at a byte b are
+                         * keys[first[b]] to keys[first[b + 1] - 1] */
+} JimStringMapTable;
+
+static void FreeStringMapInternalRep(Jim_Interp *interp, Jim_Obj *objPtr);
+static void DupStringMapInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr);
+
+static const Jim_ObjType stringMapObjType = {
+    "string-map",
+    FreeStringMapInternalRep,
+    DupStringMapInternalRep,
+    NULL,
+    JIM_TYPE_NONE,
+};
+
+static void JimStringMapTableDecrRef(Jim_Interp *interp, JimStringMapTable *table)
+{
+    if (--table->refCount == 0) {
+        int i;
+        for (i = 0; i < table->len; i++) {
+            Jim_DecrRefCount(interp, table->ele[i]);
+        }
+        Jim_Free(table->ele);
+        Jim_Free(table->nodes);
+        Jim_Free(table->keys);
+        Jim_Free(table);
+    }
+}
+
+static void FreeStringMapInternalRep(Jim_Interp *interp, Jim_Obj *objPtr)
+{
+    JimStringMapTableDecrRef(interp, objPtr->internalRep.ptr);
+}
+
+/* The table is never modified, so it can be shared */
+static void DupStringMapInternalRep(Jim_Interp *interp, Jim_Obj *srcPtr, Jim_Obj *dupPtr)
+{
+    JimStringMapTable *table = srcPtr->internalRep.ptr;
+
+    JIM_NOTUSED(interp);
+    table->refCount++;
+    dupPtr->internalRep.ptr = table;
+    dupPtr->typePtr = &stringMapObjType;
+}
+
+typedef struct JimStringMapKey {
+    const char *k;
+    int kl;
+    int index;          /* Index into 'ele' */
+} JimStringMapKey;
+
+/* Sorts keys by bytes, with a key before any key it is a prefix of, then by index */
+static int JimStringMapKeyCompare(const void *a, const void *b)
+{
+    const JimStringMapKey *ka = a;
+    const JimStringMapKey *kb = b;
+    int ret = memcmp(ka->k, kb->k, ka->kl < kb->kl ? ka->kl : kb->kl);
+
+    if (ret == 0) {
+        ret = ka->kl != kb->kl ? ka->kl - kb->kl : ka->index - kb->index;
+    }
+    return ret;
+}
+
+/* Builds the trie of the (non-empty) keys in table->ele */
+static void JimBuildStringMapTrie(JimStringMapTable *table)
+{
+    JimStringMapKey *sorted = Jim_Alloc((table->len / 2 + 1) * sizeof(*sorted));
+    int *lo, *hi, *depths;
+    int numKeys = 0;
+    int numNodes = 1;
+    int maxNodes = 1;
+    int i;
+
+    for (i = 0; i < table->len; i += 2) {
+        sorted[numKeys].k = Jim_GetString(table->ele[i], &sorted[numKeys].kl);
+        sorted[numKeys].index = i;
+        if (sorted[numKeys].kl) {
+            /* Each byte of a key adds at most one node */
+            maxNodes += sorted[numKeys++].kl;
+        }
+    }
+    qsort(sorted, numKeys, sizeof(*sorted), JimStringMapKeyCompare);
+
+    /* The keys under node n, which all share the first 'depth' bytes, are sorted[lo[n]] to sorted[hi[n] - 1].
+     * The nodes are created breadth first so that the children of each node are contiguous and sorted.
+     */
+    table->nodes = Jim_Alloc(maxNodes * sizeof(*table->nodes));
+    lo = Jim_Alloc(maxNodes * sizeof(*lo));
+    hi = Jim_Alloc(maxNodes * sizeof(*hi));
+    depths = Jim_Alloc(maxNodes * sizeof(*depths));
+    table->nodes[0].c = 0;
+    lo[0] = 0;
+    hi[0] = numKeys;
+    depths[0] = 0;
+    memset(table->first, 0, sizeof(table->first));
+
+    for (i = 0; i < numNodes; i++) {
+        JimStringMapNode *node = &table->nodes[i];
+        int depth = depths[i];
+        int l = lo[i];
+
+        node->key = -1;
+        if (l < hi[i] && sorted[l].kl == depth) {
+            /* Any keys ending here come first, and the first of those is listed first */
+            node->key = sorted[l].index;
+            while (l < hi[i] && sorted[l].kl == depth) {
+                l++;
+            }
+        }
+        node->child = numNodes;
+        node->numChildren = 0;
+        while (l < hi[i]) {
+            unsigned char c = sorted[l].k[depth];
+            JimStringMapNode *child = &table->nodes[numNodes];
+
+            child->c = c;
+            depths[numNodes] = depth + 1;
+            lo[numNodes] = l;
+            while (l < hi[i] && UCHAR(sorted[l].k[depth]) == c) {
+                l++;
+            }
+            hi[numNodes] = l;
+            if (i == 0) {
+                table->first[c] = numNodes;
+            }
+            node->numChildren++;
+            numNodes++;
+        }
+    }
+    Jim_Free(lo);
+    Jim_Free(hi);
+    Jim_Free(depths);
+    Jim_Free(sorted);
+}
+
+/* Returns the index in table->ele of the first listed key that matches at 'str', or -1 if none.
+ * If there is a match, sets *kbl to the byte length of the key.
+ */
+static int JimStringMapTrieMatch(JimStringMapTable *table, const char *str, const char *end, int *kbl)
+{
+    const JimStringMapNode *nodes = table->nodes;
+    int n = table->first[UCHAR(*str)];
+    const char *p = str;
+    int best = -1;
+
+    while (n) {
+        const JimStringMapNode *node = &nodes[n];
+        int l, h;
+
+        p++;
+        if (node->key >= 0 && (best < 0 || node->key < best)) {
+            best = node->key;
+            *kbl = p - str;
+        }
+        if (p == end) {
+            break;
+        }
+        /* Binary search for the child for the next byte */
+        l = node->child;
+        h = node->child + node->numChildren;
+        n = 0;
+        while (l < h) {
+            int m = (l + h) / 2;
+            if (nodes[m].c < UCHAR(*p)) {
+                l = m + 1;
+            }
+            else if (nodes[m].c > UCHAR(*p)) {
+                h = m;
+            }
+            else {
+                n = m;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/* Creates a table for the 'len' keys and values in 'ele' */
+static JimStringMapTable *JimNewStringMapTable(Jim_Obj *const *ele, int len, int nocase)
+{
+    JimStringMapTable *table = Jim_Alloc(sizeof(*table));
+    int fill[256];
+    int i;
+    int b;
+
+    table->refCount = 1;
+    table->nocase = nocase;
+    table->len = len;
+    table->ele = Jim_Alloc(len * sizeof(*table->ele));
+    for (i = 0; i < len; i++) {
+        table->ele[i] = ele[i];
+        Jim_IncrRefCount(ele[i]);
+    }
+    table->nodes = NULL;
+    table->keys = NULL;
+
+    if (!nocase) {
+        JimBuildStringMapTrie(table);
+        return table;
+    }
+
+    /* First count the keys for each first byte in first[b + 1] */
+    memset(table->first, 0, sizeof(table->first));
+    for (i = 0; i < len; i += 2) {
+        int kl;
+        const char *k = Jim_GetString(ele[i], &kl);
+
+        if (kl == 0) {
+            /* An empty key never matches */
+            continue;
+        }
+        b = UCHAR(*k);
+        if (b >= 0x80) {
+            /* A non-ascii char may match chars with a different first byte
+             * (even ascii chars), so every key must be tried.
+             */
+            return table;
+        }
+        else {
+            table->first[toupper(b) + 1]++;
+            if (tolower(b) != toupper(b)) {
+                table->first[tolower(b) + 1]++;
+            }
+        }
+    }
+
+    /* Now convert the counts into offsets and fill in the keys in order */
+    for (b = 0; b < 256; b++) {
+        table->first[b + 1] += table->first[b];
+        fill[b] = table->first[b];
+    }
+    table->keys = Jim_Alloc((table->first[256] + 1) * sizeof(*table->keys));
+    for (i = 0; i < len; i += 2) {
+        int kl;
+        const char *k = Jim_GetString(ele[i], &kl);
+
+        if (kl) {
+            b = UCHAR(*k);
+            table->keys[fill[toupper(b)]++] = i;
+            if (tolower(b) != toupper(b)) {
+                table->keys[fill[tolower(b)]++] = i;
+            }
+        }
+    }
+    return table;
+}
+
+/* Returns the table for the mapping list, converting the list
+ * to the string-map type, which caches the table.
+ * The list must have an even number of elements.
+ */
+static JimStringMapTable *JimGetStringMapTable(Jim_Interp *interp, Jim_Obj *mapListObjPtr, int nocase)
+{
+    JimStringMapTable *table;
+
+    if (mapListObjPtr->typePtr == &stringMapObjType) {
+        table = mapListObjPtr->internalRep.ptr;
+        if (table->nocase == nocase) {
+            return table;
+        }
+        table = JimNewStringMapTable(table->ele, table->len, nocase);
+    }
+    else {
+        Jim_Obj **ele;
+        int len;
+
+        JimListGetElements(interp, mapListObjPtr, &len, &ele);
+        table = JimNewStringMapTable(ele, len, nocase);
+        /* Keep the string rep, since there is no way to regenerate it */
+        Jim_String(mapListObjPtr);
+    }
+    Jim_FreeIntRep(interp, mapListObjPtr);
+    mapListObjPtr->typePtr = &stringMapObjType;
+    mapListObjPtr->internalRep.ptr = table;
+    return table;
+}
+
+/* If the key matches at 'str', returns the byte length of the match
+ * and sets *charLen to the char length. Otherwise returns 0.
+ * 'end' is the end of the string, and 'strLen' is the remaining length in chars.
+ */
+static int JimStringMapMatch(Jim_Interp *interp, const char *str, const char *end, int strLen,
+    Jim_Obj *keyObjPtr, int nocase, int *charLen)
+{
+    int kbl;
+    const char *k = Jim_GetString(keyObjPtr, &kbl);
+    int kl = Jim_Utf8Length(interp, keyObjPtr);
+
+    if (strLen < kl || kl == 0) {
+        return 0;
+    }
+    if (nocase) {
+        if (JimStringCompareUtf8(str, kl, k, kl, nocase) != 0) {
+            return 0;
+        }
+        kbl = utf8_index(str, kl);
+    }
+    else if (end - str < kbl || *str != *k || memcmp(str, k, kbl) != 0) {
+        /* Case sensitive, so only an exact byte match can match */
+        return 0;
+    }
+    *charLen = kl;
+    return kbl;
+}
+
 /* does the [string map] operation. On error NULL is returned,
  * otherwise a new string object with the result, having refcount = 0,
  * is returned. */
 static Jim_Obj *JimStringMap(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
     Jim_Obj *objPtr, int nocase)
 {
-    int numMaps;
-    const char *str, *noMatchStart = NULL;
-    int strLen, i;
+    int numMaps = 0;
+    const char *str, *end, *noMatchStart = NULL;
+    int strLen, byteLen;
     Jim_Obj *resultObjPtr;
+    Jim_Obj **ele = NULL;
+    JimStringMapTable *table = NULL;
 
-    numMaps = Jim_ListLength(interp, mapListObjPtr);
-    if (numMaps % 2) {
-        Jim_SetResultString(interp, "list must contain an even number of elements", -1);
-        return NULL;
-    }
-
-    str = Jim_String(objPtr);
+    str = Jim_GetString(objPtr, &byteLen);
+    end = str + byteLen;
     strLen = Jim_Utf8Length(interp, objPtr);
 
+    if (mapListObjPtr->typePtr == &stringMapObjType) {
+        table = JimGetStringMapTable(interp, mapListObjPtr, nocase);
+    }
+    else {
+        numMaps = Jim_ListLength(interp, mapListObjPtr);
+        if (numMaps % 2) {
+            Jim_SetResultString(interp, "list must contain an even number of elements", -1);
+            return NULL;
+        }
+        if (numMaps >= JIM_STRING_MAP_TABLE_MIN * 2) {
+            table = JimGetStringMapTable(interp, mapListObjPtr, nocase);
+        }
+        else {
+            JimListGetElements(interp, mapListObjPtr, &numMaps, &ele);
+        }
+    }
+    if (table) {
+        /* Hold on to the table in case mapListObjPtr changes type */
+        table->refCount++;
+        numMaps = table->len;
+        ele = table->ele;
+    }
+
     /* Map it */
     resultObjPtr = Jim_NewStringObj(interp, "", 0);
     while (strLen) {
-        for (i = 0; i < numMaps; i += 2) {
-            Jim_Obj *eachObjPtr;
-            const char *k;
-            int kl;
-
-            eachObjPtr = Jim_ListGetIndex(interp, mapListObjPtr, i);
-            k = Jim_String(eachObjPtr);
-            kl = Jim_Utf8Length(interp, eachObjPtr);
-
-            if (strLen >= kl && kl) {
-                int rc;
-                rc = JimStringCompareUtf8(str, kl, k, kl, nocase);
-                if (rc == 0) {
-                    if (noMatchStart) {
-                        Jim_AppendString(interp, resultObjPtr, noMatchStart, str - noMatchStart);
-                        noMatchStart = NULL;
-                    }
-                    Jim_AppendObj(interp, resultObjPtr, Jim_ListGetIndex(interp, mapListObjPtr, i + 1));
-                    str += utf8_index(str, kl);
-                    strLen -= kl;
+        const int *keys = NULL;
+        int numKeys = numMaps / 2;
+        int i, j;
+        int kbl = 0, kl;
+
+        if (table && table->nodes) {
+            i = JimStringMapTrieMatch(table, str, end, &kbl);
+            if (i >= 0) {
+                kl = Jim_Utf8Length(interp, ele[i]);
+            }
+        }
+        else {
+            if (table && table->keys && !(nocase && UCHAR(*str) >= 0x80)) {
+                /* Only need to try the keys that can match this byte */
+                keys = table->keys + table->first[UCHAR(*str)];
+                numKeys = table->first[UCHAR(*str) + 1] - table->first[UCHAR(*str)];
+            }
+            for (i = -1, j = 0; j < numKeys; j++) {
+                kbl = JimStringMapMatch(interp, str, end, strLen, ele[keys ? keys[j] : j * 2], nocase, &kl);
+                if (kbl) {
+                    i = keys ? keys[j] : j * 2;
                     break;
                 }
             }
         }
-        if (i == numMaps) {     /* no match */
+        if (i >= 0) {
+            if (noMatchStart) {
+                Jim_AppendString(interp, resultObjPtr, noMatchStart, str - noMatchStart);
+                noMatchStart = NULL;
+            }
+            Jim_AppendObj(interp, resultObjPtr, ele[i + 1]);
+            str += kbl;
+            strLen -= kl;
+        }
+        else {              /* no match */
             int c;
             if (noMatchStart == NULL)
                 noMatchStart = str;
@@ -14754,6 +17544,9 @@ static Jim_Obj *JimStringMap(Jim_Interp *interp, Jim_Obj *mapListObjPtr,
     if (noMatchStart) {
         Jim_AppendString(interp, resultObjPtr, noMatchStart, str - noMatchStart);
     }
+    if (table) {
+        JimStringMapTableDecrRef(interp, table);
+    }
     return resultObjPtr;
 }
 
@@ -14833,11 +17626,13 @@ static int Jim_StringCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *a
 
     switch (option) {
         case OPT_LENGTH:
-            Jim_SetResultInt(interp, Jim_Utf8Length(interp, argv[2]));
-            return JIM_OK;
-
         case OPT_BYTELENGTH:
-            Jim_SetResultInt(interp, Jim_Length(argv[2]));
+            if (argv[2]->typePtr == &ropeObjType) {
+                JimSetResultInt(interp, JimRopeLength(interp, argv[2], option == OPT_LENGTH));
+            }
+            else {
+                JimSetResultInt(interp, option == OPT_LENGTH ? Jim_Utf8Length(interp, argv[2]) : Jim_Length(argv[2]));
+            }
             return JIM_OK;
 
         case OPT_CAT:{
@@ -14903,6 +17698,7 @@ badcompareargs:
                     int l1 = Jim_Utf8Length(interp, argv[0]);
                     const char *s2 = Jim_String(argv[1]);
                     int l2 = Jim_Utf8Length(interp, argv[1]);
+                    int ascii = l1 == Jim_Length(argv[0]) && l2 == Jim_Length(argv[1]);
                     if (opt_length >= 0) {
                         if (l1 > opt_length) {
                             l1 = opt_length;
@@ -14911,7 +17707,12 @@ badcompareargs:
                             l2 = opt_length;
                         }
                     }
-                    n = JimStringCompareUtf8(s1, l1, s2, l2, !opt_case);
+                    if (ascii && opt_case) {
+                        n = JimStringCompareAscii(s1, l1, s2, l2);
+                    }
+                    else {
+                        n = JimStringCompareUtf8(s1, l1, s2, l2, !opt_case);
+                    }
                     Jim_SetResultInt(interp, option == OPT_COMPARE ? n : n == 0);
                 }
                 return JIM_OK;
@@ -15039,7 +17840,7 @@ badcompareargs:
                 }
                 else {
                     int c;
-                    int i = utf8_index(str, idx);
+                    int i = JimStringUtf8Index(argv[2], idx);
                     Jim_SetResultString(interp, str + i, utf8_tounicode(str + i, &c));
                 }
                 return JIM_OK;
@@ -15067,14 +17868,26 @@ badcompareargs:
                     idx = l2;
                 }
                 if (option == OPT_FIRST) {
-                    Jim_SetResultInt(interp, JimStringFirst(s1, l1, s2, l2, idx));
+                    if (l2 == Jim_Length(argv[3])) {
+                        /* The haystack is pure ascii */
+                        Jim_SetResultInt(interp, JimStringFirstAscii(s1, Jim_Length(argv[2]), s2, l2, idx));
+                    }
+                    else {
+                        Jim_SetResultInt(interp, JimStringFirst(s1, l1, s2, l2, idx));
+                    }
                 }
                 else {
+                    if (idx > l2) {
+                        idx = l2;
+                    }
 #ifdef JIM_UTF8
-                    Jim_SetResultInt(interp, JimStringLastUtf8(s1, l1, s2, idx));
-#else
-                    Jim_SetResultInt(interp, JimStringLast(s1, l1, s2, idx));
+                    if (l2 != Jim_Length(argv[3])) {
+                        Jim_SetResultInt(interp, JimStringLastUtf8(s1, l1, s2, Jim_Length(argv[3]), idx));
+                        return JIM_OK;
+                    }
 #endif
+                    /* The haystack is pure ascii */
+                    Jim_SetResultInt(interp, JimStringLast(s1, Jim_Length(argv[2]), s2, l2, idx));
                 }
                 return JIM_OK;
             }
@@ -15540,7 +18353,7 @@ static int Jim_CollectCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *
 
     /* Free all the freed objects. */
     while (interp->freeList) {
-        Jim_Obj *nextObjPtr = interp->freeList->nextObjPtr;
+        Jim_Obj *nextObjPtr = JimNextFreeObj(interp->freeList);
         Jim_Free(interp->freeList);
         interp->freeList = nextObjPtr;
     }
@@ -15652,26 +18465,38 @@ int Jim_DictSize(Jim_Interp *interp, Jim_Obj *objPtr)
  */
 Jim_Obj *Jim_DictMerge(Jim_Interp *interp, int objc, Jim_Obj *const *objv)
 {
-    Jim_Obj *objPtr = Jim_NewDictObj(interp, NULL, 0);
+    Jim_Obj *objPtr;
     int i;
+    int size = 0;
 
     JimPanic((objc == 0, "Jim_DictMerge called with objc=0"));
 
     /* Note that we don't optimise the trivial case of a single argument */
 
+    /* Validate all the arguments first, and size the result for the case
+     * where the keys don't overlap.
+     */
     for (i = 0; i < objc; i++) {
-        Jim_Obj **table;
         int tablelen;
-        int j;
 
         /* If the object is a list, avoid converting to a dictionary as
          * we may mishandle duplicate keys
          */
-        table = Jim_DictPairs(interp, objv[i], &tablelen);
-        if (tablelen && !table) {
-            Jim_FreeNewObj(interp, objPtr);
+        if (Jim_DictPairs(interp, objv[i], &tablelen) == NULL && tablelen) {
             return NULL;
         }
+        size += tablelen / 2;
+    }
+
+    objPtr = Jim_NewDictObj(interp, NULL, 0);
+    JimDictReserve(objPtr->internalRep.dictValue, size);
+
+    for (i = 0; i < objc; i++) {
+        Jim_Obj **table;
+        int tablelen;
+        int j;
+
+        table = Jim_DictPairs(interp, objv[i], &tablelen);
         for (j = 0; j < tablelen; j += 2) {
             DictAddElement(interp, objPtr, table[j], table[j + 1]);
         }
@@ -15692,7 +18517,13 @@ int Jim_DictInfo(Jim_Interp *interp, Jim_Obj *objPtr)
     dict = objPtr->internalRep.dictValue;
 
     /* Note that this uses internal knowledge of the hash table */
-    snprintf(buffer, sizeof(buffer), "%d entries in table, %d buckets", dict->len, dict->size);
+    if (dict->oldht) {
+        snprintf(buffer, sizeof(buffer), "%d entries in table, %d buckets, rehashing %u/%u",
+            dict->len, dict->size, dict->rehashidx, dict->oldsize);
+    }
+    else {
+        snprintf(buffer, sizeof(buffer), "%d entries in table, %d buckets", dict->len, dict->size);
+    }
     output = Jim_NewStringObj(interp, buffer, -1);
     Jim_SetResult(interp, output);
     return JIM_OK;
@@ -15782,6 +18613,7 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
         OPT_KEYS,
         OPT_SIZE,
         OPT_INFO,
+        OPT_COMPACT,
         OPT_MERGE,
         OPT_WITH,
         OPT_APPEND,
@@ -15795,7 +18627,7 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
         OPT_COUNT
     };
     static const jim_subcmd_type cmds[OPT_COUNT + 1] = {
-        JIM_DEF_SUBCMD("create", "?key value ...?", 0, -2),
+        JIM_DEF_SUBCMD("create", "?-size n? ?key value ...?", 0, -2),
         JIM_DEF_SUBCMD("get", "dictionary ?key ...?", 1, -1),
         JIM_DEF_SUBCMD_HIDDEN("getdef", "dictionary ?key ...? key default", 3, -1),
         JIM_DEF_SUBCMD("getwithdefault", "dictionary ?key ...? key default", 3, -1),
@@ -15805,6 +18637,7 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
         JIM_DEF_SUBCMD("keys", "dictionary ?pattern?", 1, 2),
         JIM_DEF_SUBCMD("size", "dictionary", 1, 1),
         JIM_DEF_SUBCMD("info", "dictionary", 1, 1),
+        JIM_DEF_SUBCMD("compact", "dictionary", 1, 1),
         JIM_DEF_SUBCMD("merge", "?...?", 0, -1),
         JIM_DEF_SUBCMD("with", "dictVar ?key ...? script", 2, -1),
         JIM_DEF_SUBCMD("append", "varName key ?value ...?", 2, -1),
@@ -15895,6 +18728,22 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
             return JIM_OK;
 
         case OPT_CREATE:
+            if (argc >= 4 && Jim_CompareStringImmediate(interp, argv[2], "-size")) {
+                /* dict create -size n ?key value ...? */
+                long size;
+
+                if (Jim_GetLong(interp, argv[3], &size) != JIM_OK || size < 0 || size > INT_MAX) {
+                    Jim_SetResultFormatted(interp, "bad size \"%#s\"", argv[3]);
+                    return JIM_ERR;
+                }
+                objPtr = Jim_NewDictObj(interp, NULL, 0);
+                JimDictReserve(objPtr->internalRep.dictValue, size);
+                for (argc -= 4, argv += 4; argc > 0; argc -= 2, argv += 2) {
+                    DictAddElement(interp, objPtr, argv[0], argv[1]);
+                }
+                Jim_SetResult(interp, objPtr);
+                return JIM_OK;
+            }
             objPtr = Jim_NewDictObj(interp, argv + 2, argc - 2);
             Jim_SetResult(interp, objPtr);
             return JIM_OK;
@@ -15902,6 +18751,14 @@ static int Jim_DictCoreCommand(Jim_Interp *interp, int argc, Jim_Obj *const *arg
         case OPT_INFO:
             return Jim_DictInfo(interp, argv[2]);
 
+        case OPT_COMPACT:
+            /* This doesn't change the value, so it is fine even if the object is shared */
+            if (SetDictFromAny(interp, argv[2]) != JIM_OK) {
+                return JIM_ERR;
+            }
+            JimDictCompact(argv[2]->internalRep.dictValue);
+            return JIM_OK;
+
         case OPT_WITH:
             return JimDictWith(interp, argv[2], argv + 3, argc - 4, argv[argc - 1]);
 
@@ -202,13 +202,14 @@ typedef struct Jim_Stack {
  * Hash table
  * ---------------------------------------------------------------------------*/
 
+/* Entries are stored in a table in insertion order, along with the hash of the key */
 typedef struct Jim_HashEntry {
     void *key;
     union {
         void *val;
         int intval;
     } u;
-    struct Jim_HashEntry *next;
+    unsigned int hash;
 } Jim_HashEntry;
 
 typedef struct Jim_HashTableType {
@@ -220,8 +221,17 @@ typedef struct Jim_HashTableType {
     void (*valDestructor)(void *privdata, void *obj);
 } Jim_HashTableType;
 
+/* The hash table uses the same approach as Jim_Dict, with an open addressed
+ * index of offsets into a table of entries. Entries are not individually
+ * allocated, and iteration (e.g. info locals, info commands) walks the dense
+ * entries table in insertion order, independent of the hash seed.
+ */
 typedef struct Jim_HashTable {
-    Jim_HashEntry **table;
+    Jim_HashEntry *table;       /* Entries table. Removed entries have a NULL key */
+    struct Jim_HashIndex {
+        int offset;             /* 1 + offset into 'table'. 0 if empty, -1 if removed */
+        unsigned int hash;
+    } *index;                   /* Allocated index of size 'size' */
     const Jim_HashTableType *type;
     void *privdata;
     unsigned int size;
@@ -229,11 +239,14 @@ typedef struct Jim_HashTable {
     unsigned int used;
     unsigned int collisions;
     unsigned int uniq;
+    unsigned int len;           /* Number of entries in 'table', including removed entries */
+    struct Jim_HashIndex *oldindex; /* If not NULL, an incremental rehash from this index is in progress */
+    unsigned int oldsize;       /* Size of 'oldindex' */
+    unsigned int rehashidx;     /* The next slot in 'oldindex' to move to 'index' */
 } Jim_HashTable;
 
 typedef struct Jim_HashTableIterator {
     Jim_HashTable *ht;
-    Jim_HashEntry *entry, *nextEntry;
     int index;
 } Jim_HashTableIterator;
 
@@ -306,12 +319,18 @@ typedef struct Jim_HashTableIterator {
  *
  * The refcount of a freed object is always -1.
  * ---------------------------------------------------------------------------*/
+#ifdef JIM_INLINE_STRINGS
+/* Size of the string representation buffer within each object */
+#define JIM_OBJ_INLINE_BYTES 16
+#endif
+
 typedef struct Jim_Obj {
     char *bytes; /* string representation buffer. NULL = no string repr. */
     const struct Jim_ObjType *typePtr; /* object type. */
     int refCount; /* reference count */
     int length; /* number of bytes in 'bytes', not including the null term. */
     unsigned taint;  /* If this object is tainted */
+    unsigned hash;  /* Cached hash of the string rep, or 0 if not known. Reset when the string rep changes */
     /* Internal representation union */
     union {
         /* integer number type */
@@ -338,6 +357,7 @@ typedef struct Jim_Obj {
             struct Jim_VarVal *vv;
             unsigned long callFrameId; /* for caching */
             int global; /* If the variable name is globally scoped with :: */
+            int slot; /* Compiled local variable slot, or -1 */
         } varValue;
         /* Command object */
         struct {
@@ -349,7 +369,8 @@ typedef struct Jim_Obj {
         struct {
             struct Jim_Obj **ele;    /* Elements vector */
             int len;        /* Length */
-            int maxLen;        /* Allocated 'ele' length */
+            int maxLen;        /* Allocated 'ele' length, or the offset into 'spine' */
+            struct Jim_ListSpine *spine; /* If not NULL, elements are held here instead of 'ele' */
         } listValue;
         /* dict object */
         struct Jim_Dict *dictValue;
@@ -357,6 +378,7 @@ typedef struct Jim_Obj {
         struct {
             int maxLength;
             int charLength;     /* utf-8 char length. -1 if unknown */
+            struct Jim_Utf8Index *utf8Index; /* Sparse char to byte offset index, or NULL */
         } strValue;
         /* Reference type */
         struct {
@@ -378,11 +400,19 @@ typedef struct Jim_Obj {
             int argc;
         } scriptLineValue;
     } internalRep;
+#ifdef JIM_INLINE_STRINGS
+    /* Short string representations (less than JIM_OBJ_INLINE_BYTES, including
+     * the null terminator) are stored here, rather than separately allocated.
+     * This adds 16 bytes to every object. */
+    char inlineBytes[JIM_OBJ_INLINE_BYTES];
+#endif
+#ifndef JIM_COMPACT_OBJ
     /* These fields add 8 or 16 bytes more for every object
      * but this is required for efficient garbage collection
      * of Jim references. */
     struct Jim_Obj *prevObjPtr; /* pointer to the prev object. */
     struct Jim_Obj *nextObjPtr; /* pointer to the next object. */
+#endif
 } Jim_Obj;
 
 /* Jim_Obj related macros */
@@ -475,6 +505,9 @@ typedef struct Jim_CallFrame {
     Jim_Stack *localCommands; /* commands to be destroyed when the call frame is destroyed */
     struct Jim_Obj *tailcallObj;  /* Pending tailcall invocation */
     struct Jim_Cmd *tailcallCmd;  /* Resolved command for pending tailcall invocation */
+    struct Jim_ProcLocals *procLocals; /* Compiled local variable names, or NULL */
+    struct Jim_VarVal **locals; /* Compiled local variables, indexed by slot */
+    int localsSize; /* Allocated length of locals */
 } Jim_CallFrame;
 
 /* Evaluation frame */
@@ -512,17 +545,16 @@ typedef void Jim_DelCmdProc(struct Jim_Interp *interp, void *privData);
  * This preserves order when adding and replacing elements.
  */
 typedef struct Jim_Dict {
-    struct JimDictHashEntry {
-        int offset;
-        unsigned hash;
-    } *ht;		        /* Allocated hash table of size 'size' */
+    struct Jim_HashIndex *ht;   /* Allocated hash table of size 'size' */
     unsigned int size;          /* Size of the hash table (0 or power of two) */
     unsigned int sizemask;      /* mask to apply to hash to index into offsets table */
-    unsigned int uniq;          /* unique value to add to hash generator */
     Jim_Obj **table;            /* Table of alternating key, value elements */
     int len;                    /* Number of used elements in table */
     int maxLen;                 /* Allocated length of table */
-    unsigned int dummy;         /* Number of dummy entries */
+    unsigned int dummy;         /* Number of dummy entries in 'ht' */
+    struct Jim_HashIndex *oldht; /* If not NULL, an incremental rehash from this table is in progress */
+    unsigned int oldsize;       /* Size of 'oldht' */
+    unsigned int rehashidx;     /* The next entry in 'oldht' to move to 'ht' */
 } Jim_Dict;
 
 #define JIM_CMD_ISPROC 1
@@ -568,6 +600,7 @@ typedef struct Jim_Cmd {
                 Jim_Obj *defaultObjPtr; /* Default value, (or rename for $args) */
             } *arglist;
             Jim_Obj *nsObj;             /* Namespace for this proc */
+            struct Jim_ProcLocals *locals; /* Compiled local variable names, or NULL if not yet known */
         } proc;
     } u;
 } Jim_Cmd;
@@ -609,13 +642,15 @@ typedef struct Jim_Interp {
     int local; /* If 'local' is in effect, newly defined procs keep a reference to the old defn */
     int quitting; /* Set to 1 during Jim_FreeInterp() */
     int safeexpr; /* Set when evaluating a "safe" expression, no var subst or command eval */
-    Jim_Obj *liveList; /* Linked list of all the live objects. */
+    Jim_Obj *liveList; /* Linked list of all the live objects. Not used with JIM_COMPACT_OBJ */
+    long liveCount; /* Number of live objects. Only used with JIM_COMPACT_OBJ */
     Jim_Obj *freeList; /* Linked list of all the unused objects. */
     Jim_EvalFrame topEvalFrame;  /* dummy top evaluation frame */
     Jim_EvalFrame *evalFrame;  /* evaluation stack */
     int procLevel;
     Jim_Obj *nullScriptObj; /* script representation of an empty string */
     Jim_Obj *emptyObj; /* Shared empty string object. */
+    Jim_Obj **intCache; /* Shared small int objects, created on demand */
     Jim_Obj *trueObj; /* Shared true int object. */
     Jim_Obj *falseObj; /* Shared false int object. */
     unsigned long referenceNextId; /* Next id for reference. */
@@ -865,6 +900,13 @@ JIM_EXPORT void Jim_AppendObj (Jim_Interp *interp, Jim_Obj *objPtr,
 /** Append a NULL-terminated list of C strings to an object. */
 JIM_EXPORT void Jim_AppendStrings (Jim_Interp *interp,
         Jim_Obj *objPtr, ...);
+/** Callback for Jim_StringForeachChunk(). Return JIM_OK to continue. */
+typedef int Jim_StringChunkProc(Jim_Interp *interp, void *privData,
+        const char *str, int len);
+/** Pass an object's string representation to chunkProc in order, piece by piece,
+ *  without flattening it first. Returns the first result other than JIM_OK, or JIM_OK. */
+JIM_EXPORT int Jim_StringForeachChunk (Jim_Interp *interp, Jim_Obj *objPtr,
+        Jim_StringChunkProc *chunkProc, void *privData);
 /** Compare two objects for string equality. */
 JIM_EXPORT int Jim_StringEqObj(Jim_Obj *aObjPtr, Jim_Obj *bObjPtr);
 /** Match an object string against a pattern object. */
@@ -1080,6 +1122,8 @@ JIM_EXPORT int Jim_DictSize(Jim_Interp *interp, Jim_Obj *objPtr);
 JIM_EXPORT int Jim_DictInfo(Jim_Interp *interp, Jim_Obj *objPtr);
 /** Merge multiple dictionaries and return the merged dictionary object. */
 JIM_EXPORT Jim_Obj *Jim_DictMerge(Jim_Interp *interp, int objc, Jim_Obj *const *objv);
+/** Pre-size a dictionary object to hold at least size keys without growing. */
+JIM_EXPORT int Jim_DictReserve(Jim_Interp *interp, Jim_Obj *objPtr, int size);
 
 /* return code object */
 /** Extract a return code integer from an object. */